@@ -0,0 +1,324 @@
+#define _DEFAULT_SOURCE
+
+#include "batch.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Run of the program on a single input */
+typedef struct {
+  const char *  fname;                    /* Input file */
+  char *        out;                      /* Output, NULL if out of memory */
+  size_t        outlen;
+  char *        err;                      /* Error messages */
+  size_t        errlen;
+  bool          done;                     /* Whether the run completed */
+} job_t;
+
+/* State shared by the worker threads */
+typedef struct {
+  const risc_image_t *image;
+  int           memsz;
+  int64_t       budget;
+  int           flags;                    /* Flags for RISC_Create */
+  job_t *       jobs;
+  int           njobs;
+  int           next;                     /* Next job to be taken up */
+  pthread_mutex_t lock;                   /* Guards next and job_t.done */
+  pthread_cond_t  done;                   /* Signalled as jobs complete */
+} batch_t;
+
+/* Prototypes */
+static void         Batch(const risc_image_t * const, char * const * const,
+                          const int, const int, const int64_t, const int,
+                          int);
+static void *       Work(void *);
+static void         Run(const batch_t * const, job_t * const);
+
+void
+Batch_Run(const risc_image_t * const image, char * const * const inputs,
+          const int n, const int memsz, const int64_t budget, const int flags)
+{
+  long          ncpu;
+
+  /* One worker per core */
+  ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  Batch(image, inputs, n, memsz, budget, flags,
+        ncpu < 1 ? 1 : ncpu > kMaxWorkers ? kMaxWorkers : (int)ncpu);
+}
+
+/* Runs the program over the inputs on up to the given no. of workers, doing
+ * the work in the calling thread if none can be started
+ */
+static void
+Batch(const risc_image_t * const image, char * const * const inputs,
+      const int n, const int memsz, const int64_t budget, const int flags,
+      int nworkers)
+{
+  pthread_t     workers[kMaxWorkers];
+  batch_t       b;
+  job_t *       job;
+  int           i;
+
+  assert(image);
+  assert(inputs || !n);
+  assert(nworkers >= 0 && nworkers <= kMaxWorkers);
+
+  b.memsz = memsz ? memsz : RISC_MemSize(image);
+  if ((long long)image->sb * 4 + image->varsize + image->strsz
+      > b.memsz) {
+    fprintf(stderr, "Program does not fit in %d bytes of memory\n", b.memsz);
+    return;
+  }
+  if (!(b.jobs = calloc(n ? n : 1, sizeof(*b.jobs)))) {
+    fprintf(stderr, "Out of memory\n");
+    return;
+  }
+  for (i = 0; i != n; ++i) {
+    b.jobs[i].fname = inputs[i];
+  }
+  b.image = image;
+  b.budget = budget;
+  b.flags = flags;
+  b.njobs = n;
+  b.next = 0;
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_cond_init(&b.done, NULL);
+
+  /* Start no more workers than there are inputs */
+  if (nworkers > n) {
+    nworkers = n;
+  }
+  for (i = 0; i != nworkers; ++i) {
+    if (pthread_create(workers + i, NULL, Work, &b)) {
+      break;
+    }
+  }
+  nworkers = i;
+  if (!nworkers) {
+    /* Do all the work ourselves instead */
+    Work(&b);
+  }
+
+  /* Write the results in order, as soon as they are available */
+  fflush(stdout);
+  for (i = 0; i != n; ++i) {
+    job = b.jobs + i;
+    pthread_mutex_lock(&b.lock);
+    while (!job->done) {
+      pthread_cond_wait(&b.done, &b.lock);
+    }
+    pthread_mutex_unlock(&b.lock);
+
+    if (!job->out) {
+      fprintf(stderr, "%s:\nOut of memory\n", job->fname);
+      continue;
+    }
+    fwrite(job->out, 1, job->outlen, stdout);
+    if (job->errlen) {
+      fflush(stdout);
+      fprintf(stderr, "%s:\n", job->fname);
+      fwrite(job->err, 1, job->errlen, stderr);
+    }
+    free(job->out);
+    free(job->err);
+  }
+  fflush(stdout);
+
+  for (i = 0; i != nworkers; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+  pthread_cond_destroy(&b.done);
+  pthread_mutex_destroy(&b.lock);
+  free(b.jobs);
+}
+
+/* Takes up jobs until none are left */
+static void *
+Work(void *arg)
+{
+  batch_t * const b = arg;
+  int           i;
+
+  for (;;) {
+    pthread_mutex_lock(&b->lock);
+    i = b->next != b->njobs ? b->next++ : -1;
+    pthread_mutex_unlock(&b->lock);
+    if (i < 0) {
+      return NULL;
+    }
+
+    Run(b, b->jobs + i);
+
+    pthread_mutex_lock(&b->lock);
+    b->jobs[i].done = true;
+    pthread_cond_broadcast(&b->done);
+    pthread_mutex_unlock(&b->lock);
+  }
+}
+
+/* Runs the program on the input of a single job, collecting its output and
+ * error messages in memory
+ */
+static void
+Run(const batch_t * const b, job_t * const job)
+{
+  risc_vm_t *   vm;
+  FILE *        out;
+  FILE *        err;
+  int           fd;
+
+  if (!(out = open_memstream(&job->out, &job->outlen))) {
+    job->out = NULL;
+    return;
+  }
+  if (!(err = open_memstream(&job->err, &job->errlen))) {
+    fclose(out);
+    free(job->out);
+    job->out = NULL;
+    return;
+  }
+
+  if ((fd = open(job->fname, O_RDONLY)) < 0) {
+    fprintf(err, "Cannot read %s\n", job->fname);
+  } else if (!(vm = RISC_Create(b->image, b->memsz, b->budget, b->flags))) {
+    fprintf(err, "Out of memory\n");
+  } else {
+    RISC_Redirect(vm, fd, out, err);
+    while (RISC_Run(vm, INT_MAX) == kRiscPreempted) {
+      /* Keep going */
+    }
+    RISC_Destroy(vm);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  fclose(out);
+  fclose(err);
+}
+
+#ifdef TEST
+
+#include <string.h>
+
+#include "minunit.h"
+
+/* Instruction encodings (cf. the tests in risc.c) */
+#define F1(op, a, b, im) ((int32_t)((((a) + 0x40) << 24) | ((b) << 20)      \
+                         | ((op) << 16) | ((im) & 0xFFFF)                   \
+                         | ((im) < 0 ? kInsnV : 0)))
+#define F2(op, a, b, off) ((int32_t)(((uint32_t)(op) << 28) | ((a) << 24)   \
+                          | ((b) << 20) | ((off) & 0xFFFF)))
+#define F3(op, cond, off) ((int32_t)(((uint32_t)(op) + 12) << 28            \
+                          | ((cond) << 24) | ((off) & 0xFFFFFF)))
+
+enum {
+  kTestInputs = 6,              /* No. of inputs, the last one missing */
+  kTestOutput = 0x100           /* Max. size of the output captured */
+};
+
+/* Read(R0); Write(R0) */
+static const int32_t  g_test_echo[] = {
+  0,
+  F1(kOpMov, 1, 0, -1),
+  F2(kOpLdr, 0, 1, 0),
+  F2(kOpStr, 0, 1, 0),
+  F3(kOpBr, kCondTrue, kRegLNK)
+};
+
+/* Runs Batch over the inputs, capturing what it writes to stdout and stderr
+ * in out and err. Returns false if they cannot be redirected.
+ */
+static bool
+Capture(const risc_image_t * const image, char * const * const inputs,
+        const int nworkers, char * const out, char * const err)
+{
+  FILE *        fp[2];
+  char *        buf[2];
+  int           saved[2];
+  size_t        len;
+  int           i;
+
+  buf[0] = out;
+  buf[1] = err;
+  fflush(stdout);
+  fflush(stderr);
+  for (i = 0; i != 2; ++i) {
+    if (!(fp[i] = tmpfile())) {
+      return false;
+    }
+    saved[i] = dup(i + 1);
+    dup2(fileno(fp[i]), i + 1);
+  }
+  Batch(image, inputs, kTestInputs, 0, 0, 0, nworkers);
+  fflush(stdout);
+  fflush(stderr);
+  for (i = 0; i != 2; ++i) {
+    dup2(saved[i], i + 1);
+    close(saved[i]);
+    rewind(fp[i]);
+    len = fread(buf[i], 1, kTestOutput - 1, fp[i]);
+    buf[i][len] = '\0';
+    fclose(fp[i]);
+  }
+  return true;
+}
+
+/* Checks that output comes out in the order of the inputs, whatever the no.
+ * of workers, including none at all (as if none could be started), and that
+ * unreadable inputs are reported under their names
+ */
+char *
+TestBatch(void)
+{
+  static const risc_image_t image = { g_test_echo, 5, 0, 0, 1 };
+  static const int  nworkers[] = { 0, 1, 2, kMaxWorkers };
+  risc_image_t      big;
+  char              names[kTestInputs][16];
+  char *            inputs[kTestInputs];
+  char              out[kTestOutput];
+  char              err[kTestOutput];
+  char              expected[kTestOutput];
+  size_t            i;
+  int               fd;
+  int               n;
+
+  for (i = 0; i != kTestInputs; ++i) {
+    strcpy(names[i], "/tmp/ocXXXXXX");
+    ASSERT_TRUE((fd = mkstemp(names[i])) >= 0);
+    n = sprintf(expected, "%d\n", (int)(i + 1) * 11);
+    ASSERT_EQ(n, write(fd, expected, n));
+    close(fd);
+    inputs[i] = names[i];
+  }
+  remove(names[kTestInputs - 1]);
+
+  for (i = 0; i != sizeof(nworkers) / sizeof(nworkers[0]); ++i) {
+    ASSERT_TRUE(Capture(&image, inputs, nworkers[i], out, err));
+    ASSERT_EQ(0, strcmp("1122334455", out));
+    sprintf(expected, "%s:\nCannot read %s\n", inputs[kTestInputs - 1],
+            inputs[kTestInputs - 1]);
+    ASSERT_EQ(0, strcmp(expected, err));
+  }
+
+  /* Sizes adding up to more than INT_MAX, as a crafted image may have */
+  big = image;
+  big.varsize = big.strsz = kMemMax;
+  ASSERT_TRUE(Capture(&big, inputs, 1, out, err));
+  ASSERT_EQ(0, strcmp("", out));
+  sprintf(expected, "Program does not fit in %d bytes of memory\n", kMemMax);
+  ASSERT_EQ(0, strcmp(expected, err));
+
+  for (i = 0; i != kTestInputs - 1; ++i) {
+    remove(names[i]);
+  }
+  return NULL;
+}
+
+#endif /* TEST */
@@ -0,0 +1,23 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <stdint.h>
+
+#include "risc.h"
+
+/* A compiled program can be run once for every file in a list of inputs, read
+ * as its standard input. The runs are spread over a pool of worker threads,
+ * one per core (at most kMaxWorkers), each running its program on a VM of its
+ * own. Output is collected in memory per run and written to stdout in the
+ * order of the inputs, as soon as all runs before it have completed. Error
+ * messages go to stderr, headed by the name of the input.
+ */
+
+enum {
+  kMaxWorkers = 64              /* Max. no. of worker threads */
+};
+
+extern void    Batch_Run(const risc_image_t * const, char * const * const,
+                         const int, const int, const int64_t, const int);
+
+#endif /* BATCH_H_ */
@@ -0,0 +1,420 @@
+#define _DEFAULT_SOURCE
+
+#include "cache.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+enum {
+  kPathLen  = 4096,             /* Max. length of a path in the cache */
+  kBufSz    = 0x1000            /* Chunk size for reading the source */
+};
+
+/* Image in the cache, as considered for eviction */
+typedef struct {
+  char          name[32];       /* Key, followed by ".img" */
+  time_t        mtime;          /* Last use */
+  off_t         size;           /* Size in bytes */
+} entry_t;
+
+/* Prototypes */
+static const char * Dir(void);
+static bool         Path(char * const, const char * const, const char * const);
+static uint64_t     Hash(uint64_t, const void * const, const size_t);
+static void         Count(const bool);
+static bool         ReadStats(unsigned long * const, unsigned long * const);
+static entry_t *    Scan(int * const, long long * const);
+static void         Evict(void);
+static int          CompareEntries(const void *, const void *);
+
+/* Included in every key, so that a new compiler does not reuse images made by
+ * an older one. To be changed whenever the generated code does.
+ */
+static const char * g_version = "oc 6";
+
+/* Private state */
+static char         g_key[17];  /* Key of the last lookup, in hexadecimal */
+
+/* Looks up the image for the source file fname, compiled with opts. Returns
+ * false on a miss, in which case the key is remembered for Cache_Add.
+ */
+bool
+Cache_Find(const char * const fname, const int opts, risc_image_t * const image)
+{
+  char          buf[kBufSz];
+  char          path[kPathLen];
+  FILE *        fp;
+  uint64_t      h;
+  size_t        n;
+
+  assert(fname);
+  assert(image);
+
+  g_key[0] = '\0';
+  if (!Dir() || !(fp = fopen(fname, "rb"))) {
+    return false;
+  }
+
+  /* FNV-1a over the compiler version, the options and the source text */
+  h = Hash(UINT64_C(0xCBF29CE484222325), g_version, strlen(g_version));
+  h = Hash(h, &opts, sizeof(opts));
+  while ((n = fread(buf, 1, sizeof(buf), fp))) {
+    h = Hash(h, buf, n);
+  }
+  if (ferror(fp)) {
+    fclose(fp);
+    return false;
+  }
+  fclose(fp);
+  sprintf(g_key, "%016llx", (unsigned long long)h);
+
+  if (Path(path, g_key, ".img") && RISC_Open(image, path)) {
+    /* Mark as recently used */
+    utimes(path, NULL);
+    Count(true);
+    return true;
+  }
+  Count(false);
+  return false;
+}
+
+/* Stores image under the key of the last missed lookup */
+void
+Cache_Add(const risc_image_t * const image)
+{
+  char          path[kPathLen];
+  char          tmp[kPathLen];
+  char          name[32];
+
+  assert(image);
+
+  if (!g_key[0]) {
+    return;
+  }
+
+  /* Write to a file of our own first, then move it into place */
+  sprintf(name, ".%s.%ld", g_key, (long)getpid());
+  if (!Path(path, g_key, ".img") || !Path(tmp, name, "")) {
+    return;
+  }
+  if (!RISC_Save(image, tmp) || rename(tmp, path)) {
+    remove(tmp);
+    return;
+  }
+  g_key[0] = '\0';
+  Evict();
+}
+
+/* Prints the number of hits and misses, and the images in the cache */
+void
+Cache_Report(void)
+{
+  unsigned long hits;
+  unsigned long misses;
+  entry_t *     entries;
+  int           n;
+  long long     total;
+
+  if (!Dir()) {
+    fprintf(stderr, "Cache disabled (set OC_CACHE)\n");
+    return;
+  }
+  if (!ReadStats(&hits, &misses)) {
+    hits = misses = 0;
+  }
+  entries = Scan(&n, &total);
+  free(entries);
+  fprintf(stderr, "Cache %s: %lu hits, %lu misses, %d images (%lld bytes)\n",
+          Dir(), hits, misses, n, total);
+}
+
+/* Returns the cache directory, creating it if need be, or NULL if none */
+static const char *
+Dir(void)
+{
+  const char *  dir;
+
+  if (!(dir = getenv("OC_CACHE")) || !*dir) {
+    return NULL;
+  }
+  mkdir(dir, 0777);
+  return dir;
+}
+
+/* Sets path to the file name followed by suffix in the cache directory */
+static bool
+Path(char * const path, const char * const name, const char * const suffix)
+{
+  const char *  dir;
+  int           n;
+
+  if (!(dir = Dir())) {
+    return false;
+  }
+  n = snprintf(path, kPathLen, "%s/%s%s", dir, name, suffix);
+  return n > 0 && n < kPathLen;
+}
+
+static uint64_t
+Hash(uint64_t h, const void * const data, const size_t len)
+{
+  const unsigned char * p;
+  size_t        i;
+
+  p = data;
+  for (i = 0; i != len; ++i) {
+    h = (h ^ p[i]) * UINT64_C(0x100000001B3);
+  }
+  return h;
+}
+
+/* Records a hit or a miss. Updates by concurrent runs may get lost. */
+static void
+Count(const bool hit)
+{
+  char          path[kPathLen];
+  char          tmp[kPathLen];
+  char          name[32];
+  unsigned long hits;
+  unsigned long misses;
+  FILE *        fp;
+
+  if (!ReadStats(&hits, &misses)) {
+    hits = misses = 0;
+  }
+  if (hit) {
+    ++hits;
+  } else {
+    ++misses;
+  }
+
+  sprintf(name, ".stats.%ld", (long)getpid());
+  if (!Path(path, "stats", "") || !Path(tmp, name, "")
+      || !(fp = fopen(tmp, "w"))) {
+    return;
+  }
+  fprintf(fp, "%lu %lu\n", hits, misses);
+  if (fclose(fp) || rename(tmp, path)) {
+    remove(tmp);
+  }
+}
+
+static bool
+ReadStats(unsigned long * const hits, unsigned long * const misses)
+{
+  char          path[kPathLen];
+  FILE *        fp;
+  bool          ok;
+
+  if (!Path(path, "stats", "") || !(fp = fopen(path, "r"))) {
+    return false;
+  }
+  ok = fscanf(fp, "%lu %lu", hits, misses) == 2;
+  fclose(fp);
+  return ok;
+}
+
+/* Lists the images in the cache, along with their total size. The result is
+ * to be freed by the caller.
+ */
+static entry_t *
+Scan(int * const n, long long * const total)
+{
+  char          path[kPathLen];
+  DIR *         dp;
+  struct dirent *de;
+  struct stat   st;
+  entry_t *     entries;
+  entry_t *     p;
+  int           cap;
+  size_t        len;
+
+  *n = 0;
+  *total = 0;
+  entries = NULL;
+  if (!(dp = opendir(Dir()))) {
+    return NULL;
+  }
+  cap = 0;
+  while ((de = readdir(dp))) {
+    len = strlen(de->d_name);
+    if (de->d_name[0] == '.' || len < 4 || len >= sizeof(p->name)
+        || strcmp(de->d_name + len - 4, ".img")
+        || !Path(path, de->d_name, "") || stat(path, &st)) {
+      continue;
+    }
+    if (*n == cap) {
+      cap = cap ? 2 * cap : 64;
+      if (!(p = realloc(entries, cap * sizeof(*entries)))) {
+        break;
+      }
+      entries = p;
+    }
+    p = entries + (*n)++;
+    strcpy(p->name, de->d_name);
+    p->mtime = st.st_mtime;
+    p->size = st.st_size;
+    *total += st.st_size;
+  }
+  closedir(dp);
+  return entries;
+}
+
+/* Removes the least recently used images until the cache fits its bound */
+static void
+Evict(void)
+{
+  char          path[kPathLen];
+  const char *  s;
+  entry_t *     entries;
+  long long     total;
+  long long     max;
+  int           n;
+  int           i;
+
+  max = (s = getenv("OC_CACHE_SIZE")) ? atoll(s) : kCacheSz;
+  entries = Scan(&n, &total);
+  if (total > max) {
+    qsort(entries, n, sizeof(*entries), CompareEntries);
+    for (i = 0; i != n && total > max; ++i) {
+      if (Path(path, entries[i].name, "") && !remove(path)) {
+        total -= entries[i].size;
+      }
+    }
+  }
+  free(entries);
+}
+
+/* Orders entries from least to most recently used */
+static int
+CompareEntries(const void *x, const void *y)
+{
+  const entry_t * const a = x;
+  const entry_t * const b = y;
+
+  return (a->mtime > b->mtime) - (a->mtime < b->mtime);
+}
+
+#ifdef TEST
+
+#include "minunit.h"
+
+/* R0 := 1 */
+static const int32_t  g_test_code[] = {
+  0,
+  (int32_t)((0x40 << 24) | (kOpMov << 16) | 1),
+  (int32_t)(((uint32_t)kOpBr + 12) << 28 | (kCondTrue << 24) | kRegLNK)
+};
+
+/* Checks misses and hits, keys that depend on the options and the compiler
+ * version, and the eviction of the least recently used images
+ */
+char *
+TestCache(void)
+{
+  static const risc_image_t image = { g_test_code, 3, 0, 0, 1 };
+  static const char * const sources[] = { "a.mod", "b.mod", "c.mod" };
+  const char *      version;
+  char              dir[] = "/tmp/ocXXXXXX";
+  char              path[kPathLen];
+  char              size[32];
+  struct timeval    times[2];
+  risc_image_t      copy;
+  entry_t *         entries;
+  unsigned long     hits;
+  unsigned long     misses;
+  long long         total;
+  FILE *            fp;
+  int               n;
+  int               i;
+
+  ASSERT_NOT_NULL(mkdtemp(dir));
+  ASSERT_EQ(0, setenv("OC_CACHE", dir, 1));
+  unsetenv("OC_CACHE_SIZE");
+  for (i = 0; i != 3; ++i) {
+    sprintf(path, "%s/%s", dir, sources[i]);
+    ASSERT_NOT_NULL(fp = fopen(path, "w"));
+    fprintf(fp, "MODULE %c; END %c.\n", 'a' + i, 'a' + i);
+    fclose(fp);
+  }
+
+  /* Miss, add, hit */
+  sprintf(path, "%s/%s", dir, sources[0]);
+  ASSERT_FALSE(Cache_Find(path, 0, &copy));
+  Cache_Add(&image);
+  ASSERT_TRUE(Cache_Find(path, 0, &copy));
+  ASSERT_EQ(image.sb, copy.sb);
+  ASSERT_EQ(0, memcmp(image.code, copy.code, image.sb * 4));
+  RISC_Close(&copy);
+
+  /* Different options or compiler, different image */
+  ASSERT_FALSE(Cache_Find(path, 1, &copy));
+  version = g_version;
+  g_version = "oc test";
+  ASSERT_FALSE(Cache_Find(path, 0, &copy));
+  g_version = version;
+  ASSERT_TRUE(Cache_Find(path, 0, &copy));
+  RISC_Close(&copy);
+  ASSERT_TRUE(ReadStats(&hits, &misses));
+  ASSERT_EQ(2, hits);
+  ASSERT_EQ(3, misses);
+
+  /* Age both images, then use the first: the second is the one evicted */
+  sprintf(path, "%s/%s", dir, sources[1]);
+  ASSERT_FALSE(Cache_Find(path, 0, &copy));
+  Cache_Add(&image);
+  entries = Scan(&n, &total);
+  ASSERT_EQ(2, n);
+  times[0].tv_sec = times[1].tv_sec = 1000000000;
+  times[0].tv_usec = times[1].tv_usec = 0;
+  for (i = 0; i != n; ++i) {
+    ASSERT_TRUE(Path(path, entries[i].name, ""));
+    ASSERT_EQ(0, utimes(path, times));
+  }
+  free(entries);
+  sprintf(path, "%s/%s", dir, sources[0]);
+  ASSERT_TRUE(Cache_Find(path, 0, &copy));
+  RISC_Close(&copy);
+  sprintf(size, "%lld", total);
+  ASSERT_EQ(0, setenv("OC_CACHE_SIZE", size, 1));
+  sprintf(path, "%s/%s", dir, sources[2]);
+  ASSERT_FALSE(Cache_Find(path, 0, &copy));
+  Cache_Add(&image);
+  free(Scan(&n, &total));
+  ASSERT_EQ(2, n);
+  for (i = 0; i != 3; ++i) {
+    sprintf(path, "%s/%s", dir, sources[i]);
+    ASSERT_EQ(i != 1, Cache_Find(path, 0, &copy));
+    if (i != 1) {
+      RISC_Close(&copy);
+    }
+  }
+
+  /* Clean up */
+  entries = Scan(&n, &total);
+  for (i = 0; i != n; ++i) {
+    if (Path(path, entries[i].name, "")) {
+      remove(path);
+    }
+  }
+  free(entries);
+  for (i = 0; i != 3; ++i) {
+    sprintf(path, "%s/%s", dir, sources[i]);
+    remove(path);
+  }
+  sprintf(path, "%s/stats", dir);
+  remove(path);
+  ASSERT_EQ(0, rmdir(dir));
+  unsetenv("OC_CACHE");
+  unsetenv("OC_CACHE_SIZE");
+  return NULL;
+}
+
+#endif /* TEST */
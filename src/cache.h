@@ -0,0 +1,26 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stdbool.h>
+
+#include "risc.h"
+
+/* Compiled images can be kept in a cache directory, named by the environment
+ * variable OC_CACHE, so that unchanged modules need not be compiled again.
+ * Images are keyed by a hash of the source text, the compiler version and
+ * those options that affect code generation. A new image is written to a
+ * temporary file first and then renamed, so concurrent runs never see a
+ * partial one. Once the images take up more than OC_CACHE_SIZE bytes (by
+ * default kCacheSz), the least recently used ones are removed.
+ */
+
+enum {
+  kCacheSz = 0x4000000          /* Default bound on the cache size (64 MiB) */
+};
+
+extern bool    Cache_Find(const char * const, const int,
+                          risc_image_t * const);
+extern void    Cache_Add(const risc_image_t * const);
+extern void    Cache_Report(void);
+
+#endif /* CACHE_H_ */
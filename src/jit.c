@@ -0,0 +1,842 @@
+/* Just-in-time translation of RISC-0 code to x86-64; see jit.h. */
+
+/* For MAP_ANONYMOUS */
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __x86_64__
+
+#include <sys/mman.h>
+
+enum {
+  /* x86-64 registers. The lower three bits are encoded in ModRM or SIB bytes,
+   * the fourth one in the REX prefix.
+   */
+  kRax = 0,   kRcx = 1,   kRdx = 2,   kRbx = 3,
+  kRsp = 4,   kRbp = 5,   kRsi = 6,   kRdi = 7,
+  kR12 = 12,  kR13 = 13,  kR14 = 14,  kR15 = 15,
+
+  /* Register assignment. All are callee-saved in the System V ABI. RAX, RCX
+   * and RDX are used as scratch registers.
+   */
+  kCpu   = kRbx,                /* jit_cpu_t *                               */
+  kSteps = kRbp,                /* cpu->steps                                */
+  kMem   = kR12,                /* Memory image                              */
+  kRes   = kR13,                /* cpu->res                                  */
+  kV     = kR14,                /* cpu->v                                    */
+  kAddr  = kR15,                /* Native code addresses (jit->addr)         */
+
+  /* Condition codes, for use with Jcc and SETcc */
+  kCcO  = 0x0,                  /* Overflow                                  */
+  kCcAE = 0x3,                  /* Above or equal (unsigned)                 */
+  kCcE  = 0x4,                  /* Equal                                     */
+  kCcNE = 0x5,                  /* Not equal                                 */
+  kCcS  = 0x8,                  /* Sign                                      */
+  kCcNS = 0x9,                  /* No sign                                   */
+
+  /* Opcodes. Two-byte opcodes hold the 0x0F escape in their upper byte. */
+  kX86OrB   = 0x08,             /* OR r/m8, r8                               */
+  kX86Add   = 0x03,             /* ADD r, r/m                                */
+  kX86Or    = 0x0B,             /* OR r, r/m                                 */
+  kX86And   = 0x23,             /* AND r, r/m                                */
+  kX86Sub   = 0x2B,             /* SUB r, r/m                                */
+  kX86Xor   = 0x33,             /* XOR r, r/m                                */
+  kX86Cmp   = 0x3B,             /* CMP r, r/m                                */
+  kX86Movsx = 0x63,             /* MOVSXD r64, r/m32                         */
+  kX86Grp1  = 0x81,             /* ADD (/0), AND (/4), CMP (/7) r/m, imm32   */
+  kX86Test  = 0x85,             /* TEST r/m, r                               */
+  kX86Store = 0x89,             /* MOV r/m, r                                */
+  kX86Load  = 0x8B,             /* MOV r, r/m                                */
+  kX86Lea   = 0x8D,             /* LEA r, m                                  */
+  kX86Cdq   = 0x99,             /* CDQ                                       */
+  kX86Shi   = 0xC1,             /* SHL (/4), SHR (/5) r/m, imm8              */
+  kX86MovI  = 0xC7,             /* MOV r/m, imm32 (/0)                       */
+  kX86Shc   = 0xD3,             /* ROR (/1), SHL (/4), SAR (/7) r/m, CL      */
+  kX86Jmp   = 0xE9,             /* JMP rel32                                 */
+  kX86Grp3  = 0xF7,             /* NOT (/2), IDIV (/7) r/m                   */
+  kX86Grp5  = 0xFF,             /* DEC (/1), JMP (/4) r/m                    */
+  kX86Cmovs = 0x0F48,           /* CMOVS r, r/m                              */
+  kX86Jcc   = 0x0F80,           /* Jcc rel32                                 */
+  kX86Setcc = 0x0F90,           /* SETcc r/m8                                */
+  kX86Imul  = 0x0FAF,           /* IMUL r, r/m                               */
+  kX86Movzx = 0x0FB6,           /* MOVZX r, r/m8                             */
+
+  /* Upper bounds on the number of bytes of native code per code word, both
+   * for the translation itself and its exit stubs.
+   */
+  kHotSz  = 128,
+  kColdSz = 96,
+
+  /* Bytes reserved for entering and leaving native code */
+  kGlueSz = 128
+};
+
+/* Output buffer for native code */
+typedef struct {
+  uint8_t *     p;              /* Next free byte                            */
+  uint8_t *     end;            /* End of buffer                             */
+} code_t;
+
+/* Translation state */
+typedef struct {
+  jit_t *       jit;
+  code_t        hot;            /* Translated instructions                   */
+  code_t        cold;           /* Exit stubs                                */
+  uint8_t *     epilogue;       /* Common path for leaving native code       */
+  uint8_t **    patch;          /* Branch to a code address, per insn        */
+  int *         target;         /* Code address branched to, per insn        */
+} xlate_t;
+
+/* Entry point of native code */
+typedef int (*entry_t)(jit_cpu_t *, int32_t *, uint8_t **, uint8_t *);
+
+/* Prototypes */
+static void     Glue(xlate_t * const);
+static void     Translate(xlate_t * const, const int);
+static void     Register(xlate_t * const, const int);
+static void     Memory(xlate_t * const, const int);
+static void     Branch(xlate_t * const, const int);
+static int      CondFalse(code_t * const, const int, uint8_t **);
+static void     Next(xlate_t * const, const int);
+static uint8_t *Exit(xlate_t * const, const int, const int, const int);
+static uint8_t *ExitDyn(xlate_t * const, const int, const int);
+static void     Byte(code_t * const, const int);
+static void     Imm32(code_t * const, const int32_t);
+static void     Rex(code_t * const, const int, const int, const int,
+                    const int);
+static void     OpR(code_t * const, const int, const int, const int,
+                    const int);
+static void     OpM(code_t * const, const int, const int, const int,
+                    const int, const int, const int, const int32_t);
+static void     Load(code_t * const, const int, const int);
+static void     Store(code_t * const, const int, const int);
+static void     MovImm(code_t * const, const int, const int32_t);
+static uint8_t *Jcc(code_t * const, const int);
+static uint8_t *Jmp(code_t * const);
+static void     Patch(uint8_t * const, const uint8_t * const);
+
+bool
+JIT_Translate(jit_t * const jit, int32_t * const mem, const int sb,
+              const int memsz)
+{
+  xlate_t       x;
+  int           i;
+  void *        buf;
+
+  assert(jit && mem);
+  assert(0 < sb && sb <= kMaxCode && sb * 4 <= memsz);
+
+  jit->mem = mem;
+  jit->sb = sb;
+  jit->memsz = memsz;
+  jit->len = kGlueSz + (size_t)sb * (kHotSz + kColdSz);
+  jit->len = (jit->len + 0xFFF) & ~(size_t)0xFFF;
+  jit->buf = NULL;
+  jit->addr = malloc(sb * sizeof(*jit->addr));
+  x.patch = malloc(sb * sizeof(*x.patch));
+  x.target = malloc(sb * sizeof(*x.target));
+  buf = mmap(NULL, jit->len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED || !jit->addr || !x.patch || !x.target) {
+    if (buf != MAP_FAILED) {
+      munmap(buf, jit->len);
+    }
+    free(x.patch);
+    free(x.target);
+    JIT_Free(jit);
+    return false;
+  }
+  jit->buf = buf;
+
+  /* Translations first, followed by all exit stubs */
+  x.jit = jit;
+  x.hot.p = jit->buf;
+  x.hot.end = jit->buf + kGlueSz + (size_t)sb * kHotSz;
+  x.cold.p = x.hot.end;
+  x.cold.end = jit->buf + jit->len;
+  Glue(&x);
+  for (i = 0; i != sb; ++i) {
+    jit->addr[i] = x.hot.p;
+    x.patch[i] = NULL;
+    Translate(&x, i);
+    assert(x.hot.p <= x.hot.end && x.cold.p <= x.cold.end);
+  }
+
+  /* Resolve branches to code addresses */
+  for (i = 0; i != sb; ++i) {
+    if (x.patch[i]) {
+      Patch(x.patch[i], jit->addr[x.target[i]]);
+    }
+  }
+  free(x.patch);
+  free(x.target);
+
+  /* Make the buffer executable, while no longer writable */
+  if (mprotect(jit->buf, jit->len, PROT_READ | PROT_EXEC)) {
+    JIT_Free(jit);
+    return false;
+  }
+  return true;
+}
+
+int
+JIT_Run(jit_t * const jit, jit_cpu_t * const cpu)
+{
+  entry_t       entry;
+
+  assert(jit && cpu);
+  assert(cpu->steps > 0);
+
+  if (cpu->pc < 0 || cpu->pc >= jit->sb) {
+    return kJitStep;
+  }
+
+  /* ISO C does not define casts from object- to function pointers */
+  memcpy(&entry, &jit->buf, sizeof(entry));
+  return entry(cpu, jit->mem, jit->addr, jit->addr[cpu->pc]);
+}
+
+void
+JIT_Free(jit_t * const jit)
+{
+  assert(jit);
+
+  if (jit->buf) {
+    munmap(jit->buf, jit->len);
+    jit->buf = NULL;
+  }
+  free(jit->addr);
+  jit->addr = NULL;
+}
+
+/* Emits the code for entering native code, found at the start of the buffer,
+ * and for leaving it again, shared by all exit stubs. On entry, the arguments
+ * (cpu, mem, addr, target) are passed in RDI, RSI, RDX and RCX. On exit, RAX
+ * holds the reason.
+ */
+static void
+Glue(xlate_t * const x)
+{
+  static const uint8_t  push[] = {
+    0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57
+  };
+  static const uint8_t  pop[] = {
+    0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3
+  };
+  code_t * const        c = &x->hot;
+  size_t                i;
+
+  /* PUSH RBX, RBP, R12-R15 */
+  for (i = 0; i != sizeof(push); ++i) {
+    Byte(c, push[i]);
+  }
+  OpR(c, 1, kX86Load, kCpu, kRdi);
+  OpR(c, 1, kX86Load, kMem, kRsi);
+  OpR(c, 1, kX86Load, kAddr, kRdx);
+  OpM(c, 1, kX86Load, kRes, kCpu, -1, 0, offsetof(jit_cpu_t, res));
+  OpM(c, 0, kX86Load, kV, kCpu, -1, 0, offsetof(jit_cpu_t, v));
+  OpM(c, 0, kX86Load, kSteps, kCpu, -1, 0, offsetof(jit_cpu_t, steps));
+  OpR(c, 0, kX86Grp5, 4, kRcx);
+
+  x->epilogue = c->p;
+  OpM(c, 1, kX86Store, kRes, kCpu, -1, 0, offsetof(jit_cpu_t, res));
+  OpM(c, 0, kX86Store, kV, kCpu, -1, 0, offsetof(jit_cpu_t, v));
+  OpM(c, 0, kX86Store, kSteps, kCpu, -1, 0, offsetof(jit_cpu_t, steps));
+
+  /* POP R15-R12, RBP, RBX; RET */
+  for (i = 0; i != sizeof(pop); ++i) {
+    Byte(c, pop[i]);
+  }
+  assert(c->p <= x->jit->buf + kGlueSz);
+}
+
+/* Translates the instruction at code address i */
+static void
+Translate(xlate_t * const x, const int i)
+{
+  int32_t       ir;
+
+  ir = x->jit->mem[i];
+  if (!(ir & kInsnMsb)) {
+    /* Register instruction (F0, F1) */
+    if (((ir >> 16) & 0xF) > kOpDiv) {
+      /* Unrecognized opcode; left for the interpreter to report */
+      Patch(Jmp(&x->hot), Exit(x, kJitStep, i, i));
+    } else {
+      Register(x, i);
+      Next(x, i);
+    }
+  } else if (!(ir & kInsnQ)) {
+    /* Memory instruction (F2) */
+    Memory(x, i);
+    Next(x, i);
+  } else {
+    /* Branch instruction (F3) */
+    Branch(x, i);
+  }
+}
+
+static void
+Register(xlate_t * const x, const int i)
+{
+  code_t * const  c = &x->hot;
+  int32_t         ir;
+  int32_t         im;
+  int             op;
+
+  ir = x->jit->mem[i];
+  op = (ir >> 16) & 0xF;
+
+  /* Second operand n in ECX */
+  if (ir & kInsnQ) {
+    im = ir & 0xFFFF;
+    if (ir & kInsnV) {
+      im = (int32_t)((uint32_t)im | 0xFFFF0000);
+    }
+    if (op == kOpMov && (ir & kInsnU)) {
+      im = (int32_t)((uint32_t)im << 16);
+    }
+    MovImm(c, kRcx, im);
+  } else {
+    Load(c, kRcx, ir & 0xF);
+  }
+
+  /* First operand R.b in EAX, result likewise */
+  Load(c, kRax, (ir >> 20) & 0xF);
+  switch (op) {
+  case kOpMov:
+    if ((ir & (kInsnQ | kInsnU)) != kInsnU) {
+      /* R.a := n */
+      OpR(c, 0, kX86Load, kRax, kRcx);
+    } else if (ir & kInsnV) {
+      /* R.a := [N, Z, C, V] */
+      OpR(c, 0, kX86Xor, kRax, kRax);
+      OpR(c, 0, kX86Xor, kRcx, kRcx);
+      OpR(c, 1, kX86Test, kRes, kRes);
+      OpR(c, 0, kX86Setcc + kCcS, 0, kRax);
+      OpR(c, 0, kX86Setcc + kCcE, 0, kRcx);
+      OpR(c, 0, kX86Shi, 4, kRax);
+      Byte(c, 3);
+      OpR(c, 0, kX86Shi, 4, kRcx);
+      Byte(c, 2);
+      OpR(c, 0, kX86Or, kRax, kRcx);
+      OpR(c, 0, kX86Or, kRax, kV);
+    } else {
+      /* R.a := H */
+      OpM(c, 0, kX86Load, kRax, kCpu, -1, 0, offsetof(jit_cpu_t, h));
+    }
+    break;
+  case kOpLsl: OpR(c, 0, kX86Shc, 4, kRax);        break;
+  case kOpAsr: OpR(c, 0, kX86Shc, 7, kRax);        break;
+  case kOpRor: OpR(c, 0, kX86Shc, 1, kRax);        break;
+  case kOpAnd: OpR(c, 0, kX86And, kRax, kRcx);     break;
+  case kOpAnn:
+    OpR(c, 0, kX86Grp3, 2, kRcx);
+    OpR(c, 0, kX86And, kRax, kRcx);
+    break;
+  case kOpIor: OpR(c, 0, kX86Or, kRax, kRcx);      break;
+  case kOpXor: OpR(c, 0, kX86Xor, kRax, kRcx);     break;
+  case kOpAdd:
+    OpR(c, 0, kX86Add, kRax, kRcx);
+    OpR(c, 0, kX86Setcc + kCcO, 0, kV);
+    break;
+  case kOpSub:
+    OpR(c, 0, kX86Sub, kRax, kRcx);
+    OpR(c, 0, kX86Setcc + kCcO, 0, kV);
+    break;
+  case kOpMul:
+    /* H := upper half of the 64-bit product */
+    OpR(c, 1, kX86Movsx, kRax, kRax);
+    OpR(c, 1, kX86Movsx, kRcx, kRcx);
+    OpR(c, 1, kX86Imul, kRax, kRcx);
+    OpR(c, 1, kX86Load, kRdx, kRax);
+    OpR(c, 1, kX86Shi, 5, kRdx);
+    Byte(c, 32);
+    OpM(c, 0, kX86Store, kRdx, kCpu, -1, 0, offsetof(jit_cpu_t, h));
+    break;
+  case kOpDiv:
+    /* H := remainder */
+    Byte(c, kX86Cdq);
+    OpR(c, 0, kX86Grp3, 7, kRcx);
+    OpM(c, 0, kX86Store, kRdx, kCpu, -1, 0, offsetof(jit_cpu_t, h));
+    break;
+  default:
+    assert(0);
+  }
+
+  /* Store the result, and record it for the N and Z flags. As in the
+   * interpreter, the result of ROR counts as unsigned.
+   */
+  Store(c, (ir >> 24) & 0xF, kRax);
+  if (op == kOpRor) {
+    OpR(c, 0, kX86Load, kRes, kRax);
+  } else {
+    OpR(c, 1, kX86Movsx, kRes, kRax);
+  }
+}
+
+static void
+Memory(xlate_t * const x, const int i)
+{
+  code_t * const  c = &x->hot;
+  uint8_t *       step;
+  int32_t         ir;
+  int             a;
+  int             sb;
+
+  ir = x->jit->mem[i];
+  a = (ir >> 24) & 0xF;
+  sb = x->jit->sb;
+  step = Exit(x, kJitStep, i, i);
+
+  /* Address in EAX */
+  Load(c, kRax, (ir >> 20) & 0xF);
+  OpR(c, 0, kX86Grp1, 0, kRax);
+  Imm32(c, ir & 0xFFFFF);
+
+  if (!(ir & kInsnU)) {
+    /* Load, leaving I/O ports to the interpreter */
+    OpR(c, 0, kX86Grp1, 7, kRax);
+    Imm32(c, x->jit->memsz);
+    Patch(Jcc(c, kCcAE), step);
+    if (ir & kInsnV) {
+      OpM(c, 0, kX86Movzx, kRax, kMem, kRax, 0, 0);
+    } else {
+      OpR(c, 0, kX86Grp1, 4, kRax);
+      Imm32(c, ~3);
+      OpM(c, 0, kX86Load, kRax, kMem, kRax, 0, 0);
+    }
+    Store(c, a, kRax);
+    OpR(c, 1, kX86Movsx, kRes, kRax);
+  } else {
+    /* Store, leaving I/O ports and the code region to the interpreter */
+    OpM(c, 0, kX86Lea, kRcx, kRax, -1, 0, -4 * sb);
+    OpR(c, 0, kX86Grp1, 7, kRcx);
+    Imm32(c, x->jit->memsz - 4 * sb);
+    Patch(Jcc(c, kCcAE), step);
+    if (ir & kInsnV) {
+      /* Bytes are OR'ed into memory, as in the interpreter */
+      OpM(c, 0, kX86Movzx, kRcx, kCpu, -1, 0, 4 * a);
+      OpM(c, 0, kX86OrB, kRcx, kMem, kRax, 0, 0);
+    } else {
+      OpR(c, 0, kX86Grp1, 4, kRax);
+      Imm32(c, ~3);
+      Load(c, kRcx, a);
+      OpM(c, 0, kX86Store, kRcx, kMem, kRax, 0, 0);
+    }
+  }
+}
+
+static void
+Branch(xlate_t * const x, const int i)
+{
+  code_t * const  c = &x->hot;
+  uint8_t *       fall[2];    /* Jumps taken if the condition is false */
+  int             nfall;
+  int32_t         ir;
+  int             sb;
+  int             t;          /* Target code address (u = 1) */
+
+  ir = x->jit->mem[i];
+  sb = x->jit->sb;
+
+  nfall = CondFalse(c, (ir >> 24) & 0xF, fall);
+  if (nfall >= 0) {
+    if (ir & kInsnV) {
+      /* Store return address in LNK register */
+      OpM(c, 0, kX86MovI, 0, kCpu, -1, 0,
+          offsetof(jit_cpu_t, reg) + 4 * kRegLNK);
+      Imm32(c, (i + 1) * 4);
+    }
+    if (ir & kInsnU) {
+      /* Offset, sign-extended from 24 bits */
+      t = i + 1 + (((ir & 0xFFFFFF) ^ 0x800000) - 0x800000);
+      if (t <= 0 || t >= sb) {
+        Patch(Jmp(c), Exit(x, kJitHalt, t, i));
+      } else {
+        OpR(c, 0, kX86Grp5, 1, kSteps);
+        Patch(Jcc(c, kCcE), Exit(x, kJitLimit, t, i));
+        x->patch[i] = Jmp(c);
+        x->target[i] = t;
+      }
+    } else {
+      /* PC := R.c / 4, rounding towards zero */
+      Load(c, kRax, ir & 0xF);
+      OpM(c, 0, kX86Lea, kRcx, kRax, -1, 0, 3);
+      OpR(c, 0, kX86Test, kRax, kRax);
+      OpR(c, 0, kX86Cmovs, kRax, kRcx);
+      OpR(c, 0, kX86Shi, 7, kRax);
+      Byte(c, 2);
+
+      /* Leave if PC <= 0 or PC >= sb */
+      OpM(c, 0, kX86Lea, kRcx, kRax, -1, 0, -1);
+      OpR(c, 0, kX86Grp1, 7, kRcx);
+      Imm32(c, sb - 1);
+      Patch(Jcc(c, kCcAE), ExitDyn(x, kJitHalt, i));
+      OpR(c, 0, kX86Grp5, 1, kSteps);
+      Patch(Jcc(c, kCcE), ExitDyn(x, kJitLimit, i));
+
+      /* JMP [R15 + RAX * 8] */
+      OpM(c, 0, kX86Grp5, 4, kAddr, kRax, 3, 0);
+    }
+  }
+
+  /* Condition false */
+  while (nfall > 0) {
+    Patch(fall[--nfall], c->p);
+  }
+  if (((ir >> 24) & 0xF) != kCondTrue) {
+    Next(x, i);
+  }
+}
+
+/* Emits a test of the given condition, jumping if it is false. Returns the
+ * number of jumps to be patched, stored in fall, or -1 if the condition never
+ * holds. As in the interpreter, conditions depending on C are never true.
+ */
+static int
+CondFalse(code_t * const c, const int cond, uint8_t **fall)
+{
+  uint8_t *     taken;
+
+  switch (cond) {
+  case kCondMI:
+  case kCondPL:
+  case kCondEQ:
+  case kCondNE:
+    OpR(c, 1, kX86Test, kRes, kRes);
+    fall[0] = Jcc(c, cond == kCondMI ? kCcNS : cond == kCondPL ? kCcS :
+                     cond == kCondEQ ? kCcNE : kCcE);
+    return 1;
+  case kCondVS:
+  case kCondVC:
+    OpR(c, 0, kX86Test, kV, kV);
+    fall[0] = Jcc(c, cond == kCondVS ? kCcE : kCcNE);
+    return 1;
+  case kCondLT:
+  case kCondGE:
+    /* N != V, resp. N = V */
+    OpR(c, 1, kX86Load, kRax, kRes);
+    OpR(c, 1, kX86Shi, 5, kRax);
+    Byte(c, 63);
+    OpR(c, 0, kX86Cmp, kRax, kV);
+    fall[0] = Jcc(c, cond == kCondLT ? kCcE : kCcNE);
+    return 1;
+  case kCondLE:
+    /* Z or N != V */
+    OpR(c, 1, kX86Test, kRes, kRes);
+    taken = Jcc(c, kCcE);
+    OpR(c, 1, kX86Load, kRax, kRes);
+    OpR(c, 1, kX86Shi, 5, kRax);
+    Byte(c, 63);
+    OpR(c, 0, kX86Cmp, kRax, kV);
+    fall[0] = Jcc(c, kCcE);
+    Patch(taken, c->p);
+    return 1;
+  case kCondGT:
+    /* ~Z and N = V */
+    OpR(c, 1, kX86Test, kRes, kRes);
+    fall[0] = Jcc(c, kCcE);
+    OpR(c, 1, kX86Load, kRax, kRes);
+    OpR(c, 1, kX86Shi, 5, kRax);
+    Byte(c, 63);
+    OpR(c, 0, kX86Cmp, kRax, kV);
+    fall[1] = Jcc(c, kCcNE);
+    return 2;
+  case kCondTrue:
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+/* Continues with the instruction following i, mirroring NEXT in risc.c */
+static void
+Next(xlate_t * const x, const int i)
+{
+  code_t * const  c = &x->hot;
+
+  if (i + 1 >= x->jit->sb) {
+    Patch(Jmp(c), Exit(x, kJitHalt, i + 1, i));
+  } else {
+    OpR(c, 0, kX86Grp5, 1, kSteps);
+    Patch(Jcc(c, kCcE), Exit(x, kJitLimit, i + 1, i));
+  }
+}
+
+/* Emits an exit stub setting PC := pc, recording ir as the address of the last
+ * executed instruction. Returns its address.
+ */
+static uint8_t *
+Exit(xlate_t * const x, const int reason, const int pc, const int ir)
+{
+  code_t * const  c = &x->cold;
+  uint8_t *       stub;
+
+  stub = c->p;
+  OpM(c, 0, kX86MovI, 0, kCpu, -1, 0, offsetof(jit_cpu_t, pc));
+  Imm32(c, pc);
+  OpM(c, 0, kX86MovI, 0, kCpu, -1, 0, offsetof(jit_cpu_t, ir));
+  Imm32(c, ir);
+  MovImm(c, kRax, reason);
+  Patch(Jmp(c), x->epilogue);
+  return stub;
+}
+
+/* Same as Exit, but taking PC from EAX */
+static uint8_t *
+ExitDyn(xlate_t * const x, const int reason, const int ir)
+{
+  code_t * const  c = &x->cold;
+  uint8_t *       stub;
+
+  stub = c->p;
+  OpM(c, 0, kX86Store, kRax, kCpu, -1, 0, offsetof(jit_cpu_t, pc));
+  OpM(c, 0, kX86MovI, 0, kCpu, -1, 0, offsetof(jit_cpu_t, ir));
+  Imm32(c, ir);
+  MovImm(c, kRax, reason);
+  Patch(Jmp(c), x->epilogue);
+  return stub;
+}
+
+static void
+Byte(code_t * const c, const int b)
+{
+  *c->p++ = b & 0xFF;
+}
+
+static void
+Imm32(code_t * const c, const int32_t imm)
+{
+  /* x86 is little-endian, as is the host */
+  memcpy(c->p, &imm, 4);
+  c->p += 4;
+}
+
+/* Emits a REX prefix if needed, with w selecting 64-bit operands */
+static void
+Rex(code_t * const c, const int w, const int reg, const int index,
+    const int base)
+{
+  int           rex;
+
+  rex = (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+  if (rex) {
+    Byte(c, 0x40 | rex);
+  }
+}
+
+/* Emits an instruction with register operands reg and rm. For opcodes taking
+ * an extension (/digit), pass the latter as reg.
+ */
+static void
+OpR(code_t * const c, const int w, const int op, const int reg, const int rm)
+{
+  Rex(c, w, reg, 0, rm);
+  if (op > 0xFF) {
+    Byte(c, op >> 8);
+  }
+  Byte(c, op);
+  Byte(c, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* Emits an instruction with a register operand reg and a memory operand
+ * [base + index * 2^scale + disp], with index < 0 if absent.
+ */
+static void
+OpM(code_t * const c, const int w, const int op, const int reg,
+    const int base, const int index, const int scale, const int32_t disp)
+{
+  int           mod;
+
+  Rex(c, w, reg, index < 0 ? 0 : index, base);
+  if (op > 0xFF) {
+    Byte(c, op >> 8);
+  }
+  Byte(c, op);
+
+  /* RBP and R13 as base always need a displacement */
+  if (disp == 0 && (base & 7) != kRbp) {
+    mod = 0;
+  } else if (disp >= -128 && disp <= 127) {
+    mod = 1;
+  } else {
+    mod = 2;
+  }
+
+  /* RSP and R12 as base always need a SIB byte */
+  if (index < 0 && (base & 7) != kRsp) {
+    Byte(c, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+  } else {
+    Byte(c, (mod << 6) | ((reg & 7) << 3) | kRsp);
+    Byte(c, (scale << 6) | (((index < 0 ? kRsp : index) & 7) << 3)
+            | (base & 7));
+  }
+  if (mod == 1) {
+    Byte(c, disp);
+  } else if (mod == 2) {
+    Imm32(c, disp);
+  }
+}
+
+/* Loads register r with RISC register a */
+static void
+Load(code_t * const c, const int r, const int a)
+{
+  OpM(c, 0, kX86Load, r, kCpu, -1, 0, offsetof(jit_cpu_t, reg) + 4 * a);
+}
+
+/* Stores register r in RISC register a */
+static void
+Store(code_t * const c, const int a, const int r)
+{
+  OpM(c, 0, kX86Store, r, kCpu, -1, 0, offsetof(jit_cpu_t, reg) + 4 * a);
+}
+
+static void
+MovImm(code_t * const c, const int r, const int32_t imm)
+{
+  OpR(c, 0, kX86MovI, 0, r);
+  Imm32(c, imm);
+}
+
+/* Emits a conditional jump, returning the address of its offset for Patch */
+static uint8_t *
+Jcc(code_t * const c, const int cc)
+{
+  Byte(c, kX86Jcc >> 8);
+  Byte(c, (kX86Jcc & 0xFF) + cc);
+  Imm32(c, 0);
+  return c->p - 4;
+}
+
+/* Emits an unconditional jump, returning the address of its offset */
+static uint8_t *
+Jmp(code_t * const c)
+{
+  Byte(c, kX86Jmp);
+  Imm32(c, 0);
+  return c->p - 4;
+}
+
+/* Sets the offset of a jump at p to the given target address */
+static void
+Patch(uint8_t * const p, const uint8_t * const target)
+{
+  int32_t       off;
+
+  off = (int32_t)(target - (p + 4));
+  memcpy(p, &off, 4);
+}
+
+#else /* __x86_64__ */
+
+/* Other hosts fall back to the interpreter */
+
+bool
+JIT_Translate(jit_t * const jit, int32_t * const mem, const int sb,
+              const int memsz)
+{
+  assert(jit && mem);
+  (void)sb;
+  (void)memsz;
+
+  jit->buf = NULL;
+  return false;
+}
+
+int
+JIT_Run(jit_t * const jit, jit_cpu_t * const cpu)
+{
+  assert(jit && cpu);
+  assert(0);
+  return kJitStep;
+}
+
+void
+JIT_Free(jit_t * const jit)
+{
+  assert(jit);
+  (void)jit;
+}
+
+#endif /* __x86_64__ */
+
+#ifdef TEST
+
+#include "minunit.h"
+
+/* Instruction encodings (cf. Put0, Put1, Put2 and Put3 in org.c) */
+#define F0(op, a, b, c) ((int32_t)(((a) << 24) | ((b) << 20) | ((op) << 16) \
+                        | (c)))
+#define F1(op, a, b, im) ((int32_t)((((a) + 0x40) << 24) | ((b) << 20)      \
+                         | ((op) << 16) | ((im) & 0xFFFF)                   \
+                         | ((im) < 0 ? kInsnV : 0)))
+#define F2(op, a, b, off) ((int32_t)(((uint32_t)(op) << 28) | ((a) << 24)   \
+                          | ((b) << 20) | ((off) & 0xFFFFF)))
+#define F3(op, cond, off) ((int32_t)(((uint32_t)(op) + 12) << 28            \
+                          | ((cond) << 24) | ((off) & 0xFFFFFF)))
+
+static int32_t  g_test_mem[kMemSz / 4];
+static jit_t    g_test_jit;
+
+char *
+TestJit(void)
+{
+  jit_cpu_t     cpu;
+
+  /* R0 := 10 + 9 + ... + 1 */
+  g_test_mem[1] = F1(kOpMov, 0, 0, 0);
+  g_test_mem[2] = F1(kOpMov, 1, 0, 10);
+  g_test_mem[3] = F0(kOpAdd, 0, 0, 1);
+  g_test_mem[4] = F1(kOpSub, 1, 1, 1);
+  g_test_mem[5] = F3(kOpBc, kCondNE, -3);
+  g_test_mem[6] = F3(kOpBr, kCondTrue, kRegLNK);
+
+  /* Read an integer */
+  g_test_mem[7] = F1(kOpMov, 0, 0, -1);
+  g_test_mem[8] = F2(kOpLdr, 1, 0, 0);
+
+  if (!JIT_Translate(&g_test_jit, g_test_mem, 9, kMemSz)) {
+    /* Not supported on the current host */
+    return NULL;
+  }
+
+  /* Run to completion, not counting the final branch */
+  memset(&cpu, 0, sizeof(cpu));
+  cpu.res = 1;
+  cpu.pc = 1;
+  cpu.steps = 1000;
+  ASSERT_EQ(kJitHalt, JIT_Run(&g_test_jit, &cpu));
+  ASSERT_EQ(0, cpu.pc);
+  ASSERT_EQ(6, cpu.ir);
+  ASSERT_EQ(55, cpu.reg[0]);
+  ASSERT_EQ(1000 - 32, cpu.steps);
+
+  /* Exhaust the step budget in the first iteration's branch */
+  cpu.pc = 1;
+  cpu.steps = 5;
+  ASSERT_EQ(kJitLimit, JIT_Run(&g_test_jit, &cpu));
+  ASSERT_EQ(3, cpu.pc);
+  ASSERT_EQ(5, cpu.ir);
+  ASSERT_EQ(10, cpu.reg[0]);
+  ASSERT_EQ(9, cpu.reg[1]);
+
+  /* I/O is left to the interpreter */
+  cpu.pc = 7;
+  cpu.steps = 1000;
+  ASSERT_EQ(kJitStep, JIT_Run(&g_test_jit, &cpu));
+  ASSERT_EQ(8, cpu.pc);
+  ASSERT_EQ(-1, cpu.reg[0]);
+  ASSERT_EQ(999, cpu.steps);
+
+  JIT_Free(&g_test_jit);
+  return NULL;
+}
+
+#endif /* TEST */
@@ -0,0 +1,55 @@
+#ifndef JIT_H_
+#define JIT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "risc.h"
+
+/* The JIT translates the code region of a RISC-0 memory image into native
+ * x86-64 code, with one sequence of native instructions per RISC word, so that
+ * execution can be resumed at any code address. Anything that is either rare
+ * or needs the C library (I/O ports, traps, stores into the code region, an
+ * exhausted step budget) leaves native code again, returning control to the
+ * caller together with the reason. The caller may then carry out a single
+ * instruction in the interpreter before reentering.
+ */
+
+/* Reasons for leaving native code */
+enum {
+  kJitStep,                     /* Instruction at pc needs the interpreter   */
+  kJitHalt,                     /* PC left the code region                   */
+  kJitLimit                     /* Step budget exhausted                     */
+};
+
+/* Processor state, as read and written by native code. Rather than the
+ * operands of the last ADD or SUB, the oVerflow flag is kept explicitly.
+ */
+typedef struct {
+  int32_t       reg[16];        /* General-purpose registers R0-R15          */
+  int32_t       h;              /* For storing remainders                    */
+  int32_t       v;              /* oVerflow flag (0 or 1)                    */
+  int64_t       res;            /* Last result (N, Z)                        */
+  int32_t       pc;             /* Next instruction (set on exit)            */
+  int32_t       ir;             /* Address of last executed insn (on exit)   */
+  int32_t       steps;          /* Remaining number of insns to execute      */
+} jit_cpu_t;
+
+/* Translation of a code region mem[0..sb) */
+typedef struct {
+  uint8_t *     buf;            /* Executable memory                         */
+  size_t        len;            /* Size of buf in bytes                      */
+  int32_t *     mem;            /* Memory image operated upon                */
+  int           sb;             /* Size of the code region in words          */
+  int           memsz;          /* Size of mem in bytes                      */
+  uint8_t **    addr;           /* Native code address per code address      */
+} jit_t;
+
+/* Exported functions */
+extern bool     JIT_Translate(jit_t * const, int32_t * const, const int,
+                              const int);
+extern int      JIT_Run(jit_t * const, jit_cpu_t * const);
+extern void     JIT_Free(jit_t * const);
+
+#endif /* JIT_H_ */
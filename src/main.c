@@ -1,28 +1,118 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "batch.h"
+#include "cache.h"
 #include "orp.h"
+#include "risc.h"
+#include "server.h"
 
 static const char * const g_help =
   "Usage: oc [options] file\n"
+  "       oc [options] -r image\n"
+  "       oc [options] -B file|-r image input...\n"
+  "       oc [options] -F socket file|-r image\n"
   "Options:\n"
   "  -s  Print assembly.\n"
+  "  -o  Save the compiled image to a file instead of running it.\n"
+  "  -S  With -o, save a snapshot taken once the program first reads.\n"
+  "  -r  Run an image or snapshot saved with -o.\n"
+  "  -B  Run once for every input file, in parallel, reading it as stdin.\n"
+  "  -F  Fork a run for every connection to a Unix socket, serving its I/O.\n"
+  "  -c  Report statistics for the cache in $OC_CACHE.\n"
+  "  -O  Optimize the generated code (peephole).\n"
+  "  -k  Report how many array index checks were found redundant.\n"
+  "  -j  Run using the JIT (x86-64).\n"
+  "  -p  Profile instructions executed per procedure.\n"
+  "  -P  Sample call stacks, printed folded (or saved to the -o file).\n"
+  "  -t  On a trap, show the last instructions executed.\n"
+  "  -d  On a trap, show all of memory.\n"
+  "  -m  Set the memory size, e.g. -m 256M (default 4K, more if needed).\n"
+  "  -b  Set the instruction budget, 0 for none (default 100000).\n"
   "  -h  Show this message.\n";
 
+static int      ParseSize(const char * const);
+static int64_t  ParseBudget(const char * const);
+
 int
 main(int argc, char *argv[])
 {
   int     sc = 0;       /* Return status */
   int     ch;           /* Input character */
-  int     sflag = 0;    /* Print assembly */
+  int     opts = 0;     /* Options for ORP_Compile */
+  int     memsz = 0;    /* Memory size in bytes (0: as needed) */
+  int64_t budget = kMaxSteps; /* Max. no. of instructions to execute */
+  char *  arg;          /* Option argument */
+  char *  out = NULL;   /* Image file to save (-o) */
+  char *  in = NULL;    /* Image file to run (-r) */
+  char *  sock = NULL;  /* Socket to serve runs on (-F) */
+  risc_image_t image;   /* Image read from in */
+  risc_vm_t * vm;       /* VM resumed from in */
+  int     report = 0;   /* Report cache statistics (-c) */
 
   /* Parse command line arguments (cf. section 5.10 of K&R) */
   while (--argc > 0 && **++argv == '-') {
     while ((ch = *++*argv)) {
       switch (ch) {
       case 's':
-        sflag = 1;
+        opts |= kOptAsm;
+        break;
+      case 'O':
+        opts |= kOptOptimize;
+        break;
+      case 'k':
+        opts |= kOptChecks;
+        break;
+      case 'j':
+        opts |= kOptJit;
+        break;
+      case 'p':
+        opts |= kOptProfile;
+        break;
+      case 'P':
+        opts |= kOptSample;
+        break;
+      case 't':
+        opts |= kOptTrace;
+        break;
+      case 'd':
+        opts |= kOptDump;
+        break;
+      case 'c':
+        report = 1;
         break;
+      case 'S':
+        opts |= kOptSnapshot;
+        break;
+      case 'B':
+        opts |= kOptBatch;
+        break;
+      case 'm':
+      case 'b':
+      case 'o':
+      case 'r':
+      case 'F':
+        /* The value either directly follows, or is the next argument */
+        arg = *argv + 1;
+        if (!*arg && argc > 1) {
+          --argc;
+          arg = *++argv;
+        }
+        if (ch == 'o') {
+          out = arg;
+        } else if (ch == 'r') {
+          in = arg;
+        } else if (ch == 'F') {
+          sock = arg;
+        }
+        if (!*arg || (ch == 'm' && !(memsz = ParseSize(arg)))
+            || (ch == 'b' && (budget = ParseBudget(arg)) < 0)) {
+          fprintf(stderr, "Illegal value for -%c: %s\n", ch, arg);
+          sc = 1;
+          argc = 0;
+        }
+        goto next;
       case 'h':
         argc = 0;
         break;
@@ -33,13 +123,120 @@ main(int argc, char *argv[])
         break;
       }
     }
+next:
+    ;
   }
 
-  if (argc != 1) {
+  if (sock) {
+    if (out || (in ? argc != 0 : argc != 1)
+        || (opts & (kOptAsm | kOptProfile | kOptSample | kOptSnapshot
+                    | kOptBatch))) {
+      puts(g_help);
+    } else if (!in) {
+      ORP_Compile(*argv, sock, opts | kOptServe, memsz, budget);
+    } else {
+      /* Serve a saved image or snapshot, loaded once */
+      vm = NULL;
+      if (RISC_Open(&image, in)) {
+        vm = RISC_Load(&image, memsz, budget, ORP_Flags(opts));
+        RISC_Close(&image);
+      } else if (!(vm = RISC_Resume(in, budget, ORP_Flags(opts)))) {
+        fprintf(stderr, "Cannot read image %s\n", in);
+      }
+      if (!vm || !Server_Run(vm, sock)) {
+        sc = 1;
+      }
+      if (vm) {
+        RISC_Destroy(vm);
+      }
+    }
+  } else if ((opts & kOptBatch)
+      && (out || (opts & (kOptAsm | kOptProfile | kOptSample | kOptSnapshot))
+          || (!in && argc == 0))) {
+    puts(g_help);
+  } else if (in && (opts & kOptBatch)) {
+    /* Run a saved image once for every input */
+    if (RISC_Open(&image, in)) {
+      Batch_Run(&image, argv, argc, memsz, budget, ORP_Flags(opts));
+      RISC_Close(&image);
+    } else {
+      fprintf(stderr, "Cannot read image %s\n", in);
+      sc = 1;
+    }
+  } else if (opts & kOptBatch) {
+    ORP_Batch(*argv, argv + 1, argc - 1, opts, memsz, budget);
+  } else if (in) {
+    /* Run a saved image, skipping compilation altogether */
+    if (argc != 0 || out || (opts & (kOptAsm | kOptProfile | kOptSample))) {
+      puts(g_help);
+    } else if (RISC_Open(&image, in)) {
+      if (opts & kOptJit) {
+        RISC_Jit(&image, memsz, budget, ORP_Flags(opts));
+      } else {
+        RISC_Interpret(&image, memsz, budget, ORP_Flags(opts));
+      }
+      RISC_Close(&image);
+    } else if ((vm = RISC_Resume(in, budget, ORP_Flags(opts)))) {
+      /* Continue from a snapshot, which determines the memory size */
+      while (RISC_Run(vm, INT_MAX) == kRiscPreempted) {
+        /* Keep going */
+      }
+      RISC_Destroy(vm);
+    } else {
+      fprintf(stderr, "Cannot read image %s\n", in);
+      sc = 1;
+    }
+  } else if (argc == 1) {
+    ORP_Compile(*argv, out, opts, memsz, budget);
+  } else if (argc != 0 || !report) {
     puts(g_help);
-  } else {
-    ORP_Compile(*argv, sflag);
+  }
+  if (report && !sc) {
+    Cache_Report();
   }
 
   return sc;
 }
+
+/* Parses a memory size in bytes, optionally followed by K, M or G. Returns 0
+ * unless it is a multiple of 4 between kMemSz and kMemMax.
+ */
+static int
+ParseSize(const char * const s)
+{
+  char *  end;
+  long    n;
+  int     shift;
+
+  n = strtol(s, &end, 10);
+  if (end == s || n < 0) {
+    return 0;
+  }
+  shift = 0;
+  if (*end == 'K') {
+    shift = 10;
+  } else if (*end == 'M') {
+    shift = 20;
+  } else if (*end == 'G') {
+    shift = 30;
+  }
+  if (shift) {
+    ++end;
+  }
+  if (*end || n > kMemMax >> shift) {
+    return 0;
+  }
+  n <<= shift;
+  return n >= kMemSz && !(n % 4) ? n : 0;
+}
+
+/* Parses an instruction budget, returning -1 if it is not a number >= 0 */
+static int64_t
+ParseBudget(const char * const s)
+{
+  char *      end;
+  long long   n;
+
+  n = strtoll(s, &end, 10);
+  return end == s || *end || n < 0 ? -1 : n;
+}
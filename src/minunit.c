@@ -15,6 +15,17 @@ static void     RunAllTests(void);
 extern char *   TestScanner(void);
 extern char *   TestScopes(void);
 extern char *   TestParser(void);
+extern char *   TestBlocks(void);
+extern char *   TestLiterals(void);
+extern char *   TestOptimizer(void);
+extern char *   TestLeaf(void);
+extern char *   TestRegisters(void);
+extern char *   TestChecks(void);
+extern char *   TestJit(void);
+extern char *   TestRisc(void);
+extern char *   TestCache(void);
+extern char *   TestBatch(void);
+extern char *   TestServer(void);
 
 int
 main()
@@ -47,4 +58,15 @@ RunAllTests(void)
   RUN_TEST(TestScanner);
   RUN_TEST(TestScopes);
   RUN_TEST(TestParser);
+  RUN_TEST(TestBlocks);
+  RUN_TEST(TestLiterals);
+  RUN_TEST(TestOptimizer);
+  RUN_TEST(TestLeaf);
+  RUN_TEST(TestRegisters);
+  RUN_TEST(TestChecks);
+  RUN_TEST(TestJit);
+  RUN_TEST(TestRisc);
+  RUN_TEST(TestCache);
+  RUN_TEST(TestBatch);
+  RUN_TEST(TestServer);
 }
@@ -49,6 +49,8 @@ ORB_Init(void)
   Enter(&list,  "ABS",       kObjSFunc, &g_int_type,  1  );
 
   /* Procedures (see StandProc in orp.c) */
+  Enter(&list,  "WriteBlock",kObjSProc, &g_no_type,   122);
+  Enter(&list,  "ReadBlock", kObjSProc, &g_no_type,   112);
   Enter(&list,  "WriteLn",   kObjSProc, &g_no_type,   71 );
   Enter(&list,  "Write",     kObjSProc, &g_no_type,   61 );
   Enter(&list,  "Read",      kObjSProc, &g_no_type,   51 );
@@ -262,8 +264,8 @@ TestScopes(void)
   g_universe = NULL;
   ORB_OpenScope(); /* Universal scope */
   ORB_OpenScope();
-  NEW_OBJ(obj, "x", kSymVar, g_int_type);
-  NEW_OBJ(obj, "y", kSymVar, g_int_type);
+  NEW_OBJ(obj, "x", kObjVar, g_int_type);
+  NEW_OBJ(obj, "y", kObjVar, g_int_type);
   ORB_OpenScope();
 
   /* Asserts */
@@ -7,12 +7,31 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "except.h"
 #include "risc.h"
 
 enum {
-  /* Upper bounds on object file areas */
-  kMaxCode = 256,                   /* Max no. of instructions */
-  kMaxStrx = 512,                   /* Max size of string pool */
+  /* Upper bound on the size of the string pool (that of the code being
+   * kMaxCode)
+   */
+  kMaxStrx = 0x400000,              /* Max size of string pool */
+
+  /* Initial capacities of the code buffer (in words) and the string pool
+   * (in bytes)
+   */
+  kMinCode = 0x400,
+  kMinStrx = 0x200,
+
+  /* No. of hash buckets for interning string literals */
+  kStrBuckets = 0x400,
+
+  /* Peephole optimization (see ORG_Optimize) */
+  kPeepScan = 32,                   /* Max. no. of insns scanned for uses */
+  kPeepDepth = 2,                   /* Max. no. of cond. branches followed */
+  kPeepHops = 4,                    /* Max. no. of jumps threaded through */
+  kLiveNZ = 1,                      /* Flags derived from the last result */
+  kLiveV = 2,                       /* Overflow flag (set by ADD and SUB) */
+  kNop = ~0x10FFFFFF,               /* BC F, 0 (marks deleted insns) */
 
   /* Modifier bits used for instruction assembly*/
   kModV = 0x1000,                   /* Controls sign extension of constants */
@@ -20,32 +39,6 @@ enum {
                                      * the instruction and the opcode */
 };
 
-/* Tables used for generating assembly */
-
-/* Opcode mnemonics */
-static const char * const g_mnemo[] = {
-  "MOV", "LSL", "ASR", "ROR", "AND", "ANN",   /* Register instructions */
-  "IOR", "XOR", "ADD", "SUB", "MUL", "DIV",   /* Register instructions cont. */
-  "LDW", "LDB", "STW", "STB",                 /* Memory instructions */
-  "BR",  "BLR", "BC",  "BL"                   /* Branch instructions */
-};
-
-/* Conditions for use with branch instructions */
-static const char * const g_cond[] = {
-  "MI", "EQ", "CS", "VS", "LS", "LT", "LE", "T",
-  "PL", "NE", "CC", "VC", "HI", "GE", "GT", "F"
-};
-
-/* General-purpose register names */
-/* Register 12 (MT) was used by Wirth to point to a module table. The current
- * implementation does not yet support separate compilation, but we have kept
- * R12 reserved regardless.
- */
-static const char * const g_regs[] = {
-  "R0",  "R1", "R2",  "R3",  "R4",  "R5",  "R6",  "R7",
-  "R8",  "R9", "R10", "R11", "MT",  "SB",  "SP",  "LNK"
-};
-
 /*
  * Indices are symbols (kEql .. kGeq, minus kEql), values are conditions 
  * (risc.h) to be used with Put3 (below).
@@ -63,11 +56,17 @@ static const int g_relmap[] = {
 static void       Put0(const int, const int, const int, const int);
 static void       Put1(int, const int, const int, const int32_t);
 static void       Put1a(int, const int, const int, const int32_t);
+static void       Put1b(int, const int, const int, const int32_t);
 static void       Put2(const int, int, int, int);
 static void       Put3(const int, int, int);
+static inline void Emit(const int32_t);
+static void       Reserve(const int);
 static void       IncR(void);
 static void       SetCC(item_t * const, const int);
 static void       Trap(const int, const int);
+static int        Intern(const int);
+static int        Hash(const char * const, const int);
+static void *     Grow(void *, int * const, const int, const size_t);
 static inline int Negated(const int);
 static void       Fix(const int, const int);
 static void       FixLinkWith(int, const int);
@@ -77,19 +76,118 @@ static void       Load(item_t * const);
 static void       LoadAdr(item_t * const);
 static void       LoadCond(item_t * const);
 static void       LoadStringAdr(item_t * const);
+static bool       BlockAdr(item_t * const);
 static int        Log2(int, int *);
 static void       Store(item_t * const, const int);
 static void       SaveRegs(const int);
 static void       RestoreRegs(const int);
+static void       Reloc(const int);
+static bool       Peep(const int);
+static inline bool IsJump(const int);
+static int        Compact(void);
+static bool       Unused(int, int, int, const int);
+static int        Uses(const int32_t);
+static inline bool Sets(const int32_t, const int);
+static int32_t    Renamed(int32_t, const int, const int);
+static bool       SetsRes(const int32_t, const int);
+static inline bool IsNop(const int32_t);
+static inline int Offset(const int32_t);
+static int        Ranged(const item_t * const);
+static int        Bound(const item_t * const);
+static int        Length(const item_t * const);
+static void       Repatch(const int);
+static void       Track(void);
+static void       Allocate(void);
+static int        Gain(const int, const int, const bool);
+static void       Spill(int, const int, const int * const);
+static inline bool IsCall(const int32_t);
+static bool       Leaf(void);
 
 /* Private state */
 static int        g_pc;             /* Program counter */
 static int        g_varsize;        /* Size of local variable declarations */
 static int        g_rh;             /* Next free reg / stack top */
 static int        g_frame;          /* Frame offset (Save- and RestoreRegs) */
-static char       g_pool[kMaxStrx]; /* String pool */
+static int *      g_frames;         /* g_frame per emitted instruction */
+static int        g_cap;            /* Capacity of g_mem and g_frames */
+static char *     g_pool;           /* String pool */
+static int        g_poolcap;        /* Capacity of g_pool */
 static int        g_strx;           /* Pointer into g_str */
 
+/* Distinct string literals in the pool, chained per hash bucket (latest
+ * first) through the indices of their successors, plus one (0 ending the
+ * chain)
+ */
+typedef struct {
+  int           off;                /* Offset in g_pool */
+  int           len;                /* Length, including the 0-terminator */
+  int           uses;               /* Items referring to it */
+  int           next;               /* Next literal in bucket */
+} literal_t;
+
+static literal_t * g_lits;          /* Interned literals */
+static int        g_nlits;          /* No. of interned literals */
+static int        g_litcap;         /* Capacity of g_lits */
+static int        g_buckets[kStrBuckets]; /* First literal per bucket */
+
+/* Code addresses computed relative to PC (see Reloc), as pairs of the
+ * address of the instruction subtracting the distance from LNK, and the
+ * address arrived at
+ */
+static int *      g_relocs;
+static int        g_nrelocs;        /* No. of pairs */
+static int        g_reloccap;       /* Capacity of g_relocs */
+
+/* State of the peephole optimizer */
+static int *      g_moved;          /* New address per original one */
+static int        g_nmoved;         /* Size of g_moved (0: not optimized) */
+static int        g_movedcap;       /* Capacity of g_moved */
+static uint8_t *  g_targets;        /* Whether jumped to, per address */
+static int        g_targetcap;      /* Capacity of g_targets */
+
+/* FOR loops enclosing the code being generated, innermost last, along with
+ * the range of their variables within their bodies (if known). The upper
+ * bound is either hi or, if len >= 0, below the length of the open array
+ * parameter at frame offset len.
+ */
+typedef struct {
+  bool          known;              /* Whether the range is known */
+  int           r, a;               /* Identify the variable (see Ranged) */
+  int           lo, hi;             /* Range */
+  int           len;                /* Open array bounding it, or -1 */
+  int           body;               /* Address of the body */
+} loop_t;
+
+static loop_t *   g_loops;
+static int        g_nloops;         /* No. of g_loops */
+static int        g_loopcap;        /* Capacity of g_loops */
+
+/* Index checks to be deleted once their loop ends (see ORG_For2), as
+ * triples of the addresses of their first instruction and of the one
+ * following, and the loop's index in g_loops
+ */
+static int *      g_checks;
+static int        g_nchecks;        /* No. of triples */
+static int        g_checkcap;       /* Capacity of g_checks */
+static int        g_nindexed;       /* No. of indices checked at runtime */
+static int        g_nelided;        /* No. of those whose check was deleted */
+
+/* The procedure being compiled (see Allocate and Leaf) */
+static int        g_enter;          /* Address of its prolog */
+static int        g_parblksize;     /* Size of its parameters, plus LNK */
+static bool       g_leaf;           /* Whether it calls no procedures */
+static int *      g_locals;         /* Offsets of its scalar variables */
+static int        g_nlocals;        /* No. of g_locals */
+static int        g_localcap;       /* Capacity of g_locals */
+
+/* Per branch condition, the flags read by it (kLive...). Those depending on
+ * the carry never hold (see risc.c), and so read none.
+ */
+static const uint8_t g_condflags[16] = {
+  kLiveNZ, kLiveNZ, 0, kLiveV, 0, kLiveNZ | kLiveV, kLiveNZ | kLiveV, 0,
+  kLiveNZ, kLiveNZ, 0, kLiveV, 0, kLiveNZ | kLiveV, kLiveNZ | kLiveV, 0
+};
+
 void
 ORG_CheckRegs(void)
 {
@@ -125,7 +223,7 @@ ORG_FixLink(int l0)
 
   while (l0 != 0) {
     /* Store link to next instruction */
-    l1 = g_mem[l0] & 0x3FFFF;
+    l1 = g_mem[l0] & 0xFFFFFF;
 
     /* Fix offset (overwrites link) */
     Fix(l0, g_pc-l0-1);
@@ -150,29 +248,13 @@ ORG_MakeConst(item_t * const x, type_t * const type, const int32_t val)
 void
 ORG_MakeString(item_t * const x, int len)
 {
-  int     i;
-
   assert(x);
   assert(len > 0);
 
   x->mode = kModeImmediate;
   x->type = &g_str_type;
-  x->a = g_strx;
+  x->a = Intern(len);
   x->b = len;
-
-  if (g_strx + len + 4 >= kMaxStrx) {
-    ORS_Mark("too many strings");
-  } else {
-    /* Copy characters into string pool */
-    for (i = 0; len > 0; --len) {
-      g_pool[g_strx++] = g_str[i++];
-    }
-
-    /* Pad with 0's */
-    while (g_strx % 4) {
-      g_pool[g_strx++] = '\0';
-    }
-  }
 }
 
 void
@@ -265,6 +347,8 @@ ORG_Index(item_t * const x, item_t * const y)
 {
   int           lim;          /* Array size (used for bounds checking) */
   int           scale;        /* Amount by which to scale the index */
+  int           loop;         /* FOR loop over y, if any (see Ranged) */
+  int           at;           /* Address of the bounds check */
 
   assert(x && x->type && x->type->tag == kTypeArray);
   assert(x->mode != kModeImmediate && x->mode != kModeReg);
@@ -272,6 +356,7 @@ ORG_Index(item_t * const x, item_t * const y)
 
   lim = x->type->u.len;
   scale = x->type->base->size;
+  loop = Ranged(y);
 
   if (y->mode == kModeImmediate && lim >= 0) {
     if (y->a < 0 || y->a >= lim) {
@@ -285,19 +370,41 @@ ORG_Index(item_t * const x, item_t * const y)
   } else {
     Load(y);
 
-    /* Check array bounds (at runtime) */
-    Trap(kCondMI, kTrapIndexOutOfBounds);
-    if (lim >= 0) {
-      Put1a(kOpCmp, g_rh, y->r, lim);                   /* CMP R.y and lim */
+    /* Check array bounds (at runtime), unless the index is known to be in
+     * range. Those in terms of FOR loop variables are only known to be once
+     * the loop ends (see ORG_For2).
+     */
+    ++g_nindexed;
+    if (lim >= 0 && Bound(y) < lim) {
+      ++g_nelided;
     } else {
-      if (x->mode == kModeDirect || x->mode == kModeParam) {
-        Put2(kOpLdr, g_rh, kRegSP, x->a + 4 + g_frame); /* RH := Mem[SP+x+4] */
-        Put0(kOpCmp, g_rh, y->r, g_rh);                 /* CMP R.y and RH */
+      at = g_pc;
+      Trap(kCondMI, kTrapIndexOutOfBounds);
+      if (lim >= 0) {
+        Put1a(kOpCmp, g_rh, y->r, lim);                 /* CMP R.y and lim */
       } else {
-        ORS_Mark("error in Index");
+        if (x->mode == kModeDirect || x->mode == kModeParam) {
+          Put2(kOpLdr, g_rh, kRegSP, x->a + 4 + g_frame); /* RH := Mem[SP+x+4] */
+          Put0(kOpCmp, g_rh, y->r, g_rh);               /* CMP R.y and RH */
+        } else {
+          ORS_Mark("error in Index");
+        }
+      }
+      Trap(kCondGE, kTrapIndexOutOfBounds);
+
+      if (loop >= 0 && g_loops[loop].lo >= 0
+          && (g_loops[loop].len < 0 ? g_loops[loop].hi < lim
+              : lim < 0 && g_loops[loop].len == x->a)) {
+        if (3 * g_nchecks + 3 > g_checkcap) {
+          g_checks = Grow(g_checks, &g_checkcap, 3 * g_nchecks + 3,
+                          sizeof(*g_checks));
+        }
+        g_checks[3 * g_nchecks] = at;
+        g_checks[3 * g_nchecks + 1] = g_pc;
+        g_checks[3 * g_nchecks + 2] = loop;
+        ++g_nchecks;
       }
     }
-    Trap(kCondGT, kTrapIndexOutOfBounds);
 
     /* Multiply index by scale factor */
     if (scale == 4) {
@@ -915,9 +1022,16 @@ ORG_StrToChar(item_t * const x)
 {
   assert(x && x->type && x->type->tag == kTypeString && x->b == 2);
 
-  /* Reclaim storage from string pool */
+  /* Reclaim storage from string pool, unless other items still refer to it
+   * or it was not the one last added
+   */
   x->type = &g_char_type;
-  g_strx -= 4;
+  if (g_nlits && g_lits[g_nlits - 1].off == x->a
+      && !--g_lits[g_nlits - 1].uses) {
+    --g_nlits;
+    g_buckets[Hash(g_pool + x->a, 2)] = g_lits[g_nlits].next;
+    g_strx -= 4;
+  }
   x->a = g_pool[x->a];
 }
 
@@ -1107,6 +1221,15 @@ ORG_For0(item_t * const y)
   /* y is the initializer for the loop variable */
   assert(y);
 
+  /* Enter the loop, its variable starting at y */
+  if (g_nloops == g_loopcap) {
+    g_loops = Grow(g_loops, &g_loopcap, g_nloops + 1, sizeof(*g_loops));
+  }
+  g_loops[g_nloops].known = y->mode == kModeImmediate;
+  g_loops[g_nloops].lo = y->a;
+  g_loops[g_nloops].len = Length(y);
+  ++g_nloops;
+
   Load(y);
 }
 
@@ -1115,6 +1238,8 @@ ORG_For1(item_t * const x, item_t * const y, item_t * const z,
          item_t * const w)
 {
   int     l;
+  int     len;                          /* Open array bounding z, if any */
+  loop_t * loop;
 
   assert(x);                            /* FOR x */
   assert(y);                            /* := y  */
@@ -1124,6 +1249,7 @@ ORG_For1(item_t * const x, item_t * const y, item_t * const z,
   assert(w->mode == kModeImmediate);
 
   /* Compare y with z (y - z) */
+  len = Length(z);
   if (z->mode == kModeImmediate) {
     Put1a(kOpCmp, g_rh, y->r, z->a);    /* RH := R.y - z.a */
   } else {
@@ -1144,8 +1270,28 @@ ORG_For1(item_t * const x, item_t * const y, item_t * const z,
     Put3(kOpBc, kCondMI, 0);
   }
 
+  /* Within the body, x lies between y and z, provided the one it starts
+   * from is a constant, and the other is one as well or the length of an open
+   * array parameter less a positive constant (which stays the same). Being
+   * read-only there, x only changes by w.
+   */
+  loop = &g_loops[g_nloops - 1];
+  if (w->a > 0) {
+    loop->known = loop->known && (z->mode == kModeImmediate || len >= 0);
+    loop->hi = z->a;
+    loop->len = len;
+  } else {
+    loop->known = z->mode == kModeImmediate && (loop->known || loop->len >= 0);
+    loop->hi = loop->lo;
+    loop->lo = z->a;
+  }
+  loop->known = loop->known && x->mode == kModeDirect && w->a != 0;
+  loop->r = x->r;
+  loop->a = x->a;
+
   /* x := y */
   ORG_Store(x, y);
+  loop->body = g_pc;
 
   /* Return address of branch instruction for fixup */
   return l;
@@ -1154,6 +1300,11 @@ ORG_For1(item_t * const x, item_t * const y, item_t * const z,
 void
 ORG_For2(item_t * const x, item_t * const w)
 {
+  loop_t *      loop;
+  bool          calls;        /* Whether the body calls procedures */
+  int           pc;
+  int           i, n;
+
   assert(x);  /* Loop variable */
   assert(w);  /* Increment */
   assert(w->mode == kModeImmediate);
@@ -1161,6 +1312,27 @@ ORG_For2(item_t * const x, item_t * const w)
   Load(x);
   --g_rh;
   Put1a(kOpAdd, x->r, x->r, w->a);      /* R.x := R.x + w */
+
+  /* Exit the loop, deleting the index checks in its body shown redundant by
+   * the range of its variable. That is, unless the variable is global and
+   * the body calls procedures, which might change it.
+   */
+  loop = &g_loops[--g_nloops];
+  calls = false;
+  for (pc = loop->body; loop->r == 0 && pc != g_pc; ++pc) {
+    calls = calls || IsCall(g_mem[pc]);
+  }
+  for (i = n = 0; i != g_nchecks; ++i) {
+    if (g_checks[3 * i + 2] != g_nloops) {
+      memmove(g_checks + 3 * n++, g_checks + 3 * i, 3 * sizeof(*g_checks));
+    } else if (!calls) {
+      for (pc = g_checks[3 * i]; pc != g_checks[3 * i + 1]; ++pc) {
+        g_mem[pc] = kNop;
+      }
+      ++g_nelided;
+    }
+  }
+  g_nchecks = n;
 }
 
 /* Branches and procedure calls */
@@ -1271,6 +1443,9 @@ ORG_Call(item_t * const x, int r)
 {
   assert(x && x->type && x->type->tag == kTypeProc);
 
+  /* Calls overwrite LNK */
+  g_leaf = false;
+
   if (x->mode == kModeImmediate) {
     /* x->a contains the byte address of a procedure relative to PC. Divide
      * by 4 to obtain the word address and subtract PC.
@@ -1337,6 +1512,9 @@ ORG_Enter(const int parblksize, const int locblksize)
   assert(locblksize >= 4);
 
   g_frame = 0;
+  g_enter = g_pc;
+  g_parblksize = parblksize;
+  g_leaf = true;
 
   if (locblksize >= 256) {
     ORS_Mark("too many locals");
@@ -1365,9 +1543,26 @@ ORG_Enter(const int parblksize, const int locblksize)
    */
 }
 
+/* Declares the word at offset a of the frame of the procedure about to be
+ * compiled to hold a local variable of a scalar type, which may be kept in a
+ * register instead (see Allocate)
+ */
+void
+ORG_Local(const int a)
+{
+  assert(a > 0 && !(a % 4));
+
+  if (g_nlocals == g_localcap) {
+    g_locals = Grow(g_locals, &g_localcap, g_nlocals + 1, sizeof(*g_locals));
+  }
+  g_locals[g_nlocals++] = a;
+}
+
 void
 ORG_Return(const form_t tag, item_t * const x, const int size)
 {
+  int           pc;
+
   assert(x);
   assert(g_rh <= 1);
 
@@ -1376,17 +1571,34 @@ ORG_Return(const form_t tag, item_t * const x, const int size)
     Load(x);
   }
 
+  /* Keep variables in registers where possible */
+  Allocate();
+  g_nlocals = 0;
+
   /* Epilog */
 
-  /* Restore contents of the LNK register (return address) */
-  Put2(kOpLdr, kRegLNK, kRegSP, 0);         /* LNK := Mem[SP] */
+  if (!g_leaf) {
+    /* Restore contents of the LNK register (return address) */
+    Put2(kOpLdr, kRegLNK, kRegSP, 0);       /* LNK := Mem[SP] */
 
-  /* Release memory */
-  Put1(kOpAdd, kRegSP, kRegSP, size);       /* SP := SP + size */
+    /* Release memory */
+    Put1(kOpAdd, kRegSP, kRegSP, size);     /* SP := SP + size */
+  } else if (Leaf()) {
+    /* LNK was never overwritten, but the frame is still in use */
+    Put1(kOpAdd, kRegSP, kRegSP, size);     /* SP := SP + size */
+  }
 
   /* Unconditional jump to return address */
   Put3(kOpBr, kCondTrue, kRegLNK);          /* BR T, LNK */
 
+  if (g_leaf) {
+    /* Tell the sampler where the return address is (see RISC_Frames) */
+    for (pc = g_enter; pc != g_pc; ++pc) {
+      g_frames[pc] = (pc == g_enter || pc == g_pc - 1
+                      || IsNop(g_mem[g_enter])) ? -1 : -1 - size;
+    }
+  }
+
   /* Return value moved from R0 by Call */
   g_rh = 0;
 }
@@ -1568,6 +1780,82 @@ ORG_Write(const bool line, item_t * const x)
   }
 }
 
+/* ReadBlock(x, y): reads up to LEN(x) bytes into x, setting y to their number.
+ * The I/O port expects the address and length of x in consecutive registers.
+ */
+void
+ORG_ReadBlock(item_t * const x, item_t * const y)
+{
+  int     len;                /* Length of x, or -1 for open arrays */
+  int     off;                /* Offset of x from SP (open arrays) */
+
+  assert(x);
+  assert(y);
+
+  len = x->type->u.len;
+  off = x->a;
+  if (!BlockAdr(x)) {
+    return;
+  }
+  if (len >= 0) {
+    Put1a(kOpMov, g_rh, 0, len);                    /* RH := LEN(x) */
+  } else {
+    Put2(kOpLdr, g_rh, kRegSP, off + 4 + g_frame);  /* RH := Mem[SP+x+4] */
+  }
+  IncR();
+  Put1(kOpMov, g_rh, 0, -5);                        /* RH := -5 */
+  Put2(kOpLdr, x->r, g_rh, 0);                      /* R.x := Mem[RH] */
+  Store(y, x->r);
+  g_rh = 0;
+}
+
+/* WriteBlock(x, y): writes the first y bytes of x */
+void
+ORG_WriteBlock(item_t * const x, item_t * const y)
+{
+  int     len;                /* Length of x, or -1 for open arrays */
+  int     off;                /* Offset of x from SP (open arrays) */
+
+  assert(x);
+  assert(y);
+
+  len = x->type->u.len;
+  off = x->a;
+  if (!BlockAdr(x)) {
+    return;
+  }
+
+  /* Validate the count, at runtime if need be */
+  if (y->mode == kModeImmediate) {
+    if (y->a < 0 || (len >= 0 && y->a > len)) {
+      ORS_Mark("bad count");
+    }
+    Load(y);
+  } else {
+    Load(y);
+    Trap(kCondMI, kTrapIndexOutOfBounds);
+    if (len >= 0) {
+      Put1a(kOpCmp, g_rh, y->r, len);               /* CMP R.y and len */
+    } else {
+      Put2(kOpLdr, g_rh, kRegSP, off + 4 + g_frame);/* RH := Mem[SP+x+4] */
+      Put0(kOpCmp, g_rh, y->r, g_rh);               /* CMP R.y and RH */
+    }
+    Trap(kCondGT, kTrapIndexOutOfBounds);
+  }
+
+  /* The I/O port expects the address and count in consecutive registers */
+  if (y->r != x->r + 1) {
+    Put0(kOpMov, g_rh, 0, x->r);                    /* RH := R.x */
+    x->r = g_rh;
+    IncR();
+    Put0(kOpMov, g_rh, 0, y->r);                    /* RH := R.y */
+    IncR();
+  }
+  Put1(kOpMov, g_rh, 0, -6);                        /* RH := -6 */
+  Put2(kOpStr, x->r, g_rh, 0);                      /* Mem[RH] := R.x */
+  g_rh = 0;
+}
+
 void
 ORG_Get(const bool put, item_t * const x, item_t * const y)
 {
@@ -1765,6 +2053,17 @@ ORG_Open(void)
   g_pc = 1;
   g_rh = 0;
   g_strx = 0;
+  g_nlits = 0;
+  memset(g_buckets, 0, sizeof(g_buckets));
+  g_nrelocs = 0;
+  g_nmoved = 0;
+  g_nlocals = 0;
+  g_nloops = 0;
+  g_nchecks = 0;
+  g_nindexed = 0;
+  g_nelided = 0;
+  Reserve(0);
+  g_mem[0] = 0;
 }
 
 void
@@ -1781,116 +2080,135 @@ ORG_Header(void)
 }
 
 void
-ORG_Close(void)
+ORG_Close(risc_image_t * const image)
 {
-  int32_t * base;
-  int       i;
+  assert(image);
 
   Put2(kOpLdr, kRegLNK, kRegSP, 0);   /* LNK := Mem[SP] */
   Put1(kOpAdd, kRegSP, kRegSP, 4);    /* SP := SP + 4 */
   Put3(kOpBr, kCondTrue, kRegLNK);    /* Return */
 
-  /* Clear data bits */
-  memset(g_mem+g_pc, 0, kMemSz-g_pc);
+  /* Delete what Allocate and Leaf (or ORG_Optimize) left behind */
+  if (g_errcnt == 0) {
+    Track();
+    Compact();
+  }
 
-  /* Copy string pool over to memory */
+  /* Copy string pool over to memory, directly following the code (the pool
+   * being laid out as the little-endian words holding it). Once
+   * loaded, the strings end up after the global variables.
+   */
   assert(!(g_strx % 4));
-  base = g_mem + g_pc + (g_varsize / 4);
-  for (i = 0; i != g_strx; i += 4) {
-    assert(!(i % 4));
-    base[i / 4] |= g_pool[i];
-    base[i / 4] |= g_pool[i + 1] << 8;
-    base[i / 4] |= g_pool[i + 2] << 16;
-    base[i / 4] |= g_pool[i + 3] << 24;
+  Reserve(g_strx / 4);
+  if (g_strx) {
+    memcpy(g_mem + g_pc, g_pool, g_strx);
   }
+
+  image->code = g_mem;
+  image->sb = g_pc;
+  image->varsize = g_varsize;
+  image->strsz = g_strx;
 }
 
-void ORG_Decode(void)
+/* Returns the no. of array indices checked at runtime, and in removed how many
+ * of those checks were found redundant and left out
+ */
+int
+ORG_Checks(int * const removed)
 {
-  int           pc;           /* program counter */
-  int32_t       ir;           /* instruction 'register' */
-  int           a;            /* Result register R.a (F0-2) or condition F3) */
-  int           b;            /* Operand R.b (F0, F1) or base address (F2) */
-  int           n;            /* Operand R.c (F0), im (F1) or address (F2) */
-  int           op;           /* opcode */
+  assert(removed);
 
-  for (pc = 1; pc != g_pc; ++pc) {
-    /* Print code address */
-    printf("%04X: ", 4*pc);
+  *removed = g_nelided;
+  return g_nindexed;
+}
 
-    /* Fetch next instruction */
-    ir = g_mem[pc];
+/* Returns the frame offset of every emitted instruction, i.e., the number of
+ * bytes saved below the frame by SaveRegs when it executes (see RISC_Frames)
+ */
+const int *
+ORG_Frames(void)
+{
+  return g_frames;
+}
+
+/* Removes redundant instructions from the code generated so far, which must
+ * be free of unresolved fixups (i.e., once all procedures and the module body
+ * have been compiled), adjusting the offsets of branches and of code
+ * addresses loaded relative to PC. Repeated until no more changes are made:
+ * - ADD, SUB or MOV of a register to itself (with 0), unless the condition
+ *   flags they set get read;
+ * - CMP R, 0 directly following an instruction that set N and Z from R;
+ * - LDR directly following a STR to the same variable, replaced by a MOV of
+ *   the stored register (or dropped if the same);
+ * - a MOV of the register just set by the previous instruction, if not used
+ *   thereafter, by having the latter set the destination instead;
+ * - a MOV of a register read by the next instruction, if not used thereafter,
+ *   by having the latter read the source instead;
+ * - jumps to (unconditional) jumps, by jumping to the final target instead,
+ *   and jumps to the next instruction.
+ * Instructions jumped to are never merged with preceding ones. Afterwards,
+ * ORG_Relocated maps earlier code addresses to their new values.
+ */
+void
+ORG_Optimize(void)
+{
+  int           pc;
+  bool          changed;
 
-    /* Register (F0, F1, F2) or condition (F3) */
-    a = (ir >> 24) & 0xF;
+  Track();
+  do {
+    /* Find the instructions jumped to, or whose address is taken */
+    g_targets = Grow(g_targets, &g_targetcap, g_pc + 1, sizeof(*g_targets));
+    memset(g_targets, 0, g_pc + 1);
+    for (pc = 1; pc != g_pc; ++pc) {
+      if ((g_mem[pc] & kInsnMsb) && (g_mem[pc] & kInsnQ)
+          && (g_mem[pc] & kInsnU)
+          && pc + 1 + Offset(g_mem[pc]) > 0) {
+        g_targets[pc + 1 + Offset(g_mem[pc])] = 1;
+      }
+    }
+    for (pc = 0; pc != g_nrelocs; ++pc) {
+      g_targets[g_relocs[2 * pc + 1]] = 1;
+    }
 
-    if (!(ir & kInsnMsb) || !(ir & kInsnQ)) {
-      /* Register and memory instructions */
-
-      /* Operand (F0, F1) or base address (F2) */
-      b = (ir >> 20) & 0xF;
-
-      if (!(ir & kInsnMsb)) {
-        /* Register instruction (F0, F1) */
-        op = (ir >> 16) & 0xF;
-        printf("%-3s ", g_mnemo[op]);
-
-        if (!(ir & kInsnQ)) {
-          /* Format F0 */
-          n = ir & 0xF;
-          if (op == kOpMov) {
-            if (ir & kInsnU) {
-              if (ir & kInsnV) {
-                printf("%s, [N,Z,C,V]\n", g_regs[a]);
-              } else {
-                printf("%s, H\n", g_regs[a]);
-              }
-            } else {
-              printf("%s, %s\n", g_regs[a], g_regs[n]);
-            }
-          } else {
-            printf("%s, %s, %s\n", g_regs[a], g_regs[b], g_regs[n]);
-          }
-        } else {
-          /* Format F1 */
-          n = ir & 0xFFFF;
-          if (op == kOpMov) {
-            if (ir & kInsnU) {
-              printf("%s, %X << 16\n", g_regs[a], n);
-            } else {
-              printf("%s, %X\n", g_regs[a], n);
-            }
-          } else {
-            printf("%s, %s, %X\n", g_regs[a], g_regs[b], n);
-          }
+    /* Rewrite pairs of instructions, replacing those deleted by kNop */
+    changed = false;
+    for (pc = 1; pc != g_pc; ++pc) {
+      if (Peep(pc)) {
+        changed = true;
+        if (pc + 1 != g_pc) {
+          ++pc;
         }
-      } else {
-        assert(!(ir & kInsnQ));
-
-        /* Memory instruction (F2) */
-        op = (ir >> 28) & 0xF;
-        n = ir & 0xFFFFF;
-        printf("%-3s %s, %s, %X\n", g_mnemo[op+4], g_regs[a], g_regs[b], n);
-      }
-    } else {
-      /* Branch instruction (F3) */
-      op = (ir >> 28) & 0x3;
-      printf("%-3s ", g_mnemo[op+16]);
-
-      switch (op) {
-      case kOpBr: case kOpBlr:
-        assert(!(ir & kInsnU));
-        n = ir & 0xF;
-        printf("%s, %s\n", g_cond[a], g_regs[n]);
-        break;
-      case kOpBc: case kOpBl:
-        assert(ir & kInsnU);
-        printf("%s, %X\n", g_cond[a], 4 * (ir & 0xFFFFFF));
-        break;
-      default:
-        assert(0);
       }
     }
+  } while (Compact() || changed);
+}
+
+/* Returns the address to which the instruction at the given code address was
+ * moved by ORG_Optimize or ORG_Close, or that of its successor if deleted
+ */
+int
+ORG_Relocated(const int pc)
+{
+  assert(0 <= pc && (!g_nmoved || pc < g_nmoved));
+
+  return g_nmoved ? g_moved[pc] : pc;
+}
+
+void ORG_Decode(const unsigned long * const counts)
+{
+  char          buf[kRiscAsmLen];
+  int           pc;           /* program counter */
+
+  for (pc = 1; pc != g_pc; ++pc) {
+    /* Print execution count, if profiled */
+    if (counts) {
+      printf("%10lu  ", counts[pc]);
+    }
+
+    /* Print code address and instruction */
+    RISC_Disassemble(g_mem[pc], buf);
+    printf("%04X: %s\n", 4*pc, buf);
   }
 }
 
@@ -1919,7 +2237,7 @@ Put0(const int op, const int a, const int b, const int c)
   assert(0 <= a && a <= 15);
   assert(0 <= b && b <= 15);
   assert(0 <= c && c <= 15);
-  g_mem[g_pc++] = (a << 24) | (b << 20) | (op << 16) | c;
+  Emit((a << 24) | (b << 20) | (op << 16) | c);
 }
 
 /*
@@ -1953,7 +2271,7 @@ Put1(int op, const int a, const int b, const int32_t im)
     op += kModV;
   }
   /* Note 0x40 equals 0100 0000 in binary. */
-  g_mem[g_pc++] = ((a + 0x40) << 24) | (b << 20) | (op << 16) | (im & 0xFFFF);
+  Emit(((a + 0x40) << 24) | (b << 20) | (op << 16) | (im & 0xFFFF));
 }
 
 /* Same as Put1, but also applies a range test to im. */
@@ -1987,6 +2305,21 @@ Put1a(int op, const int a, const int b, const int32_t im)
   }
 }
 
+/* Same as Put1a, but always emitting the IOR for an im that does not fit in
+ * 16 bits, such that it can be patched afterwards (see Compact).
+ */
+static void
+Put1b(int op, const int a, const int b, const int32_t im)
+{
+  if (im >= -0x10000 && im <= 0x0FFFF) {
+    Put1(op, a, b, im);
+  } else {
+    Put1(kOpMov + kModU, g_rh, 0, (im >> 16) & 0xFFFF);
+    Put1(kOpIor, g_rh, g_rh, im & 0xFFFF);
+    Put0(op, a, b, g_rh);
+  }
+}
+
 /*
  * Writes a memory instruction (first- and second most significant bits 1 and
  * 0) in format F2:
@@ -2013,7 +2346,7 @@ Put2(const int op, int a, int b, int off)
   assert(0 <= a && a <= 15);
   assert(0 <= b && b <= 15);
 
-  g_mem[g_pc++] = (op << 28) | (a << 24) | (b << 20) | (off & 0xFFFF);
+  Emit((op << 28) | (a << 24) | (b << 20) | (off & 0xFFFF));
 }
 
 /*
@@ -2047,7 +2380,137 @@ Put3(const int op, int cond, int off)
 {
   assert(0 <= cond && cond <= 15);
 
-  g_mem[g_pc++] = ((op + 12) << 28) | (cond << 24) | (off & 0xFFFFFF);
+  Emit(((op + 12) << 28) | (cond << 24) | (off & 0xFFFFFF));
+}
+
+/* Appends the instruction ir to the code, recording the frame offset in
+ * effect when it gets executed (see ORG_Frames)
+ */
+static inline void
+Emit(const int32_t ir)
+{
+  if (g_pc == g_cap) {
+    Reserve(1);
+  }
+  g_frames[g_pc] = g_frame;
+  g_mem[g_pc++] = ir;
+}
+
+/* Makes room for n more words following the code, doubling the capacity of
+ * the buffer as often as needed. Throws an exception if out of memory.
+ */
+static void
+Reserve(const int n)
+{
+  int32_t *     mem;
+  int *         frames;
+  int           cap;
+
+  if (g_pc + n <= g_cap) {
+    return;
+  }
+  cap = g_cap ? g_cap : kMinCode;
+  while (cap < g_pc + n) {
+    cap *= 2;
+  }
+  if (!(mem = realloc(g_mem, cap * sizeof(*mem)))) {
+    fprintf(stderr, "Out of memory\n");
+    THROW;
+  }
+  g_mem = mem;
+  if (!(frames = realloc(g_frames, cap * sizeof(*frames)))) {
+    fprintf(stderr, "Out of memory\n");
+    THROW;
+  }
+  g_frames = frames;
+  g_cap = cap;
+}
+
+/* String pool */
+
+/* Returns the offset in the string pool of the literal in g_str of the given
+ * length (including its 0-terminator), adding it if not already present, and
+ * counts the item about to refer to it.
+ */
+static int
+Intern(const int len)
+{
+  literal_t *   lit;
+  int           h;          /* Hash bucket */
+  int           i;
+  int           sz;         /* Size in the pool, padded to whole words */
+
+  h = Hash(g_str, len);
+  for (i = g_buckets[h]; i; i = lit->next) {
+    lit = &g_lits[i - 1];
+    if (lit->len == len && !memcmp(g_pool + lit->off, g_str, len)) {
+      ++lit->uses;
+      return lit->off;
+    }
+  }
+
+  sz = (len + 3) & ~3;
+  if (g_strx + sz >= kMaxStrx) {
+    ORS_Mark("too many strings");
+    return g_strx;
+  }
+
+  /* Copy characters into string pool, padding them with 0's */
+  if (g_strx + sz > g_poolcap) {
+    g_pool = Grow(g_pool, &g_poolcap, g_strx + sz, 1);
+  }
+  memcpy(g_pool + g_strx, g_str, len);
+  memset(g_pool + g_strx + len, 0, sz - len);
+
+  /* Prepend to its bucket */
+  if (g_nlits == g_litcap) {
+    g_lits = Grow(g_lits, &g_litcap, g_nlits + 1, sizeof(*g_lits));
+  }
+  lit = &g_lits[g_nlits++];
+  lit->off = g_strx;
+  lit->len = len;
+  lit->uses = 1;
+  lit->next = g_buckets[h];
+  g_buckets[h] = g_nlits;
+
+  g_strx += sz;
+  return lit->off;
+}
+
+/* Returns the hash bucket of the len characters at s (FNV-1a) */
+static int
+Hash(const char * const s, const int len)
+{
+  uint32_t      h;
+  int           i;
+
+  h = 2166136261u;
+  for (i = 0; i != len; ++i) {
+    h = (h ^ (uint8_t)s[i]) * 16777619u;
+  }
+  return h % kStrBuckets;
+}
+
+/* Reallocates the array p of *cap elements of the given size such as to hold
+ * at least n, doubling its capacity (initially kMinStrx) as often as needed
+ * and updating *cap.
+ * Throws an exception if out of memory.
+ */
+static void *
+Grow(void * p, int * const cap, const int n, const size_t size)
+{
+  int           c;
+
+  c = *cap ? *cap : kMinStrx;
+  while (c < n) {
+    c *= 2;
+  }
+  if (!(p = realloc(p, c * size))) {
+    fprintf(stderr, "Out of memory\n");
+    THROW;
+  }
+  *cap = c;
+  return p;
 }
 
 /* Increments the register stack index RH (one of R0 - R11). */
@@ -2150,7 +2613,7 @@ Merged(const int l0, int l1)
     l3 = l0;
     do {
       l2 = l3;
-      l3 = g_mem[l2] & 0x3FFFF;
+      l3 = g_mem[l2] & 0xFFFFFF;
     } while (l3 != 0);
 
     /* Set offset of instruction at l2 */
@@ -2199,8 +2662,10 @@ Load(item_t * const x)
           ORS_Mark("not allowed");
         } else {
           assert(x->r == 0);
+          g_leaf = false;
           Put3(kOpBl, kCondTrue, 0);              /* LNK := PC+1, PC := PC+1 */
-          Put1a(kOpSub,g_rh,kRegLNK,g_pc*4-x->a); /* RH := LNK - (PC*4 - x) */
+          Reloc(x->a / 4);
+          Put1b(kOpSub,g_rh,kRegLNK,g_pc*4-x->a); /* RH := LNK - (PC*4 - x) */
         }
       } else if (x->a <= 0x0FFFF && x->a >= -0x10000) {
         /* Noting x->a is a 32-bits signed integer, the 16 most significant
@@ -2302,6 +2767,29 @@ LoadAdr(item_t * const x)
   x->mode = kModeReg;
 }
 
+/* Loads the address of an ARRAY OF CHAR or BYTE x into the topmost register,
+ * as needed for passing it to the block I/O ports. Returns false if x has the
+ * wrong type.
+ */
+static bool
+BlockAdr(item_t * const x)
+{
+  assert(x);
+
+  if (x->type->tag != kTypeArray || x->type->base->size != 1
+      || (x->type->base->tag != kTypeChar && x->type->base->tag != kTypeInt)) {
+    ORS_Mark("not an ARRAY OF CHAR or BYTE");
+    return false;
+  }
+  LoadAdr(x);
+  if (x->r != g_rh - 1) {
+    Put0(kOpMov, g_rh, 0, x->r);                    /* RH := R.x */
+    x->r = g_rh;
+    IncR();
+  }
+  return true;
+}
+
 static void
 LoadCond(item_t * const x)
 {
@@ -2431,3 +2919,765 @@ RestoreRegs(const int r)
   /* Decrement frame offset */
   g_frame -= 4 * r;
 }
+
+/* Returns the index in g_loops of the innermost FOR loop over the variable y
+ * with a known range, or -1 if none
+ */
+static int
+Ranged(const item_t * const y)
+{
+  int           i;
+
+  for (i = g_nloops - 1; i >= 0 && y->mode == kModeDirect; --i) {
+    if (g_loops[i].known && g_loops[i].r == y->r && g_loops[i].a == y->a) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Returns an upper bound of the value just loaded into R.y by the last
+ * instruction, if that shows it is non-negative (a byte loaded, or a word
+ * ANDed with a non-negative mask), or INT32_MAX if not
+ */
+static int
+Bound(const item_t * const y)
+{
+  int32_t       ir;
+
+  ir = g_mem[g_pc - 1];
+  if (y->mode != kModeReg || ((ir >> 24) & 0xF) != y->r) {
+    return INT32_MAX;
+  }
+  if ((ir & kInsnMsb) && !(ir & (kInsnQ | kInsnU)) && (ir & kInsnV)) {
+    /* LDB */
+    return 0xFF;
+  }
+  if ((ir & kInsnQ) && !(ir & (kInsnMsb | kInsnU | kInsnV))
+      && ((ir >> 16) & 0xF) == kOpAnd) {
+    return ir & 0xFFFF;
+  }
+  return INT32_MAX;
+}
+
+/* Returns the frame offset of the open array parameter whose length, less a
+ * positive constant, the last instructions just computed into R.z (see
+ * ORG_Len), or -1 if they did not
+ */
+static int
+Length(const item_t * const z)
+{
+  int32_t       ir;
+
+  if (z->mode != kModeReg || g_pc < 3) {
+    return -1;
+  }
+  ir = g_mem[g_pc - 1];
+  if ((ir & (kInsnMsb | kInsnQ | kInsnU | kInsnV)) != kInsnQ
+      || ((ir >> 16) & 0xF) != kOpSub || ((ir >> 24) & 0xF) != z->r
+      || ((ir >> 20) & 0xF) != z->r || !(ir & 0xFFFF)) {
+    return -1;
+  }
+  ir = g_mem[g_pc - 2];
+  if ((ir & (kInsnMsb | kInsnQ | kInsnU | kInsnV)) != kInsnMsb
+      || ((ir >> 24) & 0xF) != z->r || ((ir >> 20) & 0xF) != kRegSP) {
+    return -1;
+  }
+  return (ir & 0xFFFF) - 4 - g_frame;
+}
+
+/* Peephole optimization */
+
+/* Records that the instructions about to be emitted load the given code
+ * address relative to LNK (see Load)
+ */
+static void
+Reloc(const int addr)
+{
+  if (2 * g_nrelocs + 2 > g_reloccap) {
+    g_relocs = Grow(g_relocs, &g_reloccap, 2 * g_nrelocs + 2,
+                    sizeof(*g_relocs));
+  }
+  g_relocs[2 * g_nrelocs] = g_pc;
+  g_relocs[2 * g_nrelocs + 1] = addr;
+  ++g_nrelocs;
+}
+
+/* Applies the first peephole rule (see ORG_Optimize) matching the instruction
+ * at pc, or that and its successor. Returns whether any did.
+ */
+static bool
+Peep(const int pc)
+{
+  int32_t       ir;         /* Instruction at pc */
+  int32_t       nx;         /* Its successor (if any) */
+  int           a, b, op;   /* Fields of ir */
+  int           to;         /* Jump target */
+  int           from;       /* Original jump target */
+  int           end;        /* End of the chain of jumps from to */
+  int           hops;
+
+  ir = g_mem[pc];
+  nx = (pc + 1 != g_pc) ? g_mem[pc + 1] : kNop;
+  a = (ir >> 24) & 0xF;
+  b = (ir >> 20) & 0xF;
+  op = (ir >> 16) & 0xF;
+
+  if ((ir & kInsnMsb) && (ir & kInsnQ)) {
+    /* Thread BC through BC T's */
+    if (!(ir & kInsnU) || (ir & kInsnV) || a == kCondFalse) {
+      return false;
+    }
+    from = to = pc + 1 + Offset(ir);
+    for (hops = 0; hops != kPeepHops && IsJump(to); ++hops) {
+      to += 1 + Offset(g_mem[to]);
+    }
+
+    /* Leave jumps alone that lead back to pc or into a cycle of jumps. A
+     * chain of jumps longer than the code revisits some address.
+     */
+    end = from;
+    for (hops = 0; hops != g_pc && end != pc && IsJump(end); ++hops) {
+      end += 1 + Offset(g_mem[end]);
+    }
+    if (to == from || end == pc || hops == g_pc) {
+      return false;
+    }
+    if (to > 0) {
+      g_targets[to] = 1;
+    }
+    g_mem[pc] = (ir & ~0xFFFFFF) | ((to - pc - 1) & 0xFFFFFF);
+    return true;
+  }
+
+  if (!(nx & kInsnMsb) && !(nx & kInsnQ) && !(nx & kInsnU)
+      && ((nx >> 16) & 0xF) == kOpMov && (nx & 0xF) == a
+      && ((nx >> 24) & 0xF) != a && !g_targets[pc + 1]
+      && (!(ir & kInsnMsb) || !(ir & kInsnU))
+      && Unused(pc + 2, 1 << a, 0, kPeepDepth)
+      && (SetsRes(ir, a) || Unused(pc + 2, 0, kLiveNZ, kPeepDepth))) {
+    /* R.a := ...; MOV R.b, R.a, with R.a unused thereafter */
+    g_mem[pc] = (ir & ~0x0F000000) | (nx & 0x0F000000);
+    g_mem[pc + 1] = kNop;
+    return true;
+  }
+
+  if (!(ir & (kInsnMsb | kInsnQ | kInsnU)) && op == kOpMov
+      && (ir & 0xF) != a && !((nx & kInsnMsb) && (nx & kInsnQ))
+      && (Uses(nx) & 1 << a) && !g_targets[pc + 1]
+      && (Sets(nx, a) || Unused(pc + 2, 1 << a, 0, kPeepDepth))
+      && ((!(nx & kInsnMsb) || SetsRes(nx, (nx >> 24) & 0xF))
+          || Unused(pc + 2, 0, kLiveNZ, kPeepDepth))) {
+    /* MOV R.a, R.c; ... R.a ..., with R.a unused thereafter */
+    g_mem[pc + 1] = Renamed(nx, a, ir & 0xF);
+    g_mem[pc] = kNop;
+    return true;
+  }
+
+  if (!(ir & kInsnMsb)) {
+    if ((ir & kInsnQ) && (op == kOpAdd || op == kOpSub) && a == b
+        && !(ir & (kInsnU | kInsnV | 0xFFFF))) {
+      /* ADD R, R, 0 or SUB R, R, 0 (i.e., CMP R, 0), only setting flags */
+      if (Unused(pc + 1, 0, kLiveNZ | kLiveV, kPeepDepth)
+          || (pc > 1 && !g_targets[pc] && SetsRes(g_mem[pc - 1], a)
+              && Unused(pc + 1, 0, kLiveV, kPeepDepth))) {
+        g_mem[pc] = kNop;
+        return true;
+      }
+    } else if (!(ir & (kInsnQ | kInsnU)) && op == kOpMov
+               && a == (ir & 0xF)
+               && Unused(pc + 1, 0, kLiveNZ, kPeepDepth)) {
+      /* MOV R, R */
+      g_mem[pc] = kNop;
+      return true;
+    }
+    return false;
+  }
+
+  /* STR R, B, off; LDR R', B, off (words, with B being SP or SB) */
+  if ((ir & kInsnQ) || !(ir & kInsnU) || (ir & kInsnV)
+      || (b != kRegSP && b != kRegSB)
+      || ((nx ^ ir) & ~0x0F000000) != kInsnU || g_targets[pc + 1]) {
+    return false;
+  }
+  if (((nx >> 24) & 0xF) != a) {
+    /* MOV R', R */
+    g_mem[pc + 1] = (nx & 0x0F000000) | (kOpMov << 16) | a;
+    return true;
+  }
+  if (Unused(pc + 2, 0, kLiveNZ, kPeepDepth)
+      || (pc > 1 && !g_targets[pc] && SetsRes(g_mem[pc - 1], a))) {
+    g_mem[pc + 1] = kNop;
+    return true;
+  }
+  return false;
+}
+
+/* Whether there is a BC T at the code address pc (which may lie outside the
+ * code, e.g. for traps)
+ */
+static inline bool
+IsJump(const int pc)
+{
+  return pc > 0 && pc < g_pc
+         && (g_mem[pc] & ~0xFFFFFF) == ((kNop & ~0x0FFFFFFF) | kCondTrue << 24);
+}
+
+/* Deletes all instructions without any effect, such as those replaced by
+ * kNop, moving the rest up and adjusting branch offsets, code addresses
+ * loaded relative to PC, the frame offsets recorded per instruction and
+ * g_moved. Returns the no. of instructions deleted.
+ */
+static int
+Compact(void)
+{
+  int *         addr;       /* New address per old one */
+  int32_t       ir;
+  int           pc;
+  int           to;         /* Jump target */
+  int           n;
+
+  if (!(addr = malloc((g_pc + 1) * sizeof(*addr)))) {
+    fprintf(stderr, "Out of memory\n");
+    THROW;
+  }
+  addr[0] = 0;
+  for (pc = 1; pc <= g_pc; ++pc) {
+    addr[pc] = addr[pc - 1] + (pc == 1 || !IsNop(g_mem[pc - 1]));
+  }
+  n = g_pc - addr[g_pc];
+
+  if (n) {
+    /* Move up instructions, fixing the offsets of branches (those to traps
+     * being at fixed, negative addresses)
+     */
+    for (pc = 1; pc != g_pc; ++pc) {
+      ir = g_mem[pc];
+      if (IsNop(ir)) {
+        continue;
+      }
+      if ((ir & kInsnMsb) && (ir & kInsnQ) && (ir & kInsnU)) {
+        to = pc + 1 + Offset(ir);
+        if (to > 0) {
+          to = addr[to];
+        }
+        ir = (ir & ~0xFFFFFF) | ((to - addr[pc] - 1) & 0xFFFFFF);
+      }
+      g_mem[addr[pc]] = ir;
+      g_frames[addr[pc]] = g_frames[pc];
+    }
+
+    for (pc = 0; pc != g_nrelocs; ++pc) {
+      g_relocs[2 * pc] = addr[g_relocs[2 * pc]];
+      g_relocs[2 * pc + 1] = addr[g_relocs[2 * pc + 1]];
+      Repatch(pc);
+    }
+
+    for (pc = 0; pc != g_nmoved; ++pc) {
+      g_moved[pc] = addr[g_moved[pc]];
+    }
+    g_pc = addr[g_pc];
+  }
+  free(addr);
+  return n;
+}
+
+/* Patches the code address loaded by the i-th pair of g_relocs with its new
+ * distance from LNK (see Put1b)
+ */
+static void
+Repatch(const int i)
+{
+  int           at;         /* Address of the SUB (or MOV) of a reloc. */
+  int           dist;       /* Distance from LNK in bytes */
+
+  at = g_relocs[2 * i];
+  dist = at * 4 - g_relocs[2 * i + 1] * 4;
+  if (g_mem[at] & kInsnU) {
+    /* MOV' RH, hi; IOR RH, RH, lo; SUB R, LNK, RH */
+    g_mem[at] = (g_mem[at] & ~0xFFFF) | ((dist >> 16) & 0xFFFF);
+    g_mem[at + 1] = (g_mem[at + 1] & ~0xFFFF) | (dist & 0xFFFF);
+  } else {
+    g_mem[at] = (g_mem[at] & ~(kInsnV | 0xFFFF)) | (dist & 0xFFFF)
+                | (dist < 0 ? kInsnV : 0);
+  }
+}
+
+/* Returns whether none of the registers in the bit set regs, nor any of the
+ * flags (kLive...), are read by the code starting at pc before being set.
+ * Up to depth conditional branches are followed, and only so many
+ * instructions in total, beyond which they are assumed to be read, as are
+ * registers by any procedure called and by any code returned or jumped to.
+ */
+static bool
+Unused(int pc, int regs, int flags, const int depth)
+{
+  int32_t       ir;
+  int           a, b, op;
+  int           to;         /* Jump target */
+  int           n;
+
+  for (n = 0; n != kPeepScan; ++n, ++pc) {
+    if (!regs && !flags) {
+      return true;
+    }
+    if (pc >= g_pc) {
+      /* The module body, returning */
+      return true;
+    }
+    ir = g_mem[pc];
+    a = (ir >> 24) & 0xF;
+    b = (ir >> 20) & 0xF;
+    op = (ir >> 16) & 0xF;
+
+    if ((ir & kInsnMsb) && (ir & kInsnQ)) {
+      /* Branch instruction (F3), a being the condition */
+      if (a == kCondFalse) {
+        continue;
+      }
+      if (flags & g_condflags[a]) {
+        return false;
+      }
+      if (!(ir & kInsnU) || (ir & kInsnV)) {
+        /* Call or return. The flags are always set anew before read. */
+        return !regs;
+      }
+      to = pc + 1 + Offset(ir);
+      if (to <= 0) {
+        /* Trap, halting execution if taken */
+        if (a == kCondTrue) {
+          return true;
+        }
+      } else if (a == kCondTrue) {
+        pc = to - 1;
+      } else if (!depth || !Unused(to, regs, flags, depth - 1)) {
+        return false;
+      }
+    } else if (Uses(ir) & regs) {
+      return false;
+    } else if (ir & kInsnMsb) {
+      /* Memory instruction (F2). Only loads from variables are sure to set
+       * N and Z (unlike input).
+       */
+      if (!(ir & kInsnU)) {
+        regs &= ~(1 << a);
+        if (b == kRegSP || b == kRegSB) {
+          flags &= ~kLiveNZ;
+        }
+      }
+    } else {
+      /* Register instruction (F0, F1) */
+      if (op == kOpMov && !(ir & kInsnQ) && (ir & kInsnU) && (ir & kInsnV)
+          && flags) {
+        /* MOV R, [N,Z,C,V] */
+        return false;
+      }
+      regs &= ~(1 << a);
+      flags &= (op == kOpAdd || op == kOpSub) ? 0 : ~kLiveNZ;
+    }
+  }
+  return !regs && !flags;
+}
+
+/* Returns the set of registers read by the register or memory instruction ir
+ * as a bit set
+ */
+static int
+Uses(const int32_t ir)
+{
+  int           a, b, op;
+
+  a = (ir >> 24) & 0xF;
+  b = (ir >> 20) & 0xF;
+  op = (ir >> 16) & 0xF;
+
+  if (ir & kInsnMsb) {
+    /* STR also reads R.a */
+    return (1 << b) | ((ir & kInsnU) ? 1 << a : 0);
+  }
+  if (op == kOpMov) {
+    /* MOV R.a, R.c (F0) or MOV R.a, im, H or flags */
+    return (ir & (kInsnQ | kInsnU)) ? 0 : 1 << (ir & 0xF);
+  }
+  return (1 << b) | ((ir & kInsnQ) ? 0 : 1 << (ir & 0xF));
+}
+
+/* Returns whether the register or memory instruction ir sets register r */
+static inline bool
+Sets(const int32_t ir, const int r)
+{
+  return ((ir >> 24) & 0xF) == r && (!(ir & kInsnMsb) || !(ir & kInsnU));
+}
+
+/* Returns the register or memory instruction ir, reading register c wherever
+ * it read register a
+ */
+static int32_t
+Renamed(int32_t ir, const int a, const int c)
+{
+  if ((ir & kInsnMsb) && (ir & kInsnU) && ((ir >> 24) & 0xF) == a) {
+    /* STR */
+    ir = (ir & ~0x0F000000) | c << 24;
+  }
+  if (((ir & kInsnMsb) || ((ir >> 16) & 0xF) != kOpMov)
+      && ((ir >> 20) & 0xF) == a) {
+    ir = (ir & ~0x00F00000) | c << 20;
+  }
+  if (!(ir & (kInsnMsb | kInsnQ)) && (ir & 0xF) == a
+      && (((ir >> 16) & 0xF) != kOpMov || !(ir & kInsnU))) {
+    ir = (ir & ~0xF) | c;
+  }
+  return ir;
+}
+
+/* Returns whether ir sets register r, deriving N and Z from its new value */
+static bool
+SetsRes(const int32_t ir, const int r)
+{
+  if (((ir >> 24) & 0xF) != r || ((ir & kInsnMsb) && (ir & kInsnQ))) {
+    return false;
+  }
+  if (ir & kInsnMsb) {
+    /* LDR from a variable (i.e., not an input) */
+    return !(ir & kInsnU)
+           && (((ir >> 20) & 0xF) == kRegSP || ((ir >> 20) & 0xF) == kRegSB);
+  }
+  /* All but DIV (whose quotient may not fit in 32 bits) */
+  return ((ir >> 16) & 0xF) != kOpDiv;
+}
+
+/* Returns whether the instruction ir has no effect: any branch that is never
+ * taken (cond F), or that jumps to the next instruction.
+ */
+static inline bool
+IsNop(const int32_t ir)
+{
+  return (ir & kInsnMsb) && (ir & kInsnQ)
+         && (((ir >> 24) & 0xF) == kCondFalse
+             || ((ir & kInsnU) && !(ir & kInsnV) && !(ir & 0xFFFFFF)));
+}
+
+/* Returns the offset of a branch instruction ir (u = 1), sign-extended from
+ * 24 bits
+ */
+static inline int
+Offset(const int32_t ir)
+{
+  return ((ir & 0xFFFFFF) ^ 0x800000) - 0x800000;
+}
+
+/* Starts mapping code addresses to where Compact moves them, unless done so
+ * already
+ */
+static void
+Track(void)
+{
+  int           pc;
+
+  if (g_nmoved) {
+    return;
+  }
+  g_moved = Grow(g_moved, &g_movedcap, g_pc + 1, sizeof(*g_moved));
+  for (pc = 0; pc <= g_pc; ++pc) {
+    g_moved[pc] = pc;
+  }
+  g_nmoved = g_pc + 1;
+}
+
+/* Keeps the parameters and the local variables declared by ORG_Local of the
+ * procedure compiled since g_enter in registers the body does not otherwise
+ * use (R0-R11), rather than in its frame, most frequently accessed first (see
+ * Gain). Their loads and stores are replaced by MOVs (or an AND), and those of
+ * the prolog by MOVs (if not deleted). Those live across a call are spilled
+ * around it (see Spill), provided that costs fewer loads and stores than
+ * saved.
+ */
+static void
+Allocate(void)
+{
+  int32_t       ir;
+  int32_t *     saved;      /* Code before keeping a variable in a register */
+  int *         gains;      /* Per parameter, then local variable */
+  int           gain;
+  int           slots[kRegMT]; /* Offset in the frame per register */
+  int           body;       /* Address of the body, following the prolog */
+  int           nparams;    /* No. of registers parameters are passed in */
+  int           n;          /* No. of variables */
+  int           used;       /* Registers taken by the body */
+  int           homes;      /* Registers assigned to variables */
+  int           taken;      /* Registers not available to a variable */
+  int           pc;
+  int           i, best;
+  int           a;          /* Offset of a variable in the frame */
+  int           f;          /* Register it is kept in */
+  int           x;          /* Register loaded or stored */
+
+  assert(!g_nmoved);
+
+  for (a = 4, nparams = 0; a < g_parblksize; a += 4) {
+    ++nparams;
+  }
+  body = g_enter + 2 + nparams;
+  n = nparams + g_nlocals;
+
+  used = 0;
+  for (pc = body; pc != g_pc; ++pc) {
+    ir = g_mem[pc];
+    if (!(ir & kInsnMsb) || !(ir & kInsnQ)) {
+      used |= Uses(ir) | 1 << ((ir >> 24) & 0xF);
+    }
+  }
+
+  /* Spilling moves the body (see Spill), which code addresses loaded by
+   * the short form (see Put1b) may not allow for once near its range
+   */
+  for (i = 0; !g_leaf && i != g_nrelocs; ++i) {
+    if (g_relocs[2 * i] >= body && !(g_mem[g_relocs[2 * i]] & kInsnU)
+        && g_relocs[2 * i] - g_relocs[2 * i + 1] > 0x2000) {
+      n = 0;
+    }
+  }
+  if (!n) {
+    return;
+  }
+
+  if (!(gains = malloc(n * sizeof(*gains)))
+      || !(saved = malloc((g_pc - g_enter) * sizeof(*saved)))) {
+    fprintf(stderr, "Out of memory\n");
+    THROW;
+  }
+  for (i = 0; i != n; ++i) {
+    gains[i] = (i < nparams) ? Gain(body, 4 + 4 * i, true)
+                             : Gain(body, g_locals[i - nparams], false);
+  }
+
+  homes = 0;
+  for (;;) {
+    best = -1;
+    for (i = 0; i != n; ++i) {
+      if (gains[i] > 0 && (best < 0 || gains[i] > gains[best])) {
+        best = i;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    gain = gains[best];
+    gains[best] = 0;
+
+    taken = used | homes;
+    if (best < nparams && !(taken & 1 << best)) {
+      f = best;
+    } else {
+      /* Not holding a parameter still to be moved by the prolog */
+      if (best < nparams) {
+        taken |= (1 << nparams) - 1;
+      }
+      for (f = 0; f != kRegMT && (taken & 1 << f); ++f) {
+        /* Skip */
+      }
+      if (f == kRegMT) {
+        continue;
+      }
+    }
+    a = (best < nparams) ? 4 + 4 * best : g_locals[best - nparams];
+
+    memcpy(saved, g_mem + g_enter, (g_pc - g_enter) * sizeof(*saved));
+    if (best < nparams) {
+      g_mem[g_enter + 2 + best] = (f == best)
+                                  ? kNop : f << 24 | kOpMov << 16 | best;
+    }
+    for (pc = body; pc != g_pc; ++pc) {
+      ir = g_mem[pc];
+      x = (ir >> 24) & 0xF;
+      if (!(ir & kInsnMsb) || (ir & kInsnQ) || ((ir >> 20) & 0xF) != kRegSP
+          || (ir & 0xFFFF) - g_frames[pc] != a) {
+        continue;
+      }
+      if (ir & kInsnU) {
+        g_mem[pc] = f << 24 | kOpMov << 16 | x;         /* MOV R.f, R.x */
+      } else if (ir & kInsnV) {
+        g_mem[pc] = kInsnQ | x << 24 | f << 20 | kOpAnd << 16 | 0xFF;
+      } else {
+        g_mem[pc] = x << 24 | kOpMov << 16 | f;         /* MOV R.x, R.f */
+      }
+    }
+
+    /* Unless spilling it around calls costs as much */
+    for (pc = body; !g_leaf && pc != g_pc; ++pc) {
+      if (IsCall(g_mem[pc]) && !Unused(pc + 1, 1 << f, 0, kPeepDepth)) {
+        gain -= 2;
+      }
+    }
+    if (gain > 0) {
+      homes |= 1 << f;
+      slots[f] = a;
+    } else {
+      memcpy(g_mem + g_enter, saved, (g_pc - g_enter) * sizeof(*saved));
+    }
+  }
+  free(gains);
+  free(saved);
+
+  if (homes && !g_leaf) {
+    Spill(body, homes, slots);
+  }
+}
+
+/* Returns the no. of loads and stores of the parameter (if param) or local
+ * variable at offset a of the frame, or 0 if it cannot be kept in a register:
+ * its address is taken, or it is accessed other than by loads (of words, or
+ * its least significant byte) or word stores not followed by a read of N and
+ * Z. Addresses taken within the frame otherwise are assumed to be those of
+ * other variables (as are indices of arrays, being checked).
+ */
+static int
+Gain(const int body, const int a, const bool param)
+{
+  int32_t       ir;
+  int           pc;
+  int           off;        /* Offset of a load or store in the frame */
+  int           n;          /* No. of loads and stores */
+
+  /* The prolog stores parameters */
+  n = param;
+  for (pc = body; pc != g_pc; ++pc) {
+    ir = g_mem[pc];
+    if ((ir & kInsnMsb) && (ir & kInsnQ)) {
+      continue;
+    }
+    if (ir & kInsnMsb) {
+      off = (ir & 0xFFFF) - g_frames[pc];
+      if (((ir >> 20) & 0xF) != kRegSP || off < 0 || off / 4 != a / 4) {
+        continue;
+      }
+      if (off != a || ((ir & kInsnU) && ((ir & kInsnV)
+                        || !Unused(pc + 1, 0, kLiveNZ, kPeepDepth)))) {
+        return 0;
+      }
+      ++n;
+    } else if ((Uses(ir) & 1 << kRegSP) && ((ir >> 24) & 0xF) != kRegSP
+               && (((ir >> 16) & 0xF) != kOpAdd || (ir & (kInsnU | kInsnV))
+                   || ((ir & kInsnQ)
+                       && (ir & 0xFFFF) - g_frames[pc] == a))) {
+      return 0;
+    }
+  }
+  return n;
+}
+
+/* Stores the registers in the bit set homes around every call in the body
+ * starting at pc after which they may be read, in the variables at the
+ * offsets in the frame given by slots, and loads them again afterwards. The
+ * code following each call is moved down to make room.
+ */
+static void
+Spill(int pc, const int homes, const int * const slots)
+{
+  int32_t       ir;
+  int *         live;       /* Registers to spill, per instruction */
+  int *         addr;       /* New address per old one */
+  int           body;       /* Address of the body */
+  int           f;
+  int           k;          /* No. of registers spilled by an instruction */
+  int           to;         /* Jump target */
+
+  body = pc;
+  if (!(live = calloc(g_pc + 1, sizeof(*live)))
+      || !(addr = malloc((g_pc + 1) * sizeof(*addr)))) {
+    fprintf(stderr, "Out of memory\n");
+    THROW;
+  }
+  for (; pc != g_pc; ++pc) {
+    if (IsCall(g_mem[pc])) {
+      for (f = 0; f != kRegMT; ++f) {
+        if ((homes & 1 << f) && !Unused(pc + 1, 1 << f, 0, kPeepDepth)) {
+          live[pc] |= 1 << f;
+        }
+      }
+    }
+  }
+
+  /* The address of the first instruction inserted before each one */
+  for (pc = 0; pc <= g_pc; ++pc) {
+    addr[pc] = pc ? addr[pc - 1] + 1 : 0;
+    for (f = 0; pc && f != kRegMT; ++f) {
+      addr[pc] += 2 * ((live[pc - 1] >> f) & 1);
+    }
+  }
+  Reserve(addr[g_pc] - g_pc);
+
+  for (pc = g_pc - 1; pc >= body; --pc) {
+    ir = g_mem[pc];
+    k = addr[pc];
+    for (f = 0; f != kRegMT; ++f) {
+      if (live[pc] & 1 << f) {
+        g_mem[k] = kInsnMsb | kInsnU | f << 24 | kRegSP << 20
+                   | (slots[f] + g_frames[pc]);            /* STW R.f */
+        g_frames[k++] = g_frames[pc];
+      }
+    }
+    if ((ir & kInsnMsb) && (ir & kInsnQ) && (ir & kInsnU)) {
+      to = pc + 1 + Offset(ir);
+      if (to > 0) {
+        to = addr[to];
+      }
+      ir = (ir & ~0xFFFFFF) | ((to - k - 1) & 0xFFFFFF);
+    }
+    g_mem[k] = ir;
+    g_frames[k] = g_frames[pc];
+    for (f = 0; f != kRegMT; ++f) {
+      if (live[pc] & 1 << f) {
+        g_mem[++k] = kInsnMsb | f << 24 | kRegSP << 20
+                     | (slots[f] + g_frames[pc]);          /* LDW R.f */
+        g_frames[k] = g_frames[pc];
+      }
+    }
+  }
+
+  for (k = 0; k != g_nrelocs; ++k) {
+    if (g_relocs[2 * k] >= body) {
+      g_relocs[2 * k] = addr[g_relocs[2 * k]];
+      g_relocs[2 * k + 1] = addr[g_relocs[2 * k + 1]];
+      Repatch(k);
+    }
+  }
+  g_pc = addr[g_pc];
+  free(live);
+  free(addr);
+}
+
+/* Returns whether ir calls a procedure, rather than merely loading the
+ * address of the instruction following it (see Load)
+ */
+static inline bool
+IsCall(const int32_t ir)
+{
+  return (ir & kInsnMsb) && (ir & kInsnQ) && (ir & kInsnV)
+         && ((ir >> 24) & 0xF) != kCondFalse
+         && (!(ir & kInsnU) || (ir & 0xFFFFFF));
+}
+
+/* Shrinks the prolog of the procedure compiled since g_enter, which calls no
+ * others (nor takes their addresses) and hence leaves LNK unchanged, by
+ * deleting the store of LNK. Returns whether the frame is still needed, the
+ * SUB allocating it being deleted if not.
+ */
+static bool
+Leaf(void)
+{
+  int           pc;
+
+  assert(g_mem[g_enter + 1]
+         == (kInsnMsb | kInsnU | kRegLNK << 24 | kRegSP << 20));
+
+  g_mem[g_enter + 1] = kNop;
+  for (pc = g_enter + 1; pc != g_pc; ++pc) {
+    if ((!(g_mem[pc] & kInsnMsb) || !(g_mem[pc] & kInsnQ))
+        && (Uses(g_mem[pc]) & 1 << kRegSP)) {
+      return true;
+    }
+  }
+  g_mem[g_enter] = kNop;
+  return false;
+}
@@ -7,6 +7,7 @@
 #include <stdint.h>
 
 #include "orb.h"
+#include "risc.h"
 
 /*
  * Addressing modes, serving as tags of items. The columns below specify the
@@ -93,12 +94,15 @@ extern void     ORG_Fixup(item_t * const);
 extern int      ORG_PrepCall(item_t * const);
 extern void     ORG_Call(item_t * const, int);
 extern void     ORG_Enter(const int, const int);
+extern void     ORG_Local(const int);
 extern void     ORG_Return(const form_t, item_t * const, const int);
 extern void     ORG_Increment(const bool, item_t * const, item_t * const);
 extern void     ORG_Include(const bool, item_t * const, item_t * const);
 extern void     ORG_Assert(item_t * const);
 extern void     ORG_Read(item_t * const);
 extern void     ORG_Write(const bool, item_t * const);
+extern void     ORG_ReadBlock(item_t * const, item_t * const);
+extern void     ORG_WriteBlock(item_t * const, item_t * const);
 extern void     ORG_Get(const bool, item_t * const, item_t * const);
 extern void     ORG_Copy(item_t * const, item_t * const, item_t * const);
 extern void     ORG_Abs(item_t * const);
@@ -113,9 +117,13 @@ extern void     ORG_Condition(item_t * const);
 extern void     ORG_Open(void);
 extern void     ORG_SetDataSize(const int);
 extern void     ORG_Header(void);
-extern void     ORG_Close(void);
+extern void     ORG_Close(risc_image_t * const);
+extern int      ORG_Checks(int * const);
+extern const int *ORG_Frames(void);
+extern void     ORG_Optimize(void);
+extern int      ORG_Relocated(const int);
 
 /* Assembly */
-extern void     ORG_Decode(void);
+extern void     ORG_Decode(const unsigned long * const);
 
 #endif
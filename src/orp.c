@@ -3,16 +3,21 @@
 #include "orp.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "batch.h"
+#include "cache.h"
 #include "except.h"
 #include "orb.h"
 #include "ors.h"
 #include "org.h"
 #include "risc.h"
 #include "pool.h"
+#include "server.h"
 
 /* Type declarations for pointers in Oberon may forward-reference their base
  * types, as in, e.g.,
@@ -34,6 +39,18 @@ struct ptrBase_s {
   type_t *    type;         /* The pointer type referencing name (Node) */
 };
 
+/* Entry point of a procedure (or the module body), recorded for profiling */
+typedef struct {
+  char          name[kIdLen];
+  int           entry;      /* Code address of the first instruction */
+  unsigned long count;      /* Executed instructions (see Profile) */
+} proc_t;
+
+enum {
+  kMaxProcs = 128,          /* Max. no. of recorded procedures */
+  kTopProcs = 10            /* No. of procedures listed by Profile */
+};
+
 /* Prototypes */
 static inline void   Consume(void);
 static inline void   Expect(const int, const char * const);
@@ -95,6 +112,15 @@ static void          Declarations(int * const);
 static void          ProcedureDecl(void);
 static void          Procedures(void);
 static void          Module(void);
+static bool          Compile(const char * const, const int);
+static void          Run(const risc_image_t * const, const char * const,
+                         const int, const int, const int64_t);
+static void          RecordProc(const char * const);
+static void          Profile(const unsigned long * const);
+static void          Fold(const int * const, const int, const char * const);
+static const char *  ProcName(const int);
+static int           CompareStacks(const void *, const void *);
+static int           CompareProcs(const void *, const void *);
 
 /* Global exception handler */
 jmp_buf * g_handler;
@@ -104,8 +130,12 @@ static int           g_sym;      /* Last read symbol */
 static int           g_dc;       /* Data counter (for variable declarations) */
 static int           g_level;    /* Incremented on entering procedures */
 static ptrBase_t *   g_pbs_list; /* List of ptr base type forward-references */
-static int           g_sb;       /* Start address for globals */
-static int           g_entry;    /* Address of first instruction to execute */
+static risc_image_t  g_image;    /* Compiled program */
+static proc_t        g_procs[kMaxProcs]; /* Procedures by entry address */
+static int           g_nprocs;   /* Number of recorded procedures */
+static char * const *g_inputs;   /* Input files (see ORP_Batch) */
+static int           g_ninputs;  /* Number of input files */
+static bool          g_optimize; /* Whether to optimize (kOptOptimize) */
 
 /*
  * Dummy object used to continue parsing after failing to look up an
@@ -116,10 +146,92 @@ static object_t      g_dummy = {
 };
 
 void
-ORP_Compile(const char * const fname, const int sflag)
+ORP_Compile(const char * const fname, const char * const out, const int opts,
+            const int memsz, const int64_t budget)
+{
+  risc_vm_t *   vm;
+  risc_image_t  cached;       /* Image from an earlier compilation */
+  int           cgopts;       /* Options affecting the generated code */
+  const int *   samples;      /* Call stacks sampled (see RISC_Samples) */
+  int           len;          /* Size of samples */
+  int           checks;       /* No. of array indices checked */
+  int           removed;      /* No. of those checks removed */
+
+  /* Reuse an earlier compilation, unless the compiler's tables are needed */
+  cgopts = opts & ~(kOptAsm | kOptJit | kOptProfile | kOptSnapshot
+                    | kOptTrace | kOptDump | kOptSample | kOptBatch
+                    | kOptServe | kOptChecks);
+  if (!(opts & (kOptAsm | kOptProfile | kOptSample | kOptChecks))
+      && Cache_Find(fname, cgopts, &cached)) {
+    Run(&cached, out, opts, memsz, budget);
+    RISC_Close(&cached);
+    return;
+  }
+
+  if (Compile(fname, opts)) {
+    if (opts & kOptChecks) {
+      checks = ORG_Checks(&removed);
+      fprintf(stderr, "Index checks: %d of %d removed\n", removed, checks);
+    }
+    if (opts & kOptAsm) {
+      /* Print assembly */
+      ORG_Decode(NULL);
+    } else if ((opts & kOptSample) || ((opts & kOptProfile) && !out)) {
+      /* Run, counting executed instructions and/or sampling call stacks */
+      if (opts & kOptProfile) {
+        vm = RISC_Load(&g_image, memsz, budget,
+                       kRiscProfile | (ORP_Flags(opts) & ~kRiscJit)
+                       | ((opts & kOptSample) ? kRiscSample : 0));
+      } else {
+        vm = RISC_Load(&g_image, memsz, budget,
+                       kRiscSample | ORP_Flags(opts));
+      }
+      if (vm) {
+        RISC_Frames(vm, ORG_Frames());
+        while (RISC_Run(vm, INT_MAX) == kRiscPreempted) {
+          /* Keep going */
+        }
+        if (opts & kOptSample) {
+          samples = RISC_Samples(vm, &len);
+          Fold(samples, len, out);
+        }
+        if (opts & kOptProfile) {
+          Profile(RISC_Counts(vm));
+        }
+        RISC_Destroy(vm);
+      }
+    } else {
+      Cache_Add(&g_image);
+      Run(&g_image, out, opts, memsz, budget);
+    }
+  } else {
+    fprintf(stderr, "compilation FAILED\n");
+  }
+}
+
+/* Compiles the module in the file fname like ORP_Compile, then runs it once
+ * for each of the n files in inputs (see Batch_Run)
+ */
+void
+ORP_Batch(const char * const fname, char * const * const inputs, const int n,
+          const int opts, const int memsz, const int64_t budget)
+{
+  assert(inputs || !n);
+
+  g_inputs = inputs;
+  g_ninputs = n;
+  ORP_Compile(fname, NULL, opts | kOptBatch, memsz, budget);
+}
+
+/* Compiles the module in the file fname into g_image, returning whether that
+ * succeeded
+ */
+static bool
+Compile(const char * const fname, const int opts)
 {
   /* Initialize lexer */
   ORS_Init(fname);
+  g_optimize = opts & kOptOptimize;
 
   TRY
     /* Push arena for globals */
@@ -140,17 +252,70 @@ ORP_Compile(const char * const fname, const int sflag)
 
   /* Free lexer */
   ORS_Free();
+  return g_errcnt == 0;
+}
 
-  if (g_errcnt == 0) {
-    if (sflag) {
-      /* Print assembly */
-      ORG_Decode();
-    } else {
-      /* Run interpreter */
-      RISC_Interpret(g_sb, g_entry);
+/* Returns the flags for the RISC emulator selected by opts */
+int
+ORP_Flags(const int opts)
+{
+  int           flags;
+
+  flags = 0;
+  if (opts & kOptJit) {
+    flags |= kRiscJit;
+  }
+  if (opts & kOptTrace) {
+    flags |= kRiscTrace;
+  }
+  if (opts & kOptDump) {
+    flags |= kRiscDump;
+  }
+  return flags;
+}
+
+/* Saves the compiled image (or a snapshot) to the file out, if given, or
+ * else runs it. With kOptServe, out instead names the socket to serve runs on.
+ */
+static void
+Run(const risc_image_t * const image, const char * const out, const int opts,
+    const int memsz, const int64_t budget)
+{
+  risc_vm_t *   vm;
+
+  if (opts & kOptServe) {
+    /* Fork a run for every connection from a VM ready to go */
+    if ((vm = RISC_Load(image, memsz, budget, ORP_Flags(opts)))) {
+      Server_Run(vm, out);
+      RISC_Destroy(vm);
+    }
+  } else if (out && (opts & kOptSnapshot)) {
+    /* Run up to the first input, saving the state from there on */
+    vm = RISC_Load(image, memsz, budget, ORP_Flags(opts));
+    if (vm) {
+      RISC_Snapshot(vm, out);
+      while (RISC_Run(vm, INT_MAX) == kRiscPreempted) {
+        /* Keep going */
+      }
+      if (!RISC_Snapped(vm)) {
+        fprintf(stderr, "No snapshot taken, as no input was read\n");
+      }
+      RISC_Destroy(vm);
+    }
+  } else if (opts & kOptBatch) {
+    /* Run once for every input, in parallel */
+    Batch_Run(image, g_inputs, g_ninputs, memsz, budget, ORP_Flags(opts));
+  } else if (out) {
+    /* Save the image for running it later (see RISC_Open) */
+    if (!RISC_Save(image, out)) {
+      fprintf(stderr, "Cannot write %s\n", out);
     }
+  } else if (opts & kOptJit) {
+    /* Translate to native code */
+    RISC_Jit(image, memsz, budget, ORP_Flags(opts));
   } else {
-    fprintf(stderr, "compilation FAILED\n");
+    /* Run interpreter */
+    RISC_Interpret(image, memsz, budget, ORP_Flags(opts));
   }
 }
 
@@ -1160,6 +1325,16 @@ StandProc(int32_t n)
     CheckInt(&z);
     ORG_Copy(&x, &y, &z);
     break;
+  case 11: /* ReadBlock(a, n) */
+    CheckReadOnly(&x);
+    CheckInt(&y);
+    CheckReadOnly(&y);
+    ORG_ReadBlock(&x, &y);
+    break;
+  case 12: /* WriteBlock(a, n) */
+    CheckInt(&y);
+    ORG_WriteBlock(&x, &y);
+    break;
   default:
     assert(0);
   }
@@ -2133,6 +2308,7 @@ ProcedureDecl(void)
   int           parblksz; /* Size of parameters */
   int           locblksz; /* Size of parameters + locally declared variables */
   int           l;        /* Label */
+  object_t *    obj;
 
   assert(g_sym == kSymProcedure);
 
@@ -2176,6 +2352,15 @@ ProcedureDecl(void)
     ORG_FixOne(l);
     proc->val = ORG_Here() * 4;
   }
+  RecordProc(proc->name);
+
+  /* Local variables that may be kept in registers */
+  for (obj = g_top_scope->rlink; obj; obj = obj->rlink) {
+    if (obj->tag == kObjVar && obj->val >= parblksz && obj->type->size == 4
+        && obj->type->tag != kTypeArray && obj->type->tag != kTypeRecord) {
+      ORG_Local(obj->val);
+    }
+  }
 
   /* Procedure body */
   ORG_Enter(parblksz, locblksz);
@@ -2227,6 +2412,7 @@ static void
 Module(void)
 {
   char      modid[kIdLen];
+  int       i;
 
   /* Parse module declaration */
   printf("\nCompiling ");
@@ -2248,6 +2434,7 @@ Module(void)
   /* Initialization */
   g_level = 0;
   g_dc = 0;
+  g_nprocs = 0;
 
   ORB_OpenScope();
 
@@ -2258,7 +2445,8 @@ Module(void)
   Procedures();
 
   /* Save the code address with which to initialize the RISC-0's PC register */
-  g_entry = ORG_Here();
+  g_image.entry = ORG_Here();
+  RecordProc(modid);
 
   /* Code executed upon loading the module */
   ORG_Header();
@@ -2281,15 +2469,174 @@ Module(void)
     ORS_Mark("period missing");
   }
   ORB_CloseScope();
-  ORG_Close();
-
-  /* Save start address for globals */
-  g_sb = ORG_Here();
+  if (g_optimize && g_errcnt == 0) {
+    ORG_Optimize();
+  }
+  ORG_Close(&g_image);
+  if (g_errcnt == 0) {
+    /* Move the recorded entry points along with the code */
+    g_image.entry = ORG_Relocated(g_image.entry);
+    for (i = 0; i != g_nprocs; ++i) {
+      g_procs[i].entry = ORG_Relocated(g_procs[i].entry);
+    }
+  }
 
   /* Reset list of forward declarations */
   g_pbs_list = NULL;
 }
 
+/* Records the current code address as the entry point of the named procedure.
+ * As procedure bodies are generated in order, so are the entries recorded.
+ */
+static void
+RecordProc(const char * const name)
+{
+  assert(name);
+
+  if (g_nprocs != kMaxProcs) {
+    strcpy(g_procs[g_nprocs].name, name);
+    g_procs[g_nprocs].entry = ORG_Here();
+    g_procs[g_nprocs].count = 0;
+    ++g_nprocs;
+  }
+}
+
+/* Prints the procedures that executed the most instructions, followed by the
+ * assembly annotated with the number of executions per instruction
+ */
+static void
+Profile(const unsigned long * const counts)
+{
+  unsigned long total;
+  int           pc;
+  int           i;
+
+  assert(counts);
+
+  /* Attribute every instruction to the last procedure starting before it */
+  total = 0;
+  i = -1;
+  for (pc = 0; pc != g_image.sb; ++pc) {
+    while (i + 1 != g_nprocs && g_procs[i + 1].entry <= pc) {
+      ++i;
+    }
+    if (i >= 0) {
+      g_procs[i].count += counts[pc];
+    }
+    total += counts[pc];
+  }
+  qsort(g_procs, g_nprocs, sizeof(*g_procs), CompareProcs);
+
+  printf("\nProfile (%lu instructions):\n", total);
+  printf("     Count      %%  Procedure\n");
+  for (i = 0; i != g_nprocs && i != kTopProcs && g_procs[i].count; ++i) {
+    printf("%10lu  %5.1f  %s\n", g_procs[i].count,
+           100.0 * g_procs[i].count / total, g_procs[i].name);
+  }
+  putchar('\n');
+  ORG_Decode(counts);
+}
+
+/* Writes the sampled call stacks to the file out (or stdout if NULL) in the
+ * folded format taken by flame graph tools: one line per distinct stack,
+ * listing the procedures from the module body inwards, separated by
+ * semicolons, followed by the number of samples.
+ */
+static void
+Fold(const int * const samples, const int len, const char * const out)
+{
+  FILE *        fp;
+  char **       stacks;
+  char *        p;
+  int           nstacks;
+  int           pos;
+  int           n;
+  int           i;
+  int           j;
+
+  assert(!len || samples);
+
+  /* Count the samples */
+  nstacks = 0;
+  for (pos = 0; pos != len; pos += 1 + samples[pos]) {
+    ++nstacks;
+  }
+  if (!(stacks = calloc(nstacks ? nstacks : 1, sizeof(*stacks)))) {
+    fprintf(stderr, "Out of memory\n");
+    return;
+  }
+
+  /* Spell out every stack, outermost procedure first */
+  for (pos = 0, i = 0; pos != len; pos += 1 + n, ++i) {
+    n = samples[pos];
+    if (!(p = stacks[i] = malloc(n * kIdLen + 1))) {
+      break;
+    }
+    *p = '\0';
+    for (j = n; j != 0; --j) {
+      p += sprintf(p, j == n ? "%s" : ";%s", ProcName(samples[pos + j]));
+    }
+  }
+
+  /* Sort them, so that equal stacks can be counted as a single line */
+  if (i == nstacks) {
+    qsort(stacks, nstacks, sizeof(*stacks), CompareStacks);
+    if (!out) {
+      printf("\nSamples (%d):\n", nstacks);
+      fp = stdout;
+    } else if (!(fp = fopen(out, "w"))) {
+      fprintf(stderr, "Cannot write %s\n", out);
+    }
+    if (fp) {
+      for (i = 0; i != nstacks; i = j) {
+        for (j = i + 1; j != nstacks && !strcmp(stacks[i], stacks[j]); ++j) {
+          /* Count equal stacks */
+        }
+        fprintf(fp, "%s %d\n", stacks[i], j - i);
+      }
+      if (fp != stdout && fclose(fp)) {
+        fprintf(stderr, "Cannot write %s\n", out);
+      }
+    }
+  } else {
+    fprintf(stderr, "Out of memory\n");
+  }
+
+  for (i = 0; i != nstacks; ++i) {
+    free(stacks[i]);
+  }
+  free(stacks);
+}
+
+/* Returns the name of the procedure containing code address pc */
+static const char *
+ProcName(const int pc)
+{
+  int           i;
+
+  for (i = g_nprocs; i != 0 && g_procs[i - 1].entry > pc; --i) {
+    /* Procedures are recorded in order of their entry addresses */
+  }
+  return i ? g_procs[i - 1].name : "?";
+}
+
+/* Orders call stacks alphabetically */
+static int
+CompareStacks(const void *p, const void *q)
+{
+  return strcmp(*(char * const *)p, *(char * const *)q);
+}
+
+/* Orders procedures by decreasing instruction counts */
+static int
+CompareProcs(const void *p, const void *q)
+{
+  const proc_t * const  x = p;
+  const proc_t * const  y = q;
+
+  return (x->count < y->count) - (x->count > y->count);
+}
+
 #ifdef TEST
 
 #include "minunit.h"
@@ -2303,10 +2650,22 @@ Module(void)
 } while (0)
 
 enum {
-  kMaxArgs = 4
+  kMaxArgs = 4,
+  kMaxOutput = 0x400        /* Max. size of the output of a test run */
 };
 
+/* Outcome of running a test program (see Execute) */
+typedef struct {
+  int           sb;         /* Size of the code in words */
+  unsigned long steps;      /* No. of instructions executed */
+  bool          trapped;    /* Whether the program stopped on a trap */
+  char          out[kMaxOutput];
+} run_t;
+
 static char * TestFile(const char * const);
+static bool   Execute(const char * const, const int, const char * const,
+                      run_t * const);
+static int    Count(const char * const, const char * const);
 
 char *
 TestParser(void)
@@ -2325,11 +2684,301 @@ TestParser(void)
   return NULL;
 }
 
+/* Checks that input read in blocks arrives whole, with a short final block
+ * and 0 bytes at (and past) its end
+ */
+char *
+TestBlocks(void)
+{
+  static const struct {
+    const char *  in;
+    const char *  out;
+  } tests[] = {
+    { "abcdefghij", "4:abcd 4:efgh 2:ij 3 10 0" },
+    { "abcdefgh", "4:abcd 4:efgh 2 8 0" },
+    { "", "0 0 0" }
+  };
+  run_t         run;
+  size_t        i;
+
+  for (i = 0; i != sizeof(tests) / sizeof(tests[0]); ++i) {
+    ASSERT_TRUE(Execute("test/block.mod", 0, tests[i].in, &run));
+    ASSERT_FALSE(run.trapped);
+    ASSERT_EQ(0, strcmp(tests[i].out, run.out));
+  }
+  return NULL;
+}
+
+/* Checks that a literal still referred to as a string survives being turned
+ * into a CHAR elsewhere, with and without the peephole optimizer
+ */
+char *
+TestLiterals(void)
+{
+  run_t         run;
+
+  ASSERT_TRUE(Execute("test/literals.mod", 0, "", &run));
+  ASSERT_EQ(0, strcmp("xxh", run.out));
+  ASSERT_TRUE(Execute("test/literals.mod", kOptOptimize, "", &run));
+  ASSERT_EQ(0, strcmp("xxh", run.out));
+  return NULL;
+}
+
+/* Checks that every peephole rule shrinks the code (or, for jumps, the
+ * instructions executed) of a program exercising it, leaving its output as is
+ */
+char *
+TestOptimizer(void)
+{
+  static const struct {
+    const char *  fname;
+    const char *  out;
+    int           saved;    /* No. of instructions deleted */
+  } tests[] = {
+    { "test/opt/store.mod", "42", 2 },
+    { "test/opt/cmp.mod", "10", 3 },
+    { "test/opt/fold.mod", "55", 6 },
+    { "test/opt/jump.mod", "1", 0 },
+    { "test/opt/cycle.mod", "0", 1 },
+    { "test/opt/copy.mod", "42", 1 }
+  };
+  run_t         run;
+  run_t         opt;
+  size_t        i;
+
+  for (i = 0; i != sizeof(tests) / sizeof(tests[0]); ++i) {
+    ASSERT_TRUE(Execute(tests[i].fname, 0, "", &run));
+    ASSERT_TRUE(Execute(tests[i].fname, kOptOptimize, "", &opt));
+    ASSERT_EQ(0, strcmp(tests[i].out, run.out));
+    ASSERT_EQ(0, strcmp(tests[i].out, opt.out));
+    ASSERT_EQ(tests[i].saved, run.sb - opt.sb);
+    ASSERT_TRUE(opt.steps < run.steps);
+  }
+  return NULL;
+}
+
+/* Checks the output of programs whose variables are kept in registers, or
+ * must not be, with and without the peephole optimizer
+ */
+char *
+TestRegisters(void)
+{
+  static const struct {
+    const char *  fname;
+    const char *  out;
+  } tests[] = {
+    { "test/regs/spill.mod", "34025 440990" },
+    { "test/regs/recurse.mod", "610 9" },
+    { "test/regs/frame.mod", "4334" },
+    { "test/regs/many.mod", "558" }
+  };
+  run_t         run;
+  size_t        i;
+
+  for (i = 0; i != sizeof(tests) / sizeof(tests[0]); ++i) {
+    ASSERT_TRUE(Execute(tests[i].fname, 0, "", &run));
+    ASSERT_EQ(0, strcmp(tests[i].out, run.out));
+    ASSERT_TRUE(Execute(tests[i].fname, kOptOptimize, "", &run));
+    ASSERT_EQ(0, strcmp(tests[i].out, run.out));
+  }
+  return NULL;
+}
+
+/* Checks which index checks are removed, and that those kept still trap on
+ * an index out of range, with and without the peephole optimizer
+ */
+char *
+TestChecks(void)
+{
+  static const struct {
+    const char *  fname;
+    int           checks;
+    int           removed;
+    const char *  in;
+    const char *  out;
+    const char *  bad;
+  } tests[] = {
+    { "test/checks/fixed.mod", 3, 2, "10", "90", "11" },
+    { "test/checks/global.mod", 2, 1, "0", "4", "5" },
+    { "test/checks/mask.mod", 5, 4, "3", "6", "9" },
+    { "test/checks/open.mod", 4, 2, "5", "10 20", "6" }
+  };
+  static const int opts[] = { 0, kOptOptimize };
+  run_t         run;
+  size_t        i;
+  size_t        j;
+  int           removed;
+
+  for (i = 0; i != sizeof(tests) / sizeof(tests[0]); ++i) {
+    for (j = 0; j != sizeof(opts) / sizeof(opts[0]); ++j) {
+      ASSERT_TRUE(Execute(tests[i].fname, opts[j], tests[i].in, &run));
+      ASSERT_EQ(tests[i].checks, ORG_Checks(&removed));
+      ASSERT_EQ(tests[i].removed, removed);
+      ASSERT_FALSE(run.trapped);
+      ASSERT_EQ(0, strcmp(tests[i].out, run.out));
+      ASSERT_TRUE(Execute(tests[i].fname, opts[j], tests[i].bad, &run));
+      ASSERT_TRUE(run.trapped);
+    }
+  }
+  return NULL;
+}
+
+/* Checks that leaf procedures neither store LNK nor reserve a frame unless
+ * needed, and that stacks sampled within them still reach their callers
+ */
+char *
+TestLeaf(void)
+{
+  risc_vm_t *   vm;
+  const int *   samples;
+  FILE *        fin;
+  FILE *        fout;
+  run_t         run;
+  int           len;
+  int           pos;
+  int           n;
+  int           spins;      /* No. of samples taken within Spin */
+
+  ASSERT_TRUE(Execute("test/regs/leaf.mod", 0, "10", &run));
+  ASSERT_EQ(0, strcmp("316\n", run.out));
+
+  /* Add only returns, Spin releases the frame for its array */
+  ASSERT_EQ(0, Count("Add", "SP"));
+  ASSERT_EQ(1, Count("Add", "LNK"));
+  ASSERT_EQ(1, Count("Spin", "SUB SP, SP"));
+  ASSERT_EQ(1, Count("Spin", "ADD SP, SP"));
+  ASSERT_EQ(1, Count("Spin", "LNK"));
+  ASSERT_EQ(1, Count("Outer", "STW LNK, SP, 0"));
+  ASSERT_EQ(1, Count("Outer", "LDW LNK, SP, 0"));
+
+  /* Every stack sampled leads back to the module body */
+  ASSERT_NOT_NULL(fin = tmpfile());
+  ASSERT_NOT_NULL(fout = tmpfile());
+  ASSERT_TRUE(fputs("3000000", fin) >= 0 && !fflush(fin));
+  rewind(fin);
+  ASSERT_NOT_NULL(vm = RISC_Load(&g_image, 0, 0, kRiscSample));
+  RISC_Redirect(vm, fileno(fin), fout, stderr);
+  RISC_Frames(vm, ORG_Frames());
+  while (RISC_Run(vm, INT_MAX) == kRiscPreempted) {
+    /* Keep going */
+  }
+  samples = RISC_Samples(vm, &len);
+  spins = 0;
+  for (pos = 0; pos != len; pos += 1 + n) {
+    n = samples[pos];
+    ASSERT_EQ(0, strcmp("leaf", ProcName(samples[pos + n])));
+    if (!strcmp("Spin", ProcName(samples[pos + 1]))) {
+      ASSERT_EQ(3, n);
+      ASSERT_EQ(0, strcmp("Outer", ProcName(samples[pos + 2])));
+      ++spins;
+    }
+  }
+  RISC_Destroy(vm);
+  fclose(fin);
+  fclose(fout);
+  ASSERT_TRUE(spins > 0);
+  return NULL;
+}
+
+/* Compiles and runs the program in the file fname with and without the
+ * peephole optimizer, which must not change its output
+ */
 static char *
 TestFile(const char * const fname)
 {
-  ORP_Compile(fname, 0);
+  run_t         run;
+  run_t         opt;
+
+  ASSERT_TRUE(Execute(fname, 0, "", &run));
+  ASSERT_TRUE(Execute(fname, kOptOptimize, "", &opt));
+  ASSERT_EQ(0, strcmp(run.out, opt.out));
+  ASSERT_EQ(run.trapped, opt.trapped);
+  ASSERT_TRUE(opt.sb <= run.sb);
   return NULL;
 }
 
+/* Compiles the program in the file fname with the given options and runs it
+ * on the given input, storing the outcome in run. Returns false if it did not
+ * compile or could not be run.
+ */
+static bool
+Execute(const char * const fname, const int opts, const char * const in,
+        run_t * const run)
+{
+  risc_vm_t *   vm;
+  const unsigned long * counts;
+  FILE *        fin;
+  FILE *        fout;
+  FILE *        ferr;
+  size_t        n;
+  int           pc;
+
+  memset(run, 0, sizeof(*run));
+  if (!Compile(fname, opts)) {
+    return false;
+  }
+  run->sb = g_image.sb;
+  fin = tmpfile();
+  fout = tmpfile();
+  ferr = tmpfile();
+  vm = NULL;
+  if (fin && fout && ferr && fputs(in, fin) >= 0 && !fflush(fin)
+      && !fseek(fin, 0, SEEK_SET)
+      && (vm = RISC_Load(&g_image, 0, kMaxSteps, kRiscProfile))) {
+    RISC_Redirect(vm, fileno(fin), fout, ferr);
+    while (RISC_Run(vm, INT_MAX) == kRiscPreempted) {
+      /* Keep going */
+    }
+    counts = RISC_Counts(vm);
+    for (pc = 0; pc != run->sb; ++pc) {
+      run->steps += counts[pc];
+    }
+    RISC_Destroy(vm);
+    rewind(fout);
+    n = fread(run->out, 1, sizeof(run->out) - 1, fout);
+    run->out[n] = '\0';
+    rewind(ferr);
+    run->trapped = fgetc(ferr) != EOF;
+  }
+  if (fin) {
+    fclose(fin);
+  }
+  if (fout) {
+    fclose(fout);
+  }
+  if (ferr) {
+    fclose(ferr);
+  }
+  return vm != NULL;
+}
+
+/* Returns the number of instructions of the procedure named proc (as last
+ * compiled) whose assembly contains s, or -1 if there is no such procedure
+ */
+static int
+Count(const char * const proc, const char * const s)
+{
+  char          buf[kRiscAsmLen];
+  int           end;
+  int           pc;
+  int           n;
+  int           i;
+
+  for (i = 0; i != g_nprocs && strcmp(proc, g_procs[i].name); ++i) {
+    /* Look up proc */
+  }
+  if (i == g_nprocs) {
+    return -1;
+  }
+  end = i + 1 != g_nprocs ? g_procs[i + 1].entry : g_image.sb;
+  n = 0;
+  for (pc = g_procs[i].entry; pc != end; ++pc) {
+    RISC_Disassemble(g_image.code[pc], buf);
+    if (strstr(buf, s)) {
+      ++n;
+    }
+  }
+  return n;
+}
+
 #endif /* TEST */
@@ -3,6 +3,27 @@
 #ifndef ORP_H_
 #define ORP_H_
 
-extern void   ORP_Compile(const char * const, const int);
+#include <stdint.h>
+
+/* Options for ORP_Compile */
+enum {
+  kOptAsm = 0x1,  /* Print assembly instead of running the program */
+  kOptJit = 0x2,  /* Run the program through the JIT */
+  kOptProfile = 0x4, /* Count executed instructions per procedure */
+  kOptSnapshot = 0x8, /* Save a snapshot taken at the first input */
+  kOptTrace = 0x10, /* Show the last instructions executed on a trap */
+  kOptDump = 0x20, /* Show all of memory on a trap */
+  kOptSample = 0x40, /* Sample call stacks while running */
+  kOptBatch = 0x80, /* Run once for every input (see ORP_Batch) */
+  kOptServe = 0x100, /* Serve runs on the socket named by out */
+  kOptOptimize = 0x200, /* Run the peephole optimizer (see ORG_Optimize) */
+  kOptChecks = 0x400 /* Report the index checks removed (see ORG_Checks) */
+};
+
+extern void   ORP_Compile(const char * const, const char * const, const int,
+                          const int, const int64_t);
+extern void   ORP_Batch(const char * const, char * const * const, const int,
+                        const int, const int, const int64_t);
+extern int    ORP_Flags(const int);
 
 #endif /* ORP_H_ */
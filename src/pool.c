@@ -101,8 +101,9 @@ typedef union {
 } header_t;
 
 /* In contrast to LCC, blocks have constant size. They are allocated from a
- * dedicated memory pool and deallocated in constant time (along with the
- * objects they contain) by placing them on a free list.
+ * dedicated memory pool (or, once that is exhausted, from the heap) and
+ * deallocated in constant time (along with the objects they contain) by
+ * placing them on a free list.
  */
 
 #define ALIGN_SZ        (sizeof(max_align_t))
@@ -212,12 +213,16 @@ NewBlock(void)
   } else if (g_avail + BLOCK_SZ < g_limit) {   /* Else, allocate from pool */
     block = (node_t *)g_avail;
     g_avail += BLOCK_SZ;
-  } else {                                     /* Else, we ran out of memory */
+  } else if (!(block = malloc(BLOCK_SZ))) {    /* Else, allocate from heap */
+    /* We ran out of memory */
     fprintf(stderr, "Out of memory\n");
     THROW;
   }
 
-  /* Initialization */
+  /* Initialization (a block from the free list still links to its old
+   * successor)
+   */
+  block->rlink = NULL;
   block->limit = ((uint8_t *)block) + BLOCK_SZ;
   block->avail = ((uint8_t *)block) + sizeof(header_t);
 
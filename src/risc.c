@@ -1,11 +1,26 @@
 /* Ported from RISC.Mod.txt, part of the Oberon07 reference implementation. */
 
+#define _DEFAULT_SOURCE
+
 #include "risc.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "jit.h"
 
 enum {
   /* Condition registers (bitmasks) */
@@ -14,27 +29,364 @@ enum {
   kFlagC    =  0x2,                       /* Carry / borrow */
   kFlagV    =  0x1,                       /* oVerflow */
 
-  /* Misc. */
-  kNumSign  = ~0x7FFFFFFF,                /* Mask for extracting sign bit */
-  kMaxSteps = 100000                      /* Max no. of insns to execute */
+  /* Size of the guard region below the stack (in bytes). Covering the reach
+   * of an F2 offset, no access relative to SP can skip it.
+   */
+  kGuardSz  = 0x100000,
+
+  /* Sizes of the output and input buffers (in bytes) */
+  kOutSz    = 0x10000,
+  kInSz     = 0x10000,
+
+  /* Versions of the image and snapshot file formats */
+  kImageVersion = 1,
+  kSnapVersion  = 1,
+
+  /* Offset of the memory in a snapshot file, a multiple of the page size */
+  kSnapOffset   = 0x10000,
+
+  /* Number of executed instructions kept for kRiscTrace (a power of 2) */
+  kTraceLen     = 16,
+
+  /* Sampling (see kRiscSample): the interval of the profiling timer (in
+   * microseconds of CPU time), and the number of instructions after which
+   * the interpreter checks whether it expired
+   */
+  kSampleUsec   = 1000,
+  kSampleSteps  = 0x1000
+};
+
+/* Header of an image file, followed by the code and strings as laid out in
+ * risc_image_t. All words are stored in the byte order of the host.
+ */
+typedef struct {
+  char          magic[4];                 /* "ORI" followed by a NUL */
+  int32_t       version;                  /* kImageVersion */
+  int32_t       sb;
+  int32_t       varsize;
+  int32_t       strsz;
+  int32_t       entry;
+} header_t;
+
+/* Header of a snapshot file, followed by the memory at kSnapOffset (with the
+ * guard region left as a hole), from which execution is to be resumed
+ */
+typedef struct {
+  char          magic[4];                 /* "ORS" followed by a NUL */
+  int32_t       version;                  /* kSnapVersion */
+  int32_t       memsz;
+  int32_t       guard;
+  int32_t       sb;
+  int32_t       pc;
+  int32_t       reg[16];
+  int32_t       h;
+  int32_t       vb;
+  int32_t       vn;
+  int32_t       vr;
+  int64_t       res;
+} snapshot_t;
+
+/* Handlers for decoded instructions, one per opcode/format combination */
+enum {
+  /* Register instructions (F0: n is R.c, F1: n is im) */
+  kF0Mov,   kF1Mov,   kF0MovH,  kF0MovCC,
+  kF0Lsl,   kF1Lsl,   kF0Asr,   kF1Asr,   kF0Ror,   kF1Ror,
+  kF0And,   kF1And,   kF0Ann,   kF1Ann,   kF0Ior,   kF1Ior,
+  kF0Xor,   kF1Xor,   kF0Add,   kF1Add,   kF0Sub,   kF1Sub,
+  kF0Mul,   kF1Mul,   kF0Div,   kF1Div,
+
+  /* Memory instructions (F2) */
+  kF2Ldw,   kF2Ldb,   kF2Stw,   kF2Stb,
+
+  /* Branch instructions (F3) */
+  kF3Br,    kF3Blr,   kF3Bc,    kF3Bl,
+
+  /* Superinstructions for idioms emitted by the code generator (see Fuse).
+   * Each replaces the handler of the first instruction in its sequence.
+   */
+  kF1SubStw,                              /* SUB SP, SP, im; STW a, SP, off */
+  kF2LdwAddBr,                            /* LDW a, SP, off; ADD SP, SP, im;
+                                           * BR T, a */
+  kF0SubBc, kF1SubBc,                     /* CMP a, b, n; BC cond, off */
+  kF1LslAdd,                              /* LSL a, b, im; ADD a', b', c' */
+
+  /* Count or record the instruction before running its actual handler,
+   * taken from the shadow copy of the code (see kRiscProfile, kRiscTrace)
+   */
+  kCount,   kTrace,
+
+  /* Unrecognized opcode (kept in c) */
+  kIllegal
+};
+
+/* Executed instruction, as recorded for kRiscTrace */
+typedef struct {
+  int32_t       pc;                       /* Code address */
+  int32_t       ir;                       /* Instruction */
+  int32_t       res;                      /* R.a afterwards (F0-F2) */
+} trace_t;
+
+/* Decoded instruction. Fields not used by a handler are set to 0. */
+typedef struct {
+  uint8_t       op;                       /* Handler */
+  uint8_t       a;                        /* R.a (F0-F2) or condition (F3) */
+  uint8_t       b;                        /* R.b (F0-F2) */
+  uint8_t       c;                        /* R.c (F0, F3) */
+  int32_t       imm;                      /* im (F1), off (F2, F3) */
+} insn_t;
+
+/* Dispatch. If RISC_THREADED is defined (see DISPATCH in the Makefile), every
+ * handler ends in its own indirect jump through a table of label addresses,
+ * a GCC and Clang extension. Otherwise, all handlers jump back to a single
+ * switch statement.
+ */
+#ifdef RISC_THREADED
+#define SWITCH(op)      goto *labels[(op)];
+#define CASE(op)        L_##op
+#define DISPATCH()      goto *labels[ip->op]
+#else
+#define SWITCH(op)      dispatch: switch (op)
+#define CASE(op)        case op
+#define DISPATCH()      goto dispatch
+#endif
+
+/* Continues with the next instruction, unless execution halted */
+#define NEXT() do {                                       \
+  if (pc <= 0 || pc >= sb || ++cnt == limit) {            \
+    goto halt;                                            \
+  }                                                       \
+  ip = code + pc++;                                       \
+  DISPATCH();                                             \
+} while (0)
+
+/* Stores the result of a register instruction (or load) in R.a, records it
+ * for the N and Z flags and continues.
+ */
+#define RESULT(x) do {                                    \
+  val = (x);                                              \
+  vm->reg[ip->a] = val & 0xFFFFFFFF;                      \
+  vm->res = val;                                          \
+  NEXT();                                                 \
+} while (0)
+
+/* Moves on to the next instruction within a superinstruction. The checks
+ * otherwise done by NEXT have already been made upfront.
+ */
+#define STEP() do {                                       \
+  ++ip;                                                   \
+  ++pc;                                                   \
+  ++cnt;                                                  \
+} while (0)
+
+/* Counts executed superinstructions, if requested (see FUSE_STATS in the
+ * Makefile).
+ */
+#ifdef RISC_FUSE_STATS
+#define FUSED(op)       ++vm->fused[(op) - kF1SubStw]
+#else
+#define FUSED(op)
+#endif
+
+/* Operands of decoded instructions */
+#define R_B             vm->reg[ip->b]
+#define R_C             vm->reg[ip->c]
+
+/* Virtual machine. Everything that changes during execution is kept here, so
+ * that separate instances can run concurrently (one per thread).
+ */
+struct risc_vm_s {
+  /* Memory, laid out as code, globals, strings, guard region and stack */
+  int32_t *     mem;
+  int           memsz;                    /* Size in bytes */
+  int           guard;                    /* Start of guard region (bytes) */
+  sigjmp_buf    fault;                    /* Target for stack overflows */
+
+  /* Registers */
+  int           pc;                       /* Program counter */
+  int32_t       ir;                       /* Instruction register */
+  int32_t       reg[16];                  /* General-purpose registers r0-15 */
+  int32_t       h;                        /* For storing remainders */
+
+  /* Condition flags, evaluated lazily (see Cond). Rather than updating N, Z
+   * and V after every instruction, we record the last value that N and Z are
+   * to be derived from, along with the operands and result of the last ADD or
+   * SUB for determining V. For SUB, the complement of the subtrahend is
+   * recorded.
+   */
+  int64_t       res;                      /* Last result (N, Z) */
+  int32_t       vb;                       /* Last ADD/SUB operand R.b (V) */
+  int32_t       vn;                       /* Last ADD/SUB operand n or ~n (V) */
+  int32_t       vr;                       /* Last ADD/SUB result (V) */
+
+  /* Code region mem[0..sb) */
+  int           sb;                       /* Size in words */
+  insn_t *      code;                     /* Decoded instructions */
+  int64_t       steps;                    /* No. of executed insns */
+  int64_t       budget;                   /* Max. value of steps (0: none) */
+  bool          jit;                      /* Translate to native code */
+  bool          stale;                    /* Overwritten since translation */
+  jit_t         native;                   /* Translation (if jit) */
+
+  /* Streams for the program's input and output, and for error messages.
+   * Dumps on a trap go to the output. See RISC_Redirect.
+   */
+  int           infd;                     /* Default: stdin */
+  FILE *        outfp;                    /* Default: stdout */
+  FILE *        errfp;                    /* Default: stderr */
+
+  /* Output not yet written to outfp */
+  int           outlen;                   /* No. of bytes in out */
+  char          out[kOutSz];
+
+  /* Input from infd, either mapped in its entirety (if a regular file) or
+   * read in blocks of kInSz bytes, once the program first reads
+   */
+  const char *  in;                       /* Mapped file or buffer */
+  size_t        inpos;                    /* Next unread byte in in */
+  size_t        inlen;                    /* No. of bytes in in */
+  bool          mapped;                   /* Whether in is mapped */
+  bool          regular;                  /* Whether infd is a regular file */
+
+  /* Snapshot to be written upon the first input (see RISC_Snapshot) */
+  const char *  snap;                     /* File name, NULL if none */
+  bool          snapped;                  /* Whether it was written */
+
+  /* Profile (if kRiscProfile was set) */
+  unsigned long *counts;                  /* Executions per code address */
+  insn_t *      shadow;                   /* Decoded insns, for kCount/kTrace */
+
+  /* Diagnostics on a trap */
+  bool          tracing;                  /* kRiscTrace was set */
+  bool          dump;                     /* kRiscDump was set */
+  unsigned      ntrace;                   /* No. of recorded insns */
+  trace_t       trace[kTraceLen];         /* Ring buffer of the last ones */
+
+  /* Call stacks sampled (if kRiscSample was set), each stored as the number
+   * of frames followed by their code addresses, innermost first
+   */
+  bool          sampling;                 /* kRiscSample was set */
+  int *         entries;                  /* Prolog per code address, or -1 */
+  const int *   frames;                   /* See RISC_Frames, NULL if none */
+  int *         samples;
+  int           nsamples;                 /* No. of ints used in samples */
+  int           samplecap;                /* No. of ints allocated */
+
+#ifdef RISC_FUSE_STATS
+  /* Number of executed superinstructions, per handler */
+  unsigned long fused[kF1LslAdd - kF1SubStw + 1];
+#endif
 };
 
 /* Prototypes */
-static void         Dump(void);           /* Dumps VM state to standard out */
-static inline void  SetN(const int64_t);  /* Set N flag */
-static inline void  SetZ(const int64_t);  /* Set Z flag */
-static void         WriteStr(const int);  /* Write a string to stdout */
-static bool         IsTrue(const int);    /* Tests a jump condition */
-
-/* Memory */
-int32_t             g_mem[kMemSz/4];
-
-/* Registers */
-static int          g_pc;                 /* Program counter */
-static int32_t      g_ir;                 /* Instruction register */
-static int32_t      g_reg[16];            /* General-purpose registers r0-15 */
-static int32_t      g_h;                  /* For storing remainders */
-static uint8_t      g_cond;               /* Condition flags [N, Z, C, V] */
+static void         Launch(const risc_image_t * const, const int,
+                           const int64_t, const int);
+static risc_vm_t *  New(const int, const int, const int, const int);
+static void         Start(risc_vm_t * const, const int64_t, const int);
+static bool         WriteSnapshot(risc_vm_t * const);
+static void         Fault(int, siginfo_t *, void *);
+static void         Slice(risc_vm_t * const, const int);
+static void         SampledSlice(risc_vm_t * const, int);
+static void         Tick(int);
+static void         Sample(risc_vm_t * const);
+static int          Backtrace(const risc_vm_t * const, int * const);
+static bool         Halted(const risc_vm_t * const);
+static int          Native(risc_vm_t * const, const int);
+static int          Execute(risc_vm_t * const, int, const int);
+static void         Report(const risc_vm_t * const);
+static void         Decode(risc_vm_t * const, const int);
+static void         Fuse(risc_vm_t * const, const int);
+static void         Invalidate(risc_vm_t * const, const int);
+static void         Save(const risc_vm_t * const, jit_cpu_t * const);
+static void         Restore(risc_vm_t * const, const jit_cpu_t * const);
+static bool         IsProlog(const risc_vm_t * const, const int);
+static inline void  Record(risc_vm_t * const, const int);
+static void         Dump(const risc_vm_t * const);
+static void         DumpTrace(const risc_vm_t * const);
+static void         DumpMemory(const risc_vm_t * const);
+static uint8_t      Cond(const risc_vm_t * const);
+static inline bool  Overflow(const risc_vm_t * const);
+static inline int64_t Ror(const int32_t, const int32_t);
+static inline int64_t Add(risc_vm_t * const, const int32_t, const int32_t);
+static inline int64_t Sub(risc_vm_t * const, const int32_t, const int32_t);
+static inline int64_t Mul(risc_vm_t * const, const int32_t, const int32_t);
+static inline int64_t Div(risc_vm_t * const, const int32_t, const int32_t);
+static bool         Input(risc_vm_t * const, const int, const int32_t);
+static bool         ReadInt(risc_vm_t * const, int32_t * const);
+static bool         ReadBlock(risc_vm_t * const, const int);
+static int          Peek(risc_vm_t * const);
+static bool         Fill(risc_vm_t * const);
+static bool         Output(risc_vm_t * const, const int, const int32_t);
+static bool         WriteStr(risc_vm_t * const, const int);
+static bool         WriteBlock(risc_vm_t * const, const int);
+static bool         IsBlock(const risc_vm_t * const, const int);
+static bool         WriteInt(risc_vm_t * const, const int32_t);
+static bool         WriteChar(risc_vm_t * const, const int);
+static bool         Flush(risc_vm_t * const);
+static bool         IsTrue(const risc_vm_t * const, const int);
+
+/* Code and strings produced by the code generator (see risc_image_t), in a
+ * buffer grown by it as needed
+ */
+int32_t *           g_mem;
+
+/* Tables for RISC_Disassemble */
+
+/* Opcode mnemonics */
+static const char * const g_mnemo[] = {
+  "MOV", "LSL", "ASR", "ROR", "AND", "ANN",   /* Register instructions */
+  "IOR", "XOR", "ADD", "SUB", "MUL", "DIV",   /* Register instructions cont. */
+  "LDW", "LDB", "STW", "STB",                 /* Memory instructions */
+  "BR",  "BLR", "BC",  "BL"                   /* Branch instructions */
+};
+
+/* Conditions for use with branch instructions */
+static const char * const g_cond[] = {
+  "MI", "EQ", "CS", "VS", "LS", "LT", "LE", "T",
+  "PL", "NE", "CC", "VC", "HI", "GE", "GT", "F"
+};
+
+/* General-purpose register names */
+/* Register 12 (MT) was used by Wirth to point to a module table. The current
+ * implementation does not yet support separate compilation, but we have kept
+ * R12 reserved regardless.
+ */
+static const char * const g_regs[] = {
+  "R0",  "R1", "R2",  "R3",  "R4",  "R5",  "R6",  "R7",
+  "R8",  "R9", "R10", "R11", "MT",  "SB",  "SP",  "LNK"
+};
+
+/* Identify image and snapshot files */
+static const char   g_magic[4] = "ORI";
+static const char   g_snap_magic[4] = "ORS";
+
+/* The VM running on the current thread, if any, for Fault */
+static __thread risc_vm_t * g_running;
+
+/* Set by Tick whenever the profiling timer expires (see kRiscSample) */
+static volatile sig_atomic_t g_ticks;
+
+/* Truth table for the branch conditions. Bit k of g_truth[cond] is set iff
+ * cond holds when the flags [N, Z, V] read k in binary. As the carry is
+ * not emulated, conditions depending on C (CS, LS, CC, HI) never hold.
+ */
+static const uint8_t g_truth[16] = {
+  0xF0,                                   /* MI   N                          */
+  0xCC,                                   /* EQ   Z                          */
+  0x00,                                   /* CS   C                          */
+  0xAA,                                   /* VS   V                          */
+  0x00,                                   /* LS   ~C | Z                     */
+  0x5A,                                   /* LT   N != V                     */
+  0xDE,                                   /* LE   (N != V) | Z               */
+  0xFF,                                   /* T    1                          */
+  0x0F,                                   /* PL   ~N                         */
+  0x33,                                   /* NE   ~Z                         */
+  0x00,                                   /* CC   ~C                         */
+  0x55,                                   /* VC   ~V                         */
+  0x00,                                   /* HI   ~(~C | Z)                  */
+  0xA5,                                   /* GE   ~(N != V)                  */
+  0x21,                                   /* GT   ~((N != V) | Z)            */
+  0x00                                    /* F    0                          */
+};
 
 /* Runtime error messages */
 static const char * const g_trap[] = {
@@ -43,344 +395,2042 @@ static const char * const g_trap[] = {
   "index out of bounds",
   "division by zero",
   "assert failure",
-  "I/O exception"
+  "I/O exception",
+  "stack overflow"
 };
 
+risc_vm_t *
+RISC_Create(const risc_image_t * const image, const int memsz,
+            const int64_t budget, const int flags)
+{
+  risc_vm_t *       vm;
+  long              page;
+  int               n;
+
+  assert(image && image->code);
+  assert(0 < image->sb && image->sb <= kMaxCode);
+  assert(0 < memsz && memsz <= kMemMax && !(memsz % 4));
+  assert((long long)image->sb * 4 + image->varsize + image->strsz <= memsz);
+  assert(budget >= 0);
+
+  /* Map zeroed memory, only backed by physical pages once touched */
+  if (!(vm = New(image->sb, memsz, flags, -1))) {
+    return NULL;
+  }
+
+  /* Load code and strings, leaving the globals in between zero */
+  memcpy(vm->mem, image->code, image->sb * 4);
+  memcpy(vm->mem + image->sb + image->varsize / 4, image->code + image->sb,
+         image->strsz);
+
+  /* Protect the pages following the strings, if there is room left for a
+   * stack above them. Stack overflows then fault upon accessing the guard
+   * region, without any checks needed on the part of the code.
+   */
+  page = sysconf(_SC_PAGESIZE);
+  n = image->sb * 4 + image->varsize + image->strsz;
+  vm->guard = (n + page - 1) / page * page;
+  if (vm->guard + kGuardSz >= memsz
+      || mprotect((char *)vm->mem + vm->guard, kGuardSz, PROT_NONE)) {
+    vm->guard = memsz;
+  }
+
+  /* Registers */
+  memset(vm->reg, 0, sizeof(vm->reg));
+  vm->pc = image->entry;        /* Code address to fetch 1st insn from */
+  vm->h = 0;
+  vm->res = 1;                  /* Set all flags (N, Z, C, V) to 0 */
+  vm->vb = vm->vn = vm->vr = 0;
+  vm->reg[kRegSB] = vm->sb * 4; /* Globals start after code */
+  vm->reg[kRegSP] = memsz;      /* The stack grows downward */
+  vm->reg[kRegLNK] = 0;         /* A jump to 0 terminates the interpreter */
+
+  Start(vm, budget, flags);
+  return vm;
+}
+
+/* Continues execution from a snapshot written by RISC_Snapshot. Its memory is
+ * mapped copy-on-write, so only the pages actually written to get copied.
+ * Returns NULL if the file cannot be read or is not a valid snapshot.
+ */
+risc_vm_t *
+RISC_Resume(const char * const fname, const int64_t budget, const int flags)
+{
+  risc_vm_t *       vm;
+  snapshot_t        hdr;
+  struct stat       st;
+  int               fd;
+
+  assert(fname);
+  assert(budget >= 0);
+
+  if ((fd = open(fname, O_RDONLY)) < 0) {
+    return NULL;
+  }
+  vm = NULL;
+  if (!fstat(fd, &st) && pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)
+      && !memcmp(hdr.magic, g_snap_magic, sizeof(hdr.magic))
+      && hdr.version == kSnapVersion
+      && hdr.memsz >= kMemSz && hdr.memsz <= kMemMax && !(hdr.memsz % 4)
+      && hdr.sb > 0 && hdr.sb <= kMaxCode
+      && hdr.guard >= hdr.sb * 4 && hdr.guard <= hdr.memsz
+      && hdr.pc > 0 && hdr.pc < hdr.sb
+      && st.st_size == (off_t)kSnapOffset + hdr.memsz) {
+    vm = New(hdr.sb, hdr.memsz, flags, fd);
+  }
+  close(fd);
+  if (!vm) {
+    return NULL;
+  }
+
+  /* The guard region is restored as a hole in the file */
+  vm->guard = hdr.guard;
+  if (vm->guard + kGuardSz >= vm->memsz
+      || mprotect((char *)vm->mem + vm->guard, kGuardSz, PROT_NONE)) {
+    vm->guard = vm->memsz;
+  }
+
+  /* Registers */
+  memcpy(vm->reg, hdr.reg, sizeof(vm->reg));
+  vm->pc = hdr.pc;
+  vm->h = hdr.h;
+  vm->res = hdr.res;
+  vm->vb = hdr.vb;
+  vm->vn = hdr.vn;
+  vm->vr = hdr.vr;
+
+  Start(vm, budget, flags);
+  return vm;
+}
+
+/* Requests a snapshot of the VM to be written to fname once the program
+ * first reads input, after which execution ends. The snapshot is to be
+ * resumed from with RISC_Resume.
+ */
 void
-RISC_Interpret(const int sb, const int entry)
+RISC_Snapshot(risc_vm_t * const vm, const char * const fname)
 {
-  int64_t           val;    /* Result value of register instructions */
-  int32_t           b;      /* Operand R.b (F0, F1) or base address (F2) */
-  int32_t           n;      /* Operand R.c (F0), im (F1) or abs address (F2) */
-  int               a;      /* Result register R.a (F0-2) or condition (F3) */
-  int               op;     /* Opcode */
-  int               cnt;    /* Number of executed instructions */
-
-  /* Initialization */
-  g_pc = entry;             /* Code address to fetch 1st insn from */
-  g_cond = 0;               /* Set all flags (N, Z, C, V) to 0 */
-  cnt = 0;
-  g_reg[kRegSB] = sb * 4;   /* Globals start after code */
-  g_reg[kRegSP] = kMemSz;   /* The stack grows downward */
-  g_reg[kRegLNK] = 0;       /* A jump to 0 terminates the interpreter */
+  assert(vm);
 
-  do {
-    /* Fetch instruction */
-    g_ir = g_mem[g_pc++];
+  vm->snap = fname;
+}
 
-    /* Register (F0,F1,F2) or condition (F3) */
-    a = (g_ir >> 24) & 0xF;
+/* Has the program read its input from the file descriptor in, and write its
+ * output to out, instead of stdin and stdout. Error messages go to err rather
+ * than stderr. To be called before the program first runs.
+ */
+void
+RISC_Redirect(risc_vm_t * const vm, const int in, FILE * const out,
+              FILE * const err)
+{
+  assert(vm);
+  assert(in >= 0);
+  assert(out && err);
+  assert(!vm->in && !vm->outlen);
 
-    if (!(g_ir & kInsnMsb) || !(g_ir & kInsnQ)) {
-      /* Register- and memory instructions */
+  vm->infd = in;
+  vm->outfp = out;
+  vm->errfp = err;
+}
 
-      /* Operand (F0, F1) or base address (F2) */
-      b = g_reg[(g_ir >> 20) & 0xF];
+/* Whether the snapshot requested through RISC_Snapshot was written */
+bool
+RISC_Snapped(const risc_vm_t * const vm)
+{
+  assert(vm);
 
-      if (!(g_ir & kInsnMsb)) {
-        /* Register instruction (F0, F1) */
+  return vm->snapped;
+}
 
-        /* Extract opcode */
-        op = (g_ir >> 16) & 0xF;
+int
+RISC_Run(risc_vm_t * const vm, const int n)
+{
+  int           limit;      /* Max. no. of insns to execute in this slice */
 
-        /* Second operand */
-        if (!(g_ir & kInsnQ)) {
-          /* Format F0 */
-          n = g_reg[g_ir & 0xF];
-        } else {
-          /* Format F1 */
-          n = g_ir & 0xFFFF;
+  assert(vm);
+  assert(n > 0);
 
-          /* Sign-extend if the v modifier bit is set */
-          if (g_ir & kInsnV) {
-            n += 0xFFFF0000;
-          }
-        }
+  if (Halted(vm)) {
+    return kRiscHalted;
+  }
+  limit = n;
+  if (vm->budget && vm->budget - vm->steps < limit) {
+    limit = (int)(vm->budget - vm->steps);
+  }
 
-        /* Switch on opcode */
-        switch (op) {
-        case kOpMov:
-          /* If u = 1, form = 0 and v = 0, R.a := H */
-          /* If u = 1, form = 0 and v = 1, R.a := [N, Z, C, V] */
-          /* If u = 1, form = 1, R.a := n << 16 */
-          /* If u = 0, R.a := n */
-          if (g_ir & kInsnU) {
-            if (g_ir & kInsnQ) {
-              val = n << 16;
-            } else {
-              val = (g_ir & kInsnV) ? g_cond : g_h;
-            }
-          } else {
-            val = n;
-          }
-          break;
-
-        case kOpRor:
-          val = (((b >> n) & ~(~0u << (32 - n))) | (b << (32 - n)));
-          break;
-
-        case kOpLsl: val = b << n; break;
-        case kOpAsr: val = b >> n; break;
-        case kOpAnd: val = b & n;  break;
-        case kOpAnn: val = b & ~n; break;
-        case kOpIor: val = b | n;  break;
-        case kOpXor: val = b ^ n;  break;
-
-        case kOpAdd:
-          val = b + n;
-
-          /* Set oVerflow flag */
-          if ((b & kNumSign) && (n & kNumSign) && !(val & kNumSign)) {
-            /* (+A)+(+B) = -C */
-            g_cond |= kFlagV;
-          } else if (!(b & kNumSign) && !(n & kNumSign) && (val & kNumSign)) {
-            /* (-A)+(-B) = +C */
-            g_cond |= kFlagV;
-          } else {
-            g_cond &= ~kFlagV;
-          }
-          break;
-
-        case kOpSub:
-          val = b - n;
-
-          /* Set oVerflow flag */
-          if ((b & kNumSign) && !(n & kNumSign) && !(val & kNumSign)) {
-            /* (+A)-(-B) = -C */
-            g_cond |= kFlagV;
-          } else if (!(b & kNumSign) && (n & kNumSign) && (val & kNumSign)) {
-            /* (-A)-(+B) = +C */
-            g_cond |= kFlagV;
-          } else {
-            g_cond &= ~kFlagV;
-          }
-          break;
+  if (vm->sampling) {
+    SampledSlice(vm, limit);
+  } else {
+    Slice(vm, limit);
+  }
+  if (!Halted(vm)) {
+    return kRiscPreempted;
+  }
+  if (!Flush(vm) && vm->pc == 0) {
+    vm->pc = kTrapIO;
+  }
+  Report(vm);
+  return kRiscHalted;
+}
 
-        case kOpMul:
-          val = b * n;
-          g_h = (val >> 32) & 0xFFFFFFFF;
-          break;
+void
+RISC_Destroy(risc_vm_t * const vm)
+{
+  assert(vm);
 
-        case kOpDiv:
-          /* Code generator already forces runtime checks */
-          assert(n != 0);
+  Flush(vm);
+  if (vm->mapped) {
+    /* Leave the input positioned after what was read */
+    munmap((void *)vm->in, vm->inlen);
+    lseek(vm->infd, vm->inpos, SEEK_SET);
+  } else {
+    free((void *)vm->in);
+  }
+  JIT_Free(&vm->native);
+  munmap(vm->mem, vm->memsz);
+  free(vm->code);
+  free(vm->counts);
+  free(vm->shadow);
+  free(vm->entries);
+  free(vm->samples);
+  free(vm);
+}
 
-          val = b / n;
-          g_h = b % n;
-          break;
+const unsigned long *
+RISC_Counts(const risc_vm_t * const vm)
+{
+  assert(vm);
 
-        default:
-          fprintf(stderr, "Unrecognized opcode: %x\n", op);
+  return vm->counts;
+}
 
-          /* Force the interpreter to abort execution */
-          g_pc = kMaxSteps;
-          continue;
-        }
-        /* Store value in result register */
-        g_reg[a] = val & 0xFFFFFFFF;
+/* Supplies the frame offset for every code address, i.e., the number of bytes
+ * by which SP lies below the start of the frame of the procedure executing
+ * it, given that the procedure's prolog has completed. Non-zero only while
+ * registers are saved around a call (see SaveRegs in org.c), or within a leaf
+ * procedure, which never stores LNK (see Leaf in org.c): there, it is -1 minus
+ * the number of bytes SP lies below where it was on entry. Without it, stacks
+ * sampled in the midst of such calls or procedures may be cut short.
+ */
+void
+RISC_Frames(risc_vm_t * const vm, const int * const frames)
+{
+  assert(vm);
 
-        /* Set condition flags */
-        SetN(val);
-        SetZ(val);
-      } else {
-        /* Memory instruction (format F2) */
-        n = b + (g_ir & 0xFFFFF);
-        if (g_ir & kInsnU) {
-          if (n >= 0) {
-            /* Store */
-            if (g_ir & kInsnV) {
-              /* Store a single byte */
-              g_mem[n / 4] |= (g_reg[a] & 0xFF) << ((n % 4) * 8);
+  vm->frames = frames;
+}
+
+/* Returns the call stacks sampled during execution (see kRiscSample), storing
+ * their total size in ints in len. Each consists of its number of frames n,
+ * followed by n code addresses: first that of the instruction executing when
+ * the sample was taken, then those of the calls it is nested in.
+ */
+const int *
+RISC_Samples(const risc_vm_t * const vm, int * const len)
+{
+  assert(vm);
+  assert(len);
+
+  *len = vm->nsamples;
+  return vm->samples;
+}
+
+/* Like RISC_Create, but reporting failures on stderr. A memory size of 0
+ * selects RISC_MemSize.
+ */
+risc_vm_t *
+RISC_Load(const risc_image_t * const image, const int memsz,
+          const int64_t budget, const int flags)
+{
+  risc_vm_t *   vm;
+  int           sz;         /* Memory size in bytes */
+
+  assert(image);
+
+  sz = memsz ? memsz : RISC_MemSize(image);
+  if ((long long)image->sb * 4 + image->varsize + image->strsz > sz) {
+    fprintf(stderr, "Program does not fit in %d bytes of memory\n", sz);
+    return NULL;
+  }
+  if (!(vm = RISC_Create(image, sz, budget, flags))) {
+    fprintf(stderr, "Out of memory\n");
+  }
+  return vm;
+}
+
+/* Returns the default memory size for image, as laid out by RISC_Create:
+ * kMemSz, unless its code, globals and strings take up more than half of
+ * that. In that case, they are followed by kMemSz bytes for the stack (or
+ * whatever room is left below kMemMax).
+ */
+int
+RISC_MemSize(const risc_image_t * const image)
+{
+  long long     n;
+
+  assert(image);
+
+  n = (long long)image->sb * 4 + image->varsize + image->strsz;
+  if (n <= kMemSz / 2) {
+    return kMemSz;
+  }
+  n = (n + kMemSz - 1) / kMemSz * kMemSz + kMemSz;
+  return n < kMemMax ? (int)n : kMemMax;
+}
+
+void
+RISC_Interpret(const risc_image_t * const image, const int memsz,
+               const int64_t budget, const int flags)
+{
+  Launch(image, memsz, budget, flags & ~kRiscJit);
+}
+
+void
+RISC_Jit(const risc_image_t * const image, const int memsz,
+         const int64_t budget, const int flags)
+{
+  Launch(image, memsz, budget, flags | kRiscJit);
+}
+
+/* Writes the assembly for the instruction ir to buf, which is to hold at least
+ * kRiscAsmLen characters
+ */
+void
+RISC_Disassemble(const int32_t ir, char * const buf)
+{
+  int           a;            /* Result register R.a (F0-2) or condition F3) */
+  int           b;            /* Operand R.b (F0, F1) or base address (F2) */
+  int           n;            /* Operand R.c (F0), im (F1) or address (F2) */
+  int           op;           /* opcode */
+  int           len;
+
+  assert(buf);
+
+  /* Register (F0, F1, F2) or condition (F3) */
+  a = (ir >> 24) & 0xF;
+
+  if (!(ir & kInsnMsb) || !(ir & kInsnQ)) {
+    /* Register and memory instructions */
+
+    /* Operand (F0, F1) or base address (F2) */
+    b = (ir >> 20) & 0xF;
+
+    if (!(ir & kInsnMsb)) {
+      /* Register instruction (F0, F1) */
+      op = (ir >> 16) & 0xF;
+      len = sprintf(buf, "%-3s ", g_mnemo[op]);
+
+      if (!(ir & kInsnQ)) {
+        /* Format F0 */
+        n = ir & 0xF;
+        if (op == kOpMov) {
+          if (ir & kInsnU) {
+            if (ir & kInsnV) {
+              sprintf(buf + len, "%s, [N,Z,C,V]", g_regs[a]);
             } else {
-              /* Store a word */
-              g_mem[n / 4] = g_reg[a];
+              sprintf(buf + len, "%s, H", g_regs[a]);
             }
           } else {
-            /* Output */
-            if (n == -1) {
-              /* Write an integer */
-              if (printf("%d", g_reg[a]) < 0) {
-                g_pc = kTrapIO;
-              }
-            } else if (n == -2) {
-              /* Write a character */
-              if (putchar(g_reg[a]) == EOF) {
-                g_pc = kTrapIO;
-              }
-            } else if (n == -3) {
-              /* Write a string */
-              WriteStr(a);
-            } else if (n == -4) {
-              /* Write a newline character */
-              if (putchar('\n') == EOF) {
-                g_pc = kTrapIO;
-              }
-            } else {
-              assert(0);
-            }
+            sprintf(buf + len, "%s, %s", g_regs[a], g_regs[n]);
           }
         } else {
-          if (n >= 0) {
-            /* Load */
-            if (g_ir & kInsnV) {
-              /* Load a byte */
-              val = (g_mem[n / 4] >> ((n % 4) * 8)) & 0xFF;
-            } else {
-              /* Load a word */
-              val = g_mem[n / 4];
-            }
-            g_reg[a] = val & 0xFFFFFFFF;
-
-            /* Set condition flags */
-            SetN(val);
-            SetZ(val);
+          sprintf(buf + len, "%s, %s, %s", g_regs[a], g_regs[b], g_regs[n]);
+        }
+      } else {
+        /* Format F1 */
+        n = ir & 0xFFFF;
+        if (op == kOpMov) {
+          if (ir & kInsnU) {
+            sprintf(buf + len, "%s, %X << 16", g_regs[a], n);
           } else {
-            /* Input */
-            if (n == -1) {
-              /* Read an integer */
-              if (scanf("%d", g_reg + a) == EOF) {
-                g_pc = kTrapIO;
-              }
-            } else if (n == -2) {
-              /* Read a character */
-              if ((g_reg[a] = getchar()) == EOF) {
-                g_pc = kTrapIO;
-              }
-            } else {
-              assert(0);
-            }
+            sprintf(buf + len, "%s, %X", g_regs[a], n);
           }
-        }
-      }
-    } else {
-      /* Branch instruction */
-      if (IsTrue(a)) {
-        if (g_ir & kInsnV) {
-          /* Store return address in LNK register */
-          g_reg[kRegLNK] = g_pc * 4;
-        }
-        if (g_ir & kInsnU) {
-          /* If u = 1, read offset from instruction (could be < 0) */
-          g_pc += ((g_ir & 0xFFFFFF) << 16) >> 16;
-
         } else {
-          /* If u = 0, take the destination address from a register */
-          g_pc = g_reg[g_ir & 0xF] / 4;
+          sprintf(buf + len, "%s, %s, %X", g_regs[a], g_regs[b], n);
         }
       }
+    } else {
+      /* Memory instruction (F2) */
+      op = (ir >> 28) & 0xF;
+      n = ir & 0xFFFFF;
+      sprintf(buf, "%-3s %s, %s, %X", g_mnemo[op+4], g_regs[a],
+              g_regs[b], n);
     }
-  } while (g_pc > 0 && g_pc < sb && ++cnt != kMaxSteps);
+  } else {
+    /* Branch instruction (F3) */
+    op = (ir >> 28) & 0x3;
+    len = sprintf(buf, "%-3s ", g_mnemo[op+16]);
 
-  /* Check for a runtime error */
-  if (g_pc != 0) {
-    if (cnt == kMaxSteps) {
-      fprintf(stderr, "Execution aborted\n");
-    } else if (g_pc < 0 && g_pc >= kTrapIO) {
-      fprintf(stderr, "Trap: %s\n", g_trap[abs(g_pc)]);
-    } else {
-      fprintf(stderr, "Illegal code address: %06x\n", g_pc);
+    switch (op) {
+    case kOpBr: case kOpBlr:
+      n = ir & 0xF;
+      sprintf(buf + len, "%s, %s", g_cond[a], g_regs[n]);
+      break;
+    default:
+      sprintf(buf + len, "%s, %X", g_cond[a], 4 * (ir & 0xFFFFFF));
+      break;
     }
-    Dump();
   }
 }
 
+/* Writes image to the file fname, returning false on failure */
+bool
+RISC_Save(const risc_image_t * const image, const char * const fname)
+{
+  FILE *        fp;
+  header_t      hdr;
+  bool          ok;
+
+  assert(image);
+  assert(fname);
+
+  memcpy(hdr.magic, g_magic, sizeof(hdr.magic));
+  hdr.version = kImageVersion;
+  hdr.sb = image->sb;
+  hdr.varsize = image->varsize;
+  hdr.strsz = image->strsz;
+  hdr.entry = image->entry;
+  if (!(fp = fopen(fname, "wb"))) {
+    return false;
+  }
+  ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+       && fwrite(image->code, 1, image->sb * 4 + image->strsz, fp)
+          == (size_t)image->sb * 4 + image->strsz;
+  return !fclose(fp) && ok;
+}
+
+/* Maps the image file fname into memory, having image refer to it. Returns
+ * false if it cannot be read or is not a valid image.
+ */
+bool
+RISC_Open(risc_image_t * const image, const char * const fname)
+{
+  struct stat     st;
+  const header_t *hdr;
+  void *          p;
+  int             fd;
+
+  assert(image);
+  assert(fname);
+
+  if ((fd = open(fname, O_RDONLY)) < 0) {
+    return false;
+  }
+  p = MAP_FAILED;
+  if (!fstat(fd, &st) && st.st_size >= (off_t)sizeof(*hdr)) {
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (p == MAP_FAILED) {
+    return false;
+  }
+
+  /* Validate the header before relying on it */
+  hdr = p;
+  if (memcmp(hdr->magic, g_magic, sizeof(hdr->magic))
+      || hdr->version != kImageVersion
+      || hdr->sb <= 0 || hdr->sb > kMaxCode
+      || hdr->varsize < 0 || hdr->varsize % 4 || hdr->varsize > kMemMax
+      || hdr->strsz < 0 || hdr->strsz % 4 || hdr->strsz > kMemMax
+      || hdr->entry < 0 || hdr->entry >= hdr->sb
+      || st.st_size != (off_t)sizeof(*hdr) + hdr->sb * 4 + hdr->strsz) {
+    munmap(p, st.st_size);
+    return false;
+  }
+  image->code = (const int32_t *)(hdr + 1);
+  image->sb = hdr->sb;
+  image->varsize = hdr->varsize;
+  image->strsz = hdr->strsz;
+  image->entry = hdr->entry;
+  return true;
+}
+
+/* Unmaps an image obtained from RISC_Open */
+void
+RISC_Close(risc_image_t * const image)
+{
+  assert(image && image->code);
+
+  munmap((header_t *)image->code - 1,
+         sizeof(header_t) + image->sb * 4 + image->strsz);
+  image->code = NULL;
+}
+
+/* Allocates a VM for a code region of sb words, with memsz bytes of memory
+ * mapped either from a snapshot file fd or else zeroed (fd < 0). Also sets up
+ * the handling of stack overflows.
+ */
+static risc_vm_t *
+New(const int sb, const int memsz, const int flags, const int fd)
+{
+  risc_vm_t *       vm;
+  void *            mem;
+  struct sigaction  sa;
+
+  if (!(vm = malloc(sizeof(*vm)))) {
+    return NULL;
+  }
+
+  /* Allocate the decoded code, as well as the profile, the shadow copy of the
+   * code and the prologs, if needed
+   */
+  vm->counts = NULL;
+  vm->shadow = NULL;
+  vm->entries = NULL;
+  if (!(vm->code = malloc(sb * sizeof(*vm->code)))
+      || ((flags & kRiscProfile)
+       && !(vm->counts = calloc(sb, sizeof(*vm->counts))))
+      || ((flags & (kRiscProfile | kRiscTrace))
+          && !(vm->shadow = malloc(sb * sizeof(*vm->shadow))))
+      || ((flags & kRiscSample)
+          && !(vm->entries = malloc(sb * sizeof(*vm->entries))))) {
+    free(vm->code);
+    free(vm->counts);
+    free(vm->shadow);
+    free(vm);
+    return NULL;
+  }
+
+  /* Pages are only backed by physical memory (or copied) once touched */
+  if (fd < 0) {
+    mem = mmap(NULL, memsz, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  } else {
+    mem = mmap(NULL, memsz, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_NORESERVE, fd, kSnapOffset);
+  }
+  if (mem == MAP_FAILED) {
+    free(vm->code);
+    free(vm->counts);
+    free(vm->shadow);
+    free(vm->entries);
+    free(vm);
+    return NULL;
+  }
+  vm->mem = mem;
+  vm->memsz = memsz;
+  vm->sb = sb;
+
+  /* Catch accesses to the guard region */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = Fault;
+  sa.sa_flags = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGSEGV, &sa, NULL);
+  return vm;
+}
+
+/* Readies a VM with its memory and registers in place for execution */
 static void
-Dump(void)
+Start(risc_vm_t * const vm, const int64_t budget, const int flags)
 {
-  int m, n;
+  int               n;
 
-  /* Print special-purpose registers */
-  printf("Registers:\n");
-  printf("PC,      IR,      N,       Z,       C,       V\n");
-  printf("%08x,%08x,",    g_pc,                 g_ir);
-  printf("%08x,%08x,",    g_cond & kFlagN >> 3, g_cond & kFlagZ >> 2);
-  printf("%08x,%08x\n\n", g_cond & kFlagC >> 1, g_cond & kFlagV);
+  vm->ir = 0;
+  vm->steps = 0;
+  vm->budget = budget;
+  vm->infd = STDIN_FILENO;
+  vm->outfp = stdout;
+  vm->errfp = stderr;
+  vm->outlen = 0;
+  vm->in = NULL;
+  vm->inpos = vm->inlen = 0;
+  vm->mapped = vm->regular = false;
+  vm->snap = NULL;
+  vm->snapped = false;
+  vm->tracing = flags & kRiscTrace;
+  vm->dump = flags & kRiscDump;
+  vm->ntrace = 0;
+  vm->sampling = flags & kRiscSample;
+  vm->frames = NULL;
+  vm->samples = NULL;
+  vm->nsamples = vm->samplecap = 0;
+#ifdef RISC_FUSE_STATS
+  memset(vm->fused, 0, sizeof(vm->fused));
+#endif
 
-  /* Print general-purpose registers */
-  printf("R0,      R1,      R2,      R3,      R4,      R5,      R6,      R7");
-  printf("\n%08x,%08x,%08x,%08x,", g_reg[0], g_reg[1], g_reg[2], g_reg[3]);
-  printf("%08x,%08x,%08x,%08x\n\n",g_reg[4], g_reg[5], g_reg[6], g_reg[7]);
-  printf("R8,      R9,      R10,     R11,     MT,      SB,      SP,      LNK");
-  printf("\n%08x,%08x,%08x,%08x,", g_reg[8],  g_reg[9],  g_reg[10], g_reg[11]);
-  printf("%08x,%08x,%08x,%08x\n\n",g_reg[12], g_reg[13], g_reg[14], g_reg[15]);
-
-  /* Print memory contents */
-  printf("Memory:\n");
-  printf("       00000000,00000004,00000008,0000000C,"
-         "00000010,00000014,00000018,0000001C\n");
-  for (n = 0; n < kMemSz; n += 32) {
-    printf("%06x ", n);
-    for (m = 0; n + m != kMemSz && m != 32; m += 4) {
-      printf("%08x", g_mem[(n + m) / 4]);
-      if (m != 28) {
-        putchar(',');
-      }
+  /* Decode the code region once, before execution starts */
+  for (n = 0; n != vm->sb; ++n) {
+    Decode(vm, n);
+  }
+  for (n = 0; n != vm->sb; ++n) {
+    Fuse(vm, n);
+  }
+
+  /* Find the procedure containing every code address, for Backtrace */
+  if (vm->sampling) {
+    for (n = 0; n != vm->sb; ++n) {
+      vm->entries[n] = IsProlog(vm, n) ? n : n ? vm->entries[n - 1] : -1;
+    }
+  }
+
+  /* Translate it to native code, if requested and supported. Profiling and
+   * tracing are left to the interpreter.
+   */
+  vm->stale = false;
+  vm->native.buf = NULL;
+  vm->native.addr = NULL;
+  vm->jit = (flags & kRiscJit) && !vm->shadow
+            && JIT_Translate(&vm->native, vm->mem, vm->sb, vm->memsz);
+}
+
+/* Writes the snapshot requested through RISC_Snapshot, with PC at the
+ * instruction reading input. Pages that are all zero are left as holes.
+ */
+static bool
+WriteSnapshot(risc_vm_t * const vm)
+{
+  static const int32_t zero[0x400];
+  snapshot_t    hdr;
+  const char *  p;
+  int           fd;
+  int           off;
+  int           len;
+  bool          ok;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, g_snap_magic, sizeof(hdr.magic));
+  hdr.version = kSnapVersion;
+  hdr.memsz = vm->memsz;
+  hdr.guard = vm->guard;
+  hdr.sb = vm->sb;
+  hdr.pc = vm->pc;
+  memcpy(hdr.reg, vm->reg, sizeof(hdr.reg));
+  hdr.h = vm->h;
+  hdr.vb = vm->vb;
+  hdr.vn = vm->vn;
+  hdr.vr = vm->vr;
+  hdr.res = vm->res;
+
+  if ((fd = open(vm->snap, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+    return false;
+  }
+  ok = pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)
+       && !ftruncate(fd, (off_t)kSnapOffset + vm->memsz);
+  p = (const char *)vm->mem;
+  for (off = 0; ok && off < vm->memsz; off += len) {
+    len = vm->memsz - off < (int)sizeof(zero) ? vm->memsz - off
+                                              : (int)sizeof(zero);
+    if (off >= vm->guard && off < vm->guard + kGuardSz) {
+      len = vm->guard + kGuardSz - off;
+    } else if (memcmp(p + off, zero, len)) {
+      ok = pwrite(fd, p + off, len, (off_t)kSnapOffset + off) == len;
     }
-    putchar('\n');
   }
-  putchar('\n');
+  return !close(fd) && ok;
 }
 
+/* Runs the given program to completion on a VM of its own */
 static void
-SetN(const int64_t val)
+Launch(const risc_image_t * const image, const int memsz,
+       const int64_t budget, const int flags)
 {
-  if (val < 0) {
-    g_cond |= kFlagN;
-  } else {
-    g_cond &= ~kFlagN;
+  risc_vm_t *   vm;
+
+  if (!(vm = RISC_Load(image, memsz, budget, flags))) {
+    return;
+  }
+  while (RISC_Run(vm, INT_MAX) == kRiscPreempted) {
+    /* Keep going */
+  }
+  RISC_Destroy(vm);
+}
+
+/* Handles segmentation faults. Those caused by the running VM accessing its
+ * guard region end execution, with all others being fatal as usual.
+ */
+static void
+Fault(int sig, siginfo_t *info, void *ctx)
+{
+  risc_vm_t * const vm = g_running;
+  const char *      addr;
+
+  (void)ctx;
+  addr = info->si_addr;
+  if (vm && addr >= (char *)vm->mem + vm->guard
+      && addr < (char *)vm->mem + vm->guard + kGuardSz) {
+    siglongjmp(vm->fault, 1);
   }
+
+  /* Fault again upon returning, this time without a handler */
+  signal(sig, SIG_DFL);
 }
 
+/* Executes at most limit instructions, turning accesses to the guard region
+ * into a trap
+ */
 static void
-SetZ(const int64_t val)
+Slice(risc_vm_t * const vm, const int limit)
 {
-  /* Set Z flag */
-  if (val == 0) {
-    g_cond |= kFlagZ;
+  g_running = vm;
+  if (sigsetjmp(vm->fault, 1)) {
+    /* Registers are as of the last exit from native code, if jit is set */
+    vm->pc = kTrapStack;
   } else {
-    g_cond &= ~kFlagZ;
+    vm->steps += vm->jit ? Native(vm, limit) : Execute(vm, 0, limit);
   }
+  g_running = NULL;
 }
 
+/* Executes at most limit instructions like Slice, with a profiling timer
+ * running. The call stack is sampled after every kSampleSteps instructions
+ * during which the timer expired, which keeps the overhead outside of Tick
+ * to a check per kSampleSteps. With the JIT, native code is left as often.
+ */
 static void
-WriteStr(const int a)
+SampledSlice(risc_vm_t * const vm, int limit)
 {
-  int           i;            /* Number of bits written */
-  int           ch;
-  int           base;         /* Word address */
+  struct sigaction  sa;
+  struct itimerval  it;
+  int               n;
 
-  base = g_reg[a] / 4;
-  i = 0;
-  do {
-    ch = (g_mem[base] >> i) & 0xFF;
-    if (putchar(ch) == EOF) {
-      g_pc = kTrapIO;
-      return;
-    }
-    i += 8;
-    if (i == 32) {
-      i = 0;
-      ++base;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = Tick;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, NULL);
+  memset(&it, 0, sizeof(it));
+  it.it_interval.tv_usec = kSampleUsec;
+  it.it_value = it.it_interval;
+  g_ticks = 0;
+  setitimer(ITIMER_PROF, &it, NULL);
+
+  while (limit > 0 && !Halted(vm)) {
+    n = limit < kSampleSteps ? limit : kSampleSteps;
+    Slice(vm, n);
+    limit -= n;
+    if (g_ticks && !Halted(vm)) {
+      g_ticks = 0;
+      Sample(vm);
     }
-  } while (ch);
+  }
+
+  /* Stop the timer, leaving the handler in place for any late signal */
+  memset(&it, 0, sizeof(it));
+  setitimer(ITIMER_PROF, &it, NULL);
 }
 
-static bool
-IsTrue(const int cond)
-{
-  bool flagN = g_cond & kFlagN;
-  bool flagZ = g_cond & kFlagZ;
-  bool flagV = g_cond & kFlagV;
-
-  return (cond == kCondTrue)                                ||
-         (cond == kCondMI && flagN)                         ||
-         (cond == kCondEQ && flagZ)                         ||
-         (cond == kCondVS && flagV)                         ||
-         (cond == kCondLT && (flagN != flagV))              ||
-         (cond == kCondLE && ((flagN != flagV) || flagZ))   ||
-         (cond == kCondPL && !flagN)                        ||
-         (cond == kCondNE && !flagZ)                        ||
-         (cond == kCondVC && !flagV)                        ||
-         (cond == kCondGE && (flagN == flagV))              ||
-         (cond == kCondGT && ((flagN == flagV) && !flagZ));
+/* Handles the expiry of the profiling timer */
+static void
+Tick(int sig)
+{
+  (void)sig;
+  g_ticks = 1;
+}
+
+/* Appends the current call stack to the samples, unless out of memory */
+static void
+Sample(risc_vm_t * const vm)
+{
+  int *         p;
+  int           cap;
+
+  if (vm->samplecap - vm->nsamples < 1 + kRiscMaxFrames) {
+    cap = vm->samplecap ? 2 * vm->samplecap : 0x1000;
+    if (!(p = realloc(vm->samples, cap * sizeof(*p)))) {
+      return;
+    }
+    vm->samples = p;
+    vm->samplecap = cap;
+  }
+  p = vm->samples + vm->nsamples;
+  *p = Backtrace(vm, p + 1);
+  vm->nsamples += 1 + *p;
 }
+
+/* Stores the code address of the next instruction in pcs[0], followed by
+ * those of the calls it is nested in, innermost first, and returns their
+ * number (at most kRiscMaxFrames). Every frame starts with the return address
+ * stored by the prolog of ORG_Enter (or ORG_Header), and spans the number of
+ * bytes subtracted from SP by that prolog. The exception is a leaf procedure,
+ * which can only be innermost: its return address stays in LNK, and its frame
+ * (if any) is found through the negative frame offsets (see RISC_Frames).
+ */
+static int
+Backtrace(const risc_vm_t * const vm, int * const pcs)
+{
+  const int32_t ret = (int32_t)((12u + kOpBr) << 28 | kCondTrue << 24
+                                | kRegLNK);     /* BR T, LNK */
+  int           pc;
+  int           sp;
+  int           lnk;
+  int           entry;
+  int           n;
+
+  pc = vm->pc;
+  sp = vm->reg[kRegSP];
+  for (n = 0; n != kRiscMaxFrames && pc > 0 && pc < vm->sb; ++n) {
+    pcs[n] = pc;
+    if (n == 0 && vm->frames && vm->frames[pc] < 0) {
+      /* A leaf procedure, keeping its return address in LNK */
+      lnk = vm->reg[kRegLNK];
+      sp += -1 - vm->frames[pc];
+      pc = (lnk & 3) ? 0 : lnk / 4 - 1;
+      continue;
+    }
+    if ((entry = vm->entries[pc]) < 0) {
+      return n + 1;
+    }
+
+    /* Only the innermost procedure may not have stored its return address
+     * yet, or have released its frame already. Otherwise, registers may be
+     * saved below the frame (see RISC_Frames).
+     */
+    if (n == 0 && (pc == entry || vm->mem[pc] == ret)) {
+      lnk = vm->reg[kRegLNK];
+    } else if (n == 0 && pc == entry + 1) {
+      lnk = vm->reg[kRegLNK];
+      sp += vm->mem[entry] & 0xFFFF;
+    } else {
+      if (vm->frames) {
+        sp += vm->frames[pc];
+      }
+      if (sp < 0 || sp >= vm->memsz || (sp & 3)
+          || (sp >= vm->guard && sp < vm->guard + kGuardSz)) {
+        return n + 1;
+      }
+      lnk = vm->mem[sp / 4];
+      sp += vm->mem[entry] & 0xFFFF;
+    }
+
+    /* Continue at the call, i.e., the instruction preceding the return
+     * address. A return address of 0 ends the module body.
+     */
+    pc = (lnk & 3) ? 0 : lnk / 4 - 1;
+  }
+  return n;
+}
+
+/* Whether execution ended, either normally or due to a runtime error */
+static bool
+Halted(const risc_vm_t * const vm)
+{
+  return vm->pc <= 0 || vm->pc >= vm->sb
+         || (vm->budget && vm->steps == vm->budget);
+}
+
+/* Runs native code for as long as possible, only interpreting single
+ * instructions when needed, until PC leaves the code region or limit
+ * instructions have been executed. Returns the number of executed
+ * instructions.
+ */
+static int
+Native(risc_vm_t * const vm, const int limit)
+{
+  jit_cpu_t     cpu;
+  int           cnt;        /* Number of executed instructions */
+
+  cnt = 0;
+  for (;;) {
+    Save(vm, &cpu);
+    cpu.pc = vm->pc;
+    cpu.steps = limit - cnt;
+    if (JIT_Run(&vm->native, &cpu) != kJitStep) {
+      Restore(vm, &cpu);
+      vm->pc = cpu.pc;
+      vm->ir = vm->mem[cpu.ir];
+      return limit - cpu.steps;
+    }
+    Restore(vm, &cpu);
+    vm->pc = cpu.pc;
+    cnt = limit - cpu.steps;
+
+    /* Interpret a single instruction */
+    cnt = Execute(vm, cnt, cnt + 1);
+    if (vm->pc <= 0 || vm->pc >= vm->sb || cnt == limit) {
+      return cnt;
+    }
+
+    /* Retranslate if the code was overwritten */
+    if (vm->stale) {
+      vm->stale = false;
+      JIT_Free(&vm->native);
+      if (!JIT_Translate(&vm->native, vm->mem, vm->sb, vm->memsz)) {
+        vm->jit = false;
+        return Execute(vm, cnt, limit);
+      }
+    }
+  }
+}
+
+#ifdef RISC_THREADED
+/* Labels as values are not part of ISO C */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+/* Executes instructions starting at PC, given that cnt of them have already
+ * been executed, until either PC leaves the code region or the count reaches
+ * limit. Returns the new count.
+ */
+static int
+Execute(risc_vm_t * const vm, int cnt, const int limit)
+{
+#ifdef RISC_THREADED
+  /* Handler addresses, indexed by the op field of decoded instructions */
+  static const void * const labels[] = {
+    [kF0Mov]   = &&L_kF0Mov,   [kF1Mov]   = &&L_kF1Mov,
+    [kF0MovH]  = &&L_kF0MovH,  [kF0MovCC] = &&L_kF0MovCC,
+    [kF0Lsl]   = &&L_kF0Lsl,   [kF1Lsl]   = &&L_kF1Lsl,
+    [kF0Asr]   = &&L_kF0Asr,   [kF1Asr]   = &&L_kF1Asr,
+    [kF0Ror]   = &&L_kF0Ror,   [kF1Ror]   = &&L_kF1Ror,
+    [kF0And]   = &&L_kF0And,   [kF1And]   = &&L_kF1And,
+    [kF0Ann]   = &&L_kF0Ann,   [kF1Ann]   = &&L_kF1Ann,
+    [kF0Ior]   = &&L_kF0Ior,   [kF1Ior]   = &&L_kF1Ior,
+    [kF0Xor]   = &&L_kF0Xor,   [kF1Xor]   = &&L_kF1Xor,
+    [kF0Add]   = &&L_kF0Add,   [kF1Add]   = &&L_kF1Add,
+    [kF0Sub]   = &&L_kF0Sub,   [kF1Sub]   = &&L_kF1Sub,
+    [kF0Mul]   = &&L_kF0Mul,   [kF1Mul]   = &&L_kF1Mul,
+    [kF0Div]   = &&L_kF0Div,   [kF1Div]   = &&L_kF1Div,
+    [kF2Ldw]   = &&L_kF2Ldw,   [kF2Ldb]   = &&L_kF2Ldb,
+    [kF2Stw]   = &&L_kF2Stw,   [kF2Stb]   = &&L_kF2Stb,
+    [kF3Br]    = &&L_kF3Br,    [kF3Blr]   = &&L_kF3Blr,
+    [kF3Bc]    = &&L_kF3Bc,    [kF3Bl]    = &&L_kF3Bl,
+    [kF1SubStw]   = &&L_kF1SubStw,   [kF2LdwAddBr] = &&L_kF2LdwAddBr,
+    [kF0SubBc]    = &&L_kF0SubBc,    [kF1SubBc]    = &&L_kF1SubBc,
+    [kF1LslAdd]   = &&L_kF1LslAdd,
+    [kCount]   = &&L_kCount,   [kTrace]   = &&L_kTrace,
+    [kIllegal] = &&L_kIllegal
+  };
+#endif
+  const insn_t * const  code = vm->code;
+  const int         sb = vm->sb;
+  int               pc;     /* Program counter, kept local for speed */
+  const insn_t *    ip;     /* Decoded instruction at PC */
+  int64_t           val;    /* Result value of register instructions */
+  int32_t           n;      /* Absolute address (F2) */
+
+  assert(cnt < limit);
+
+  /* Fetch the first decoded instruction */
+  pc = vm->pc;
+  ip = code + pc++;
+
+  SWITCH (ip->op) {
+  /* Register instructions (F0, F1) */
+  CASE(kF0Mov):   RESULT(R_C);
+  CASE(kF1Mov):   RESULT(ip->imm);
+  CASE(kF0MovH):  RESULT(vm->h);
+  CASE(kF0MovCC): RESULT(Cond(vm));
+  CASE(kF0Lsl):   RESULT(R_B << R_C);
+  CASE(kF1Lsl):
+  f1lsl:          RESULT(R_B << ip->imm);
+  CASE(kF0Asr):   RESULT(R_B >> R_C);
+  CASE(kF1Asr):   RESULT(R_B >> ip->imm);
+  CASE(kF0Ror):   RESULT(Ror(R_B, R_C));
+  CASE(kF1Ror):   RESULT(Ror(R_B, ip->imm));
+  CASE(kF0And):   RESULT(R_B & R_C);
+  CASE(kF1And):   RESULT(R_B & ip->imm);
+  CASE(kF0Ann):   RESULT(R_B & ~R_C);
+  CASE(kF1Ann):   RESULT(R_B & ~ip->imm);
+  CASE(kF0Ior):   RESULT(R_B | R_C);
+  CASE(kF1Ior):   RESULT(R_B | ip->imm);
+  CASE(kF0Xor):   RESULT(R_B ^ R_C);
+  CASE(kF1Xor):   RESULT(R_B ^ ip->imm);
+  CASE(kF0Add):   RESULT(Add(vm, R_B, R_C));
+  CASE(kF1Add):   RESULT(Add(vm, R_B, ip->imm));
+  CASE(kF0Sub):
+  f0sub:          RESULT(Sub(vm, R_B, R_C));
+  CASE(kF1Sub):
+  f1sub:          RESULT(Sub(vm, R_B, ip->imm));
+  CASE(kF0Mul):   RESULT(Mul(vm, R_B, R_C));
+  CASE(kF1Mul):   RESULT(Mul(vm, R_B, ip->imm));
+  CASE(kF0Div):   RESULT(Div(vm, R_B, R_C));
+  CASE(kF1Div):   RESULT(Div(vm, R_B, ip->imm));
+
+  /* Memory instructions (F2) */
+  CASE(kF2Ldw):
+  f2ldw:
+    n = R_B + ip->imm;
+    if (n < 0) {
+      vm->pc = pc - 1;
+      if (!Input(vm, ip->a, n)) {
+        pc = kTrapIO;
+      }
+      NEXT();
+    }
+    /* Load a word */
+    RESULT(vm->mem[n / 4]);
+  CASE(kF2Ldb):
+    n = R_B + ip->imm;
+    if (n < 0) {
+      vm->pc = pc - 1;
+      if (!Input(vm, ip->a, n)) {
+        pc = kTrapIO;
+      }
+      NEXT();
+    }
+    /* Load a byte */
+    RESULT((vm->mem[n / 4] >> ((n % 4) * 8)) & 0xFF);
+  CASE(kF2Stw):
+    n = R_B + ip->imm;
+    if (n >= 0) {
+      /* Store a word */
+      vm->mem[n / 4] = vm->reg[ip->a];
+      if (n / 4 < sb) {
+        Invalidate(vm, n / 4);
+      }
+    } else {
+      if (!Output(vm, ip->a, n)) {
+        pc = kTrapIO;
+      }
+    }
+    NEXT();
+  CASE(kF2Stb):
+    n = R_B + ip->imm;
+    if (n >= 0) {
+      /* Store a single byte */
+      vm->mem[n / 4] |= (vm->reg[ip->a] & 0xFF) << ((n % 4) * 8);
+      if (n / 4 < sb) {
+        Invalidate(vm, n / 4);
+      }
+    } else {
+      if (!Output(vm, ip->a, n)) {
+        pc = kTrapIO;
+      }
+    }
+    NEXT();
+
+  /* Branch instructions (F3) */
+  CASE(kF3Br):
+    if (IsTrue(vm, ip->a)) {
+      /* Take the destination address from a register */
+      pc = R_C / 4;
+    }
+    NEXT();
+  CASE(kF3Blr):
+    if (IsTrue(vm, ip->a)) {
+      /* Store return address in LNK register */
+      vm->reg[kRegLNK] = pc * 4;
+      pc = R_C / 4;
+    }
+    NEXT();
+  CASE(kF3Bc):
+    if (IsTrue(vm, ip->a)) {
+      /* Read offset from instruction (could be < 0) */
+      pc += ip->imm;
+    }
+    NEXT();
+  CASE(kF3Bl):
+    if (IsTrue(vm, ip->a)) {
+      vm->reg[kRegLNK] = pc * 4;
+      pc += ip->imm;
+    }
+    NEXT();
+
+  /* Superinstructions. The whole sequence is only executed at once if none of
+   * its instructions but the last can halt execution, which includes the step
+   * budget running out. Otherwise, we fall back to the plain handler of the
+   * first instruction.
+   */
+  CASE(kF1SubStw):
+    n = (int32_t)((uint32_t)R_B - (uint32_t)ip->imm + (uint32_t)ip[1].imm);
+    if (cnt + 1 >= limit || n < 0 || n / 4 < sb) {
+      goto f1sub;
+    }
+    FUSED(kF1SubStw);
+    val = Sub(vm, R_B, ip->imm);
+    vm->reg[ip->a] = val & 0xFFFFFFFF;
+    vm->res = val;
+    STEP();
+    vm->mem[n / 4] = vm->reg[ip->a];
+    NEXT();
+  CASE(kF2LdwAddBr):
+    n = R_B + ip->imm;
+    if (cnt + 2 >= limit || n < 0) {
+      goto f2ldw;
+    }
+    FUSED(kF2LdwAddBr);
+    vm->reg[ip->a] = vm->mem[n / 4];
+    STEP();
+    val = Add(vm, R_B, ip->imm);
+    vm->reg[ip->a] = val & 0xFFFFFFFF;
+    vm->res = val;
+    STEP();
+    pc = R_C / 4;
+    NEXT();
+  CASE(kF0SubBc):
+    if (cnt + 1 >= limit) {
+      goto f0sub;
+    }
+    n = R_C;
+    goto subbc;
+  CASE(kF1SubBc):
+    if (cnt + 1 >= limit) {
+      goto f1sub;
+    }
+    n = ip->imm;
+  subbc:
+    FUSED(ip->op);
+    val = Sub(vm, R_B, n);
+    vm->reg[ip->a] = val & 0xFFFFFFFF;
+    vm->res = val;
+    STEP();
+    if (IsTrue(vm, ip->a)) {
+      pc += ip->imm;
+    }
+    NEXT();
+  CASE(kF1LslAdd):
+    if (cnt + 1 >= limit) {
+      goto f1lsl;
+    }
+    FUSED(kF1LslAdd);
+    val = R_B << ip->imm;
+    vm->reg[ip->a] = val & 0xFFFFFFFF;
+    STEP();
+    RESULT(Add(vm, R_B, R_C));
+
+  CASE(kCount):
+    ++vm->counts[pc - 1];
+    ip = vm->shadow + (pc - 1);
+    DISPATCH();
+
+  CASE(kTrace):
+    Record(vm, pc - 1);
+    ip = vm->shadow + (pc - 1);
+    DISPATCH();
+
+  CASE(kIllegal):
+    fprintf(vm->errfp, "Unrecognized opcode: %x\n", ip->c);
+
+    /* Force the interpreter to abort execution */
+    pc = kMaxSteps;
+    goto halt;
+  }
+
+halt:
+  /* Restore the instruction register for Dump */
+  vm->pc = pc;
+  vm->ir = vm->mem[ip - (vm->shadow ? vm->shadow : code)];
+  return cnt;
+}
+
+#ifdef RISC_THREADED
+#pragma GCC diagnostic pop
+#endif
+
+/* Reports a runtime error, if any, once execution halted */
+static void
+Report(const risc_vm_t * const vm)
+{
+#ifdef RISC_FUSE_STATS
+  fprintf(vm->errfp, "Fused: SUB/STW %lu, LDW/ADD/BR %lu, CMP/BC %lu, "
+          "LSL/ADD %lu\n", vm->fused[kF1SubStw - kF1SubStw],
+          vm->fused[kF2LdwAddBr - kF1SubStw],
+          vm->fused[kF0SubBc - kF1SubStw] + vm->fused[kF1SubBc - kF1SubStw],
+          vm->fused[kF1LslAdd - kF1SubStw]);
+#endif
+
+  if (vm->pc != 0 && !vm->snapped) {
+    if (vm->budget && vm->steps == vm->budget) {
+      fprintf(vm->errfp, "Execution aborted\n");
+    } else if (vm->pc < 0 && vm->pc >= kTrapStack) {
+      fprintf(vm->errfp, "Trap: %s\n", g_trap[abs(vm->pc)]);
+    } else {
+      fprintf(vm->errfp, "Illegal code address: %06x\n", vm->pc);
+    }
+    Dump(vm);
+    if (vm->tracing) {
+      DumpTrace(vm);
+    }
+    if (vm->dump) {
+      DumpMemory(vm);
+    }
+  }
+}
+
+/* Decodes the instruction at the given word address into vm->code, extracting
+ * its operands and selecting a handler for its opcode and format. Called for
+ * the whole code region before execution, and again for any word therein
+ * that gets overwritten.
+ */
+static void
+Decode(risc_vm_t * const vm, const int at)
+{
+  static const uint8_t  reg_ops[] = {
+    kF0Mov, kF0Lsl, kF0Asr, kF0Ror, kF0And, kF0Ann, kF0Ior, kF0Xor,
+    kF0Add, kF0Sub, kF0Mul, kF0Div
+  };
+  insn_t *      ip;
+  int32_t       ir;
+  int           op;
+
+  ip = vm->code + at;
+  ir = vm->mem[at];
+  ip->a = (ir >> 24) & 0xF;
+  ip->b = 0;
+  ip->c = 0;
+  ip->imm = 0;
+
+  if (!(ir & kInsnMsb)) {
+    /* Register instruction (F0, F1) */
+    ip->b = (ir >> 20) & 0xF;
+    op = (ir >> 16) & 0xF;
+    if (op > kOpDiv) {
+      ip->op = kIllegal;
+      ip->c = op;
+    } else if (!(ir & kInsnQ)) {
+      /* Format F0 */
+      ip->op = reg_ops[op];
+      ip->c = ir & 0xF;
+      if (op == kOpMov && (ir & kInsnU)) {
+        /* R.a := [N, Z, C, V] (v = 1) or R.a := H (v = 0) */
+        ip->op = (ir & kInsnV) ? kF0MovCC : kF0MovH;
+      }
+    } else {
+      /* Format F1 */
+      ip->op = reg_ops[op] + 1;
+      ip->imm = ir & 0xFFFF;
+
+      /* Sign-extend if the v modifier bit is set */
+      if (ir & kInsnV) {
+        ip->imm += 0xFFFF0000;
+      }
+
+      /* If u = 1, MOV shifts im to the upper half of R.a */
+      if (op == kOpMov && (ir & kInsnU)) {
+        ip->imm = (int32_t)((uint32_t)ip->imm << 16);
+      }
+    }
+  } else if (!(ir & kInsnQ)) {
+    /* Memory instruction (F2) */
+    ip->b = (ir >> 20) & 0xF;
+    ip->imm = ir & 0xFFFFF;
+    if (ir & kInsnU) {
+      ip->op = (ir & kInsnV) ? kF2Stb : kF2Stw;
+    } else {
+      ip->op = (ir & kInsnV) ? kF2Ldb : kF2Ldw;
+    }
+  } else {
+    /* Branch instruction (F3) */
+    if (ir & kInsnU) {
+      /* Offset, sign-extended from 24 bits */
+      ip->op = (ir & kInsnV) ? kF3Bl : kF3Bc;
+      ip->imm = ((ir & 0xFFFFFF) ^ 0x800000) - 0x800000;
+    } else {
+      /* Destination address in R.c */
+      ip->op = (ir & kInsnV) ? kF3Blr : kF3Br;
+      ip->c = ir & 0xF;
+    }
+  }
+
+  /* When profiling or tracing, count or record every execution first. This
+   * also rules out any superinstructions, which would otherwise hide all but
+   * their first instruction.
+   */
+  if (vm->shadow) {
+    vm->shadow[at] = *ip;
+    ip->op = vm->tracing ? kTrace : kCount;
+  }
+}
+
+/* Selects a superinstruction for the sequence starting at the given address,
+ * if it matches one of the idioms emitted by ORG_Enter, ORG_Return, ORG_Index,
+ * ORG_IntRel or Trap. As the instructions following the first keep their own
+ * handlers, jumps into the middle of a sequence still work as before.
+ */
+static void
+Fuse(risc_vm_t * const vm, const int at)
+{
+  const int     sb = vm->sb;
+  insn_t *      ip;
+
+  ip = vm->code + at;
+  if (at + 1 >= sb) {
+    return;
+  }
+
+  switch (ip->op) {
+  case kF1Sub:
+    if (ip->a == kRegSP && ip->b == kRegSP
+        && ip[1].op == kF2Stw && ip[1].b == kRegSP) {
+      /* Procedure prolog */
+      ip->op = kF1SubStw;
+    } else if (ip[1].op == kF3Bc) {
+      /* Comparison, or bounds check */
+      ip->op = kF1SubBc;
+    }
+    break;
+  case kF0Sub:
+    if (ip[1].op == kF3Bc) {
+      ip->op = kF0SubBc;
+    }
+    break;
+  case kF1Lsl:
+    if (ip[1].op == kF0Add) {
+      /* Index scaling */
+      ip->op = kF1LslAdd;
+    }
+    break;
+  case kF2Ldw:
+    if (at + 2 < sb && ip->b == kRegSP
+        && ip[1].op == kF1Add && ip[1].a == kRegSP && ip[1].b == kRegSP
+        && ip[2].op == kF3Br && ip[2].a == kCondTrue && ip[2].c == ip->a) {
+      /* Procedure epilog */
+      ip->op = kF2LdwAddBr;
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+/* Decodes the instruction at the given address again after it got overwritten,
+ * along with any superinstruction it may have been part of.
+ */
+static void
+Invalidate(risc_vm_t * const vm, const int at)
+{
+  int           n;
+
+  for (n = at < 2 ? 0 : at - 2; n <= at; ++n) {
+    Decode(vm, n);
+  }
+  for (n = at < 2 ? 0 : at - 2; n <= at; ++n) {
+    Fuse(vm, n);
+  }
+  vm->stale = true;
+}
+
+/* Whether a procedure prolog starts at code address pc, as emitted by
+ * ORG_Enter or ORG_Header: SUB SP, SP, size followed by STW LNK, SP, 0
+ */
+static bool
+IsProlog(const risc_vm_t * const vm, const int pc)
+{
+  const int32_t sub = (0x40 + kRegSP) << 24 | kRegSP << 20 | kOpSub << 16;
+  const int32_t stw = (int32_t)((uint32_t)kOpStr << 28 | kRegLNK << 24
+                                | kRegSP << 20);
+
+  return pc + 1 < vm->sb && (vm->mem[pc] & 0xFFFF0000) == sub
+         && vm->mem[pc + 1] == stw;
+}
+
+/* Records the instruction at code address pc as the last one executed, along
+ * with the result of the one preceding it (see kRiscTrace)
+ */
+static inline void
+Record(risc_vm_t * const vm, const int pc)
+{
+  trace_t *     tp;
+
+  if (vm->ntrace) {
+    tp = vm->trace + (vm->ntrace - 1) % kTraceLen;
+    tp->res = vm->reg[(tp->ir >> 24) & 0xF];
+  }
+  tp = vm->trace + vm->ntrace++ % kTraceLen;
+  tp->pc = pc;
+  tp->ir = vm->mem[pc];
+  if (vm->counts) {
+    ++vm->counts[pc];
+  }
+}
+
+/* Prints the registers */
+static void
+Dump(const risc_vm_t * const vm)
+{
+  FILE * const  fp = vm->outfp;
+  uint8_t cond = Cond(vm);
+
+  /* Print special-purpose registers */
+  fprintf(fp, "Registers:\n");
+  fprintf(fp, "PC,      IR,      N,       Z,       C,       V\n");
+  fprintf(fp, "%08x,%08x,",    vm->pc,                 vm->ir);
+  fprintf(fp, "%08x,%08x,",    cond & kFlagN >> 3,   cond & kFlagZ >> 2);
+  fprintf(fp, "%08x,%08x\n\n", cond & kFlagC >> 1,   cond & kFlagV);
+
+  /* Print general-purpose registers */
+  fprintf(fp, "R0,      R1,      R2,      R3,      R4,      R5,      R6,      R7");
+  fprintf(fp, "\n%08x,%08x,%08x,%08x,", vm->reg[0], vm->reg[1], vm->reg[2], vm->reg[3]);
+  fprintf(fp, "%08x,%08x,%08x,%08x\n\n",vm->reg[4], vm->reg[5], vm->reg[6], vm->reg[7]);
+  fprintf(fp, "R8,      R9,      R10,     R11,     MT,      SB,      SP,      LNK");
+  fprintf(fp, "\n%08x,%08x,%08x,%08x,", vm->reg[8],  vm->reg[9],  vm->reg[10], vm->reg[11]);
+  fprintf(fp, "%08x,%08x,%08x,%08x\n\n",vm->reg[12], vm->reg[13], vm->reg[14], vm->reg[15]);
+}
+
+/* Prints the last instructions executed, oldest first, along with the value
+ * they left in R.a. Branches have none.
+ */
+static void
+DumpTrace(const risc_vm_t * const vm)
+{
+  FILE * const  fp = vm->outfp;
+  char          buf[kRiscAsmLen];
+  const trace_t *tp;
+  unsigned      i;
+  int32_t       res;
+
+  fprintf(fp, "Trace:\n");
+  i = vm->ntrace > kTraceLen ? vm->ntrace - kTraceLen : 0;
+  for (; i != vm->ntrace; ++i) {
+    tp = vm->trace + i % kTraceLen;
+    RISC_Disassemble(tp->ir, buf);
+    fprintf(fp, "%04X: %-24s", 4*tp->pc, buf);
+    if ((tp->ir & kInsnMsb) && (tp->ir & kInsnQ)) {
+      putc('\n', fp);
+    } else {
+      res = i + 1 == vm->ntrace ? vm->reg[(tp->ir >> 24) & 0xF] : tp->res;
+      fprintf(fp, "%08x\n", res);
+    }
+  }
+  putc('\n', fp);
+}
+
+/* Prints all of memory (see kRiscDump) */
+static void
+DumpMemory(const risc_vm_t * const vm)
+{
+  FILE * const  fp = vm->outfp;
+  int m, n;
+  int top;
+
+  /* Print memory contents, skipping the guard region along with any unused
+   * stack space above it
+   */
+  top = vm->reg[kRegSP] & ~31;
+  if (top < vm->guard + kGuardSz) {
+    top = vm->guard + kGuardSz;
+  }
+  fprintf(fp, "Memory:\n");
+  fprintf(fp, "       00000000,00000004,00000008,0000000C,"
+         "00000010,00000014,00000018,0000001C\n");
+  for (n = 0; n < vm->memsz; n += 32) {
+    if (n >= vm->guard && n < top) {
+      continue;
+    }
+    fprintf(fp, "%06x ", n);
+    for (m = 0; n + m != vm->memsz && m != 32; m += 4) {
+      fprintf(fp, "%08x", vm->mem[(n + m) / 4]);
+      if (m != 28) {
+        putc(',', fp);
+      }
+    }
+    putc('\n', fp);
+  }
+  putc('\n', fp);
+}
+
+/* Derives the condition flags [N, Z, C, V] from the last recorded results */
+static uint8_t
+Cond(const risc_vm_t * const vm)
+{
+  uint8_t       cond;
+
+  cond = 0;
+  if (vm->res < 0) {
+    cond |= kFlagN;
+  }
+  if (vm->res == 0) {
+    cond |= kFlagZ;
+  }
+
+  if (Overflow(vm)) {
+    cond |= kFlagV;
+  }
+  return cond;
+}
+
+/* Signed overflow occurred iff the sign of the result differs from those of
+ * both operands (taking the complement of the subtrahend for SUB).
+ */
+static bool
+Overflow(const risc_vm_t * const vm)
+{
+  return ((vm->vb ^ vm->vr) & (vm->vn ^ vm->vr)) < 0;
+}
+
+/* Copies the registers to the state operated upon by native code */
+static void
+Save(const risc_vm_t * const vm, jit_cpu_t * const cpu)
+{
+  memcpy(cpu->reg, vm->reg, sizeof(vm->reg));
+  cpu->h = vm->h;
+  cpu->v = Overflow(vm);
+  cpu->res = vm->res;
+}
+
+/* Copies the registers back from native code. The oVerflow flag is recorded
+ * as the result of adding two zeroes, or -2^31 to itself.
+ */
+static void
+Restore(risc_vm_t * const vm, const jit_cpu_t * const cpu)
+{
+  memcpy(vm->reg, cpu->reg, sizeof(vm->reg));
+  vm->h = cpu->h;
+  vm->vb = vm->vn = cpu->v ? INT32_MIN : 0;
+  vm->vr = 0;
+  vm->res = cpu->res;
+}
+
+static int64_t
+Ror(const int32_t b, const int32_t n)
+{
+  return (((b >> n) & ~(~0u << (32 - n))) | (b << (32 - n)));
+}
+
+static int64_t
+Add(risc_vm_t * const vm, const int32_t b, const int32_t n)
+{
+  int32_t       val;
+
+  val = (int32_t)((uint32_t)b + (uint32_t)n);
+
+  /* Record operands and result for the oVerflow flag */
+  vm->vb = b;
+  vm->vn = n;
+  vm->vr = val;
+  return val;
+}
+
+static int64_t
+Sub(risc_vm_t * const vm, const int32_t b, const int32_t n)
+{
+  int32_t       val;
+
+  val = (int32_t)((uint32_t)b - (uint32_t)n);
+
+  /* Record operands and result for the oVerflow flag */
+  vm->vb = b;
+  vm->vn = ~n;
+  vm->vr = val;
+  return val;
+}
+
+static int64_t
+Mul(risc_vm_t * const vm, const int32_t b, const int32_t n)
+{
+  int64_t       val;
+
+  val = (int64_t)b * n;
+  vm->h = (val >> 32) & 0xFFFFFFFF;
+  return (int32_t)val;
+}
+
+static int64_t
+Div(risc_vm_t * const vm, const int32_t b, const int32_t n)
+{
+  /* Code generator already forces runtime checks */
+  assert(n != 0);
+
+  vm->h = b % n;
+  return b / n;
+}
+
+/* Reads from the input port n (< 0) into R.a. Returns false on failure. */
+static bool
+Input(risc_vm_t * const vm, const int a, const int32_t n)
+{
+  /* Stop here if a snapshot was requested, with vm->pc set by Execute */
+  if (vm->snap) {
+    if (!Flush(vm)) {
+      return false;
+    }
+    if (!(vm->snapped = WriteSnapshot(vm))) {
+      fprintf(vm->errfp, "Cannot write snapshot %s\n", vm->snap);
+    }
+    vm->snap = NULL;
+    return false;
+  }
+
+  if (n == -1) {
+    /* Read an integer */
+    return ReadInt(vm, vm->reg + a);
+  } else if (n == -2) {
+    /* Read a character */
+    if ((vm->reg[a] = Peek(vm)) == EOF) {
+      return false;
+    }
+    ++vm->inpos;
+    return true;
+  } else if (n == -5) {
+    /* Read a block of bytes */
+    return ReadBlock(vm, a);
+  }
+  assert(0);
+  return false;
+}
+
+/* Reads an optionally signed decimal integer after skipping white space, as
+ * scanf's %d would. Returns false iff the input ends before anything else is
+ * found. If no digits follow, *n is left untouched.
+ */
+static bool
+ReadInt(risc_vm_t * const vm, int32_t * const n)
+{
+  uint32_t      u;
+  int           ch;
+  bool          neg;
+
+  while (isspace(ch = Peek(vm))) {
+    ++vm->inpos;
+  }
+  if (ch == EOF) {
+    return false;
+  }
+  neg = ch == '-';
+  if (neg || ch == '+') {
+    ++vm->inpos;
+    ch = Peek(vm);
+  }
+  if (!isdigit(ch)) {
+    return true;
+  }
+  u = 0;
+  do {
+    u = u * 10 + (ch - '0');
+    ++vm->inpos;
+  } while (isdigit(ch = Peek(vm)));
+  *n = (int32_t)(neg ? -u : u);
+  return true;
+}
+
+/* Reads up to R.(a+1) bytes into memory starting at address R.a, setting R.a
+ * to their number (0 at the end of input). Any code overwritten is decoded
+ * anew.
+ */
+static bool
+ReadBlock(risc_vm_t * const vm, const int a)
+{
+  char *        dst;
+  size_t        len;
+  size_t        n;
+  int           i;
+
+  if (!IsBlock(vm, a)) {
+    return false;
+  }
+  dst = (char *)vm->mem + vm->reg[a];
+  len = vm->reg[a + 1];
+  for (n = 0; n < len && Peek(vm) != EOF; n += i) {
+    i = len - n < vm->inlen - vm->inpos ? len - n : vm->inlen - vm->inpos;
+    memcpy(dst + n, vm->in + vm->inpos, i);
+    vm->inpos += i;
+  }
+  for (i = vm->reg[a] / 4; i < vm->sb && i * 4 < vm->reg[a] + (int)n; ++i) {
+    Invalidate(vm, i);
+  }
+  vm->reg[a] = n;
+  return true;
+}
+
+/* Returns the next input byte without consuming it, or EOF */
+static int
+Peek(risc_vm_t * const vm)
+{
+  if (vm->inpos == vm->inlen && !Fill(vm)) {
+    return EOF;
+  }
+  return (unsigned char)vm->in[vm->inpos];
+}
+
+/* Makes more input available, returning false at its end or on a read error.
+ * Upon first use, a regular file is mapped in its entirety, reading from its
+ * current offset onwards. Otherwise, input is read in blocks of kInSz bytes,
+ * showing any pending output (e.g., a prompt) first unless reading cannot
+ * wait, i.e. infd is a regular file.
+ */
+static bool
+Fill(risc_vm_t * const vm)
+{
+  struct stat   st;
+  void *        p;
+  off_t         pos;
+  ssize_t       n;
+
+  if (!vm->in) {
+    vm->regular = !fstat(vm->infd, &st) && S_ISREG(st.st_mode);
+    if (vm->regular && st.st_size > 0
+        && (pos = lseek(vm->infd, 0, SEEK_CUR)) >= 0
+        && (p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, vm->infd,
+                     0)) != MAP_FAILED) {
+      vm->in = p;
+      vm->inlen = st.st_size;
+      vm->inpos = pos < st.st_size ? (size_t)pos : vm->inlen;
+      vm->mapped = true;
+      return vm->inpos < vm->inlen;
+    }
+    if (!(vm->in = malloc(kInSz))) {
+      return false;
+    }
+  }
+  if (vm->mapped) {
+    return false;
+  }
+
+  /* Read the next block */
+  if (!vm->regular && !Flush(vm)) {
+    return false;
+  }
+  do {
+    n = read(vm->infd, (char *)vm->in, kInSz);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+    return false;
+  }
+  vm->inpos = 0;
+  vm->inlen = n;
+  return true;
+}
+
+/* Writes R.a to the output port n (< 0). Returns false on failure. */
+static bool
+Output(risc_vm_t * const vm, const int a, const int32_t n)
+{
+  if (n == -1) {
+    /* Write an integer */
+    return WriteInt(vm, vm->reg[a]);
+  } else if (n == -2) {
+    /* Write a character */
+    return WriteChar(vm, vm->reg[a]);
+  } else if (n == -3) {
+    /* Write a string */
+    return WriteStr(vm, a);
+  } else if (n == -4) {
+    /* Write a newline character */
+    return WriteChar(vm, '\n');
+  } else if (n == -6) {
+    /* Write a block of bytes */
+    return WriteBlock(vm, a);
+  }
+  assert(0);
+  return false;
+}
+
+static bool
+WriteStr(risc_vm_t * const vm, const int a)
+{
+  int           i;            /* Number of bits written */
+  int           ch;
+  int           base;         /* Word address */
+
+  base = vm->reg[a] / 4;
+  i = 0;
+  do {
+    ch = (vm->mem[base] >> i) & 0xFF;
+    if (!WriteChar(vm, ch)) {
+      return false;
+    }
+    i += 8;
+    if (i == 32) {
+      i = 0;
+      ++base;
+    }
+  } while (ch);
+  return true;
+}
+
+/* Writes R.(a+1) bytes from memory starting at address R.a */
+static bool
+WriteBlock(risc_vm_t * const vm, const int a)
+{
+  const char *  src;
+  int           len;
+  int           n;
+
+  if (!IsBlock(vm, a)) {
+    return false;
+  }
+  src = (const char *)vm->mem + vm->reg[a];
+  for (len = vm->reg[a + 1]; len; len -= n) {
+    if (vm->outlen == kOutSz && !Flush(vm)) {
+      return false;
+    }
+    n = len < kOutSz - vm->outlen ? len : kOutSz - vm->outlen;
+    memcpy(vm->out + vm->outlen, src, n);
+    vm->outlen += n;
+    src += n;
+  }
+  return true;
+}
+
+/* Checks whether R.a and R.(a+1) delimit a block of memory. As bytes are
+ * numbered from the least significant end of a word, blocks can be copied to
+ * and from a little-endian host's memory as is.
+ */
+static bool
+IsBlock(const risc_vm_t * const vm, const int a)
+{
+  return a < 15 && vm->reg[a] >= 0 && vm->reg[a + 1] >= 0
+      && vm->reg[a + 1] <= vm->memsz - vm->reg[a];
+}
+
+/* Appends the decimal representation of n to the output buffer */
+static bool
+WriteInt(risc_vm_t * const vm, const int32_t n)
+{
+  char          buf[11];      /* Sign and up to 10 digits, in reverse */
+  uint32_t      u;
+  int           len;
+
+  /* Negate in unsigned arithmetic, so as to cover INT32_MIN */
+  u = n < 0 ? -(uint32_t)n : (uint32_t)n;
+  len = 0;
+  do {
+    buf[len++] = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (n < 0) {
+    buf[len++] = '-';
+  }
+
+  if (vm->outlen + len > kOutSz && !Flush(vm)) {
+    return false;
+  }
+  while (len) {
+    vm->out[vm->outlen++] = buf[--len];
+  }
+  return true;
+}
+
+/* Appends a single byte to the output buffer */
+static bool
+WriteChar(risc_vm_t * const vm, const int ch)
+{
+  if (vm->outlen == kOutSz && !Flush(vm)) {
+    return false;
+  }
+  vm->out[vm->outlen++] = ch;
+  return true;
+}
+
+/* Writes out the output buffer. Anything printed through stdio before (e.g.,
+ * by the compiler) goes first. Returns false on failure, discarding the
+ * buffer's contents.
+ */
+static bool
+Flush(risc_vm_t * const vm)
+{
+  ssize_t       n;
+  int           i;
+  int           fd;
+  bool          ok;
+
+  if (!vm->outlen) {
+    return true;
+  }
+  if ((fd = fileno(vm->outfp)) < 0) {
+    /* A stream without a file descriptor, e.g. in memory */
+    ok = fwrite(vm->out, 1, vm->outlen, vm->outfp) == (size_t)vm->outlen;
+    vm->outlen = 0;
+    return ok;
+  }
+  if (fflush(vm->outfp)) {
+    vm->outlen = 0;
+    return false;
+  }
+  for (i = 0; i != vm->outlen; i += n) {
+    n = write(fd, vm->out + i, vm->outlen - i);
+    if (n < 0) {
+      if (errno == EINTR) {
+        n = 0;
+        continue;
+      }
+      vm->outlen = 0;
+      return false;
+    }
+  }
+  vm->outlen = 0;
+  return true;
+}
+
+static bool
+IsTrue(const risc_vm_t * const vm, const int cond)
+{
+  int           k;            /* Flags [N, Z, V] */
+
+  k = (vm->res < 0) << 2;
+  k |= (vm->res == 0) << 1;
+  k |= Overflow(vm);
+  return (g_truth[cond] >> k) & 1;
+}
+
+#ifdef TEST
+
+#include "minunit.h"
+
+/* Instruction encodings (cf. Put0, Put1 and Put3 in org.c) */
+#define F0(op, a, b, c) ((int32_t)(((a) << 24) | ((b) << 20) | ((op) << 16) \
+                        | (c)))
+#define F1(op, a, b, im) ((int32_t)((((a) + 0x40) << 24) | ((b) << 20)      \
+                         | ((op) << 16) | ((im) & 0xFFFF)                   \
+                         | ((im) < 0 ? kInsnV : 0)))
+#define F2(op, a, b, off) ((int32_t)(((uint32_t)(op) << 28) | ((a) << 24)   \
+                          | ((b) << 20) | ((off) & 0xFFFF)))
+#define F3(op, cond, off) ((int32_t)(((uint32_t)(op) + 12) << 28            \
+                          | ((cond) << 24) | ((off) & 0xFFFFFF)))
+
+/* R0 := 10 + 9 + ... + 1 */
+static const int32_t  g_test_code[] = {
+  0,
+  F1(kOpMov, 0, 0, 0),
+  F1(kOpMov, 1, 0, 10),
+  F0(kOpAdd, 0, 0, 1),
+  F1(kOpSub, 1, 1, 1),
+  F3(kOpBc, kCondNE, -3),
+  F3(kOpBr, kCondTrue, kRegLNK)
+};
+
+/* R0 := 7; Read(R2) */
+static const int32_t  g_test_read[] = {
+  0,
+  F1(kOpMov, 0, 0, 7),
+  F1(kOpMov, 1, 0, -1),
+  F2(kOpLdr, 2, 1, 0),
+  F3(kOpBr, kCondTrue, kRegLNK)
+};
+
+/* Write(7); Read(R2) */
+static const int32_t  g_test_echo[] = {
+  0,
+  F1(kOpMov, 0, 0, 7),
+  F1(kOpMov, 1, 0, -1),
+  F2(kOpStr, 0, 1, 0),
+  F2(kOpLdr, 2, 1, 0),
+  F3(kOpBr, kCondTrue, kRegLNK)
+};
+
+char *
+TestRisc(void)
+{
+  static const risc_image_t image = { g_test_code, 7, 0, 0, 1 };
+  static const int  flags[] = { 0, kRiscJit, kRiscProfile, kRiscTrace };
+  risc_vm_t *       vm;
+  const unsigned long * counts;
+  const trace_t *   tp;
+  char              buf[kRiscAsmLen];
+  risc_image_t      copy;
+  char              fname[] = "/tmp/ocXXXXXX";
+  int               fd;
+  int               fds[2];
+  FILE *            fp;
+  int               i;
+  int               n;
+
+  for (i = 0; i != 4; ++i) {
+    /* Preempt after every instruction, not counting the final branch */
+    ASSERT_NOT_NULL(vm = RISC_Create(&image, kMemSz, 0, flags[i]));
+    for (n = 0; RISC_Run(vm, 1) == kRiscPreempted; ) {
+      ASSERT_EQ(++n, vm->steps);
+    }
+    ASSERT_EQ(32, n);
+    ASSERT_EQ(55, vm->reg[0]);
+    ASSERT_EQ(kRiscHalted, RISC_Run(vm, 1));
+    RISC_Destroy(vm);
+
+    /* Slices ending within the loop's superinstructions */
+    ASSERT_NOT_NULL(vm = RISC_Create(&image, kMemSz, 0, flags[i]));
+    ASSERT_EQ(kRiscPreempted, RISC_Run(vm, 4));
+    ASSERT_EQ(10, vm->reg[0]);
+    ASSERT_EQ(9, vm->reg[1]);
+    ASSERT_EQ(kRiscPreempted, RISC_Run(vm, 7));
+    ASSERT_EQ(kRiscHalted, RISC_Run(vm, 100));
+    ASSERT_EQ(32, vm->steps);
+    ASSERT_EQ(55, vm->reg[0]);
+    RISC_Destroy(vm);
+  }
+
+  /* Counts per instruction, including the final branch */
+  ASSERT_NOT_NULL(vm = RISC_Create(&image, kMemSz, 0, kRiscProfile));
+  ASSERT_EQ(kRiscHalted, RISC_Run(vm, 100));
+  ASSERT_NOT_NULL(counts = RISC_Counts(vm));
+  ASSERT_EQ(0, counts[0]);
+  ASSERT_EQ(1, counts[1]);
+  ASSERT_EQ(10, counts[3]);
+  ASSERT_EQ(10, counts[5]);
+  ASSERT_EQ(1, counts[6]);
+  RISC_Destroy(vm);
+
+  /* Trace of the last instructions, ending with the final branch */
+  ASSERT_NOT_NULL(vm = RISC_Create(&image, kMemSz, 0, kRiscTrace));
+  ASSERT_EQ(kRiscHalted, RISC_Run(vm, 100));
+  ASSERT_EQ(33, vm->ntrace);
+  tp = vm->trace + (vm->ntrace - 1) % kTraceLen;
+  ASSERT_EQ(6, tp->pc);
+  ASSERT_EQ(g_test_code[6], tp->ir);
+  tp = vm->trace + (vm->ntrace - 3) % kTraceLen;
+  ASSERT_EQ(4, tp->pc);
+  ASSERT_EQ(0, tp->res);
+  tp = vm->trace + (vm->ntrace - 4) % kTraceLen;
+  ASSERT_EQ(3, tp->pc);
+  ASSERT_EQ(55, tp->res);
+  RISC_Destroy(vm);
+  RISC_Disassemble(g_test_code[4], buf);
+  ASSERT_EQ(0, strcmp("SUB R1, R1, 1", buf));
+  RISC_Disassemble(g_test_code[6], buf);
+  ASSERT_EQ(0, strcmp("BR  T, LNK", buf));
+
+  /* Round trip through an image file */
+  ASSERT_TRUE((fd = mkstemp(fname)) >= 0);
+  close(fd);
+  ASSERT_TRUE(RISC_Save(&image, fname));
+  ASSERT_TRUE(RISC_Open(&copy, fname));
+  remove(fname);
+  ASSERT_EQ(image.sb, copy.sb);
+  ASSERT_EQ(image.entry, copy.entry);
+  ASSERT_EQ(0, memcmp(image.code, copy.code, image.sb * 4));
+  ASSERT_NOT_NULL(vm = RISC_Create(&copy, kMemSz, 0, 0));
+  ASSERT_EQ(kRiscHalted, RISC_Run(vm, 100));
+  ASSERT_EQ(55, vm->reg[0]);
+  RISC_Destroy(vm);
+  RISC_Close(&copy);
+
+  /* Sizes adding up to more than INT_MAX, as a crafted image may have */
+  copy = image;
+  copy.varsize = copy.strsz = kMemMax;
+  ASSERT_NULL(RISC_Load(&copy, kMemMax, 0, 0));
+
+  /* Snapshot taken at the first input, with the reading insn yet to run */
+  copy.code = g_test_read;
+  copy.sb = 5;
+  copy.varsize = copy.strsz = 0;
+  copy.entry = 1;
+  strcpy(fname, "/tmp/ocXXXXXX");
+  ASSERT_TRUE((fd = mkstemp(fname)) >= 0);
+  close(fd);
+  ASSERT_NOT_NULL(vm = RISC_Create(&copy, kMemSz, 0, 0));
+  RISC_Snapshot(vm, fname);
+  ASSERT_EQ(kRiscHalted, RISC_Run(vm, 100));
+  ASSERT_TRUE(RISC_Snapped(vm));
+  RISC_Destroy(vm);
+  ASSERT_NOT_NULL(vm = RISC_Resume(fname, 0, 0));
+  remove(fname);
+  ASSERT_EQ(3, vm->pc);
+  ASSERT_EQ(7, vm->reg[0]);
+  ASSERT_EQ(-1, vm->reg[1]);
+  ASSERT_EQ(kMemSz, vm->reg[kRegSP]);
+  ASSERT_EQ(g_test_read[3], vm->mem[3]);
+  RISC_Destroy(vm);
+
+  /* Output stays buffered while reading from a file, but not from a pipe */
+  copy.code = g_test_echo;
+  copy.sb = 6;
+  ASSERT_NOT_NULL(fp = tmpfile());
+  strcpy(fname, "/tmp/ocXXXXXX");
+  ASSERT_TRUE((fd = mkstemp(fname)) >= 0);
+  remove(fname);
+  ASSERT_EQ(2, write(fd, "5\n", 2));
+  lseek(fd, 0, SEEK_SET);
+  ASSERT_NOT_NULL(vm = RISC_Create(&copy, kMemSz, 0, 0));
+  RISC_Redirect(vm, fd, fp, stderr);
+  ASSERT_EQ(kRiscPreempted, RISC_Run(vm, 4));
+  ASSERT_EQ(5, vm->reg[2]);
+  ASSERT_EQ(1, vm->outlen);
+  RISC_Destroy(vm);
+  close(fd);
+  ASSERT_EQ(0, pipe(fds));
+  ASSERT_EQ(2, write(fds[1], "5\n", 2));
+  close(fds[1]);
+  ASSERT_NOT_NULL(vm = RISC_Create(&copy, kMemSz, 0, 0));
+  RISC_Redirect(vm, fds[0], fp, stderr);
+  ASSERT_EQ(kRiscPreempted, RISC_Run(vm, 4));
+  ASSERT_EQ(5, vm->reg[2]);
+  ASSERT_EQ(0, vm->outlen);
+  RISC_Destroy(vm);
+  close(fds[0]);
+  ASSERT_EQ(2, ftell(fp));
+  fclose(fp);
+  return NULL;
+}
+
+#endif /* TEST */
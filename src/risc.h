@@ -3,7 +3,9 @@
 #ifndef RISC_H_
 #define RISC_H_
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 enum {
   /* Reserved registers */
@@ -13,7 +15,33 @@ enum {
   kRegLNK = 15,                 /* Link register (return address)            */
 
   /* Memory size (in bytes) */
-  kMemSz = 4096,
+  kMemSz  = 4096,               /* Default, also bounding the code region    */
+  kMemMax = 0x40000000,         /* Largest size supported (1 GiB)            */
+
+  /* Max. size of the code region (in words). Well within the reach of the
+   * 24-bit offsets of branch instructions, so that no branch is ever too long.
+   */
+  kMaxCode = 0x100000,
+
+  /* Default instruction budget (max. no. of insns to execute, 0 for none) */
+  kMaxSteps = 100000,
+
+  /* Flags for RISC_Create */
+  kRiscJit = 0x1,               /* Translate to native code, if supported    */
+  kRiscProfile = 0x2,           /* Count executions per instruction          */
+  kRiscTrace = 0x4,             /* Show the last insns executed on a trap    */
+  kRiscDump = 0x8,              /* Show all of memory on a trap              */
+  kRiscSample = 0x10,           /* Sample call stacks periodically           */
+
+  /* Max. no. of frames recorded per sample (see RISC_Samples) */
+  kRiscMaxFrames = 64,
+
+  /* Buffer size needed for RISC_Disassemble */
+  kRiscAsmLen = 32,
+
+  /* Results of RISC_Run */
+  kRiscHalted = 0,              /* Execution ended (see stderr for errors)   */
+  kRiscPreempted = 1,           /* Slice used up, execution may be resumed   */
 
   /* Instruction decoding */
   kInsnMsb = ~0x7FFFFFFF,       /* Most significant bit                      */
@@ -45,6 +73,7 @@ enum {
   kTrapDivByZero        = -3,   /* Division by zero                          */
   kTrapAssert           = -4,   /* Assertion failure                         */
   kTrapIO               = -5,   /* I/O exception                             */
+  kTrapStack            = -6,   /* Stack overflow (raised by the emulator)   */
 
   /* Opcodes for register instructions; see Put0 (n is c) and Put1 (n is im) */
   kOpMov = 0,   /* MOV a, n       R.a := n                                   */
@@ -75,10 +104,47 @@ enum {
   kOpBl  = 3    /* BL  cond, off  if (cond) { R15 := PC+1, PC := PC+1+off }  */
 };
 
+/* Compiled program, as laid out in memory by ORG_Close: code starting at
+ * address 0, followed by the global variables (initially zero, hence not
+ * stored) and the string constants.
+ */
+typedef struct {
+  const int32_t *   code;       /* Code, directly followed by the strings    */
+  int               sb;         /* Size of the code in words                 */
+  int               varsize;    /* Size of the global variables in bytes     */
+  int               strsz;      /* Size of the string constants in bytes     */
+  int               entry;      /* Code address of the first instruction     */
+} risc_image_t;
+
+/* Virtual machine, holding the state of a single running program */
+typedef struct risc_vm_s risc_vm_t;
+
 /* Exported functions */
-extern void       RISC_Interpret(const int, const int);
+extern risc_vm_t *RISC_Create(const risc_image_t * const, const int,
+                              const int64_t, const int);
+extern risc_vm_t *RISC_Load(const risc_image_t * const, const int,
+                            const int64_t, const int);
+extern int        RISC_MemSize(const risc_image_t * const);
+extern risc_vm_t *RISC_Resume(const char * const, const int64_t, const int);
+extern void       RISC_Snapshot(risc_vm_t * const, const char * const);
+extern void       RISC_Redirect(risc_vm_t * const, const int, FILE * const,
+                                FILE * const);
+extern bool       RISC_Snapped(const risc_vm_t * const);
+extern int        RISC_Run(risc_vm_t * const, const int);
+extern void       RISC_Destroy(risc_vm_t * const);
+extern const unsigned long *RISC_Counts(const risc_vm_t * const);
+extern void       RISC_Frames(risc_vm_t * const, const int * const);
+extern const int *RISC_Samples(const risc_vm_t * const, int * const);
+extern void       RISC_Interpret(const risc_image_t * const, const int,
+                                 const int64_t, const int);
+extern void       RISC_Jit(const risc_image_t * const, const int,
+                           const int64_t, const int);
+extern void       RISC_Disassemble(const int32_t, char * const);
+extern bool       RISC_Save(const risc_image_t * const, const char * const);
+extern bool       RISC_Open(risc_image_t * const, const char * const);
+extern void       RISC_Close(risc_image_t * const);
 
 /* Exported data */
-extern int32_t    g_mem[kMemSz / 4];  /* Memory */
+extern int32_t *  g_mem;              /* Output of the code generator */
 
 #endif
@@ -0,0 +1,265 @@
+#define _DEFAULT_SOURCE
+
+#include "server.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Prototypes */
+static int          Listen(const char * const);
+static void         Serve(risc_vm_t * const, const int, const int);
+
+/* Listens on the Unix socket at path, replacing any file there, and runs the
+ * program on vm, which has yet to run, for every connection. Only returns
+ * (false) if the socket cannot be set up or connections no longer be
+ * accepted.
+ */
+bool
+Server_Run(risc_vm_t * const vm, const char * const path)
+{
+  int           fd;
+  int           conn;
+
+  assert(vm);
+  assert(path);
+
+  if ((fd = Listen(path)) < 0) {
+    fprintf(stderr, "Cannot listen on %s\n", path);
+    return false;
+  }
+
+  /* Have finished children reaped, and nothing buffered duplicated in them */
+  signal(SIGCHLD, SIG_IGN);
+  fflush(stdout);
+  fflush(stderr);
+
+  for (;;) {
+    if ((conn = accept(fd, NULL, NULL)) < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      break;
+    }
+    switch (fork()) {
+    case -1:
+      fprintf(stderr, "Cannot fork\n");
+      break;
+    case 0:
+      Serve(vm, fd, conn);
+      break;
+    default:
+      break;
+    }
+    close(conn);
+  }
+  fprintf(stderr, "Cannot accept connections on %s\n", path);
+  close(fd);
+  return false;
+}
+
+/* Returns a socket listening at path, or -1 on failure */
+static int
+Listen(const char * const path)
+{
+  struct sockaddr_un addr;
+  int           fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)
+      || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))
+      || listen(fd, SOMAXCONN)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Runs the program in a child process, with the connection conn taking the
+ * place of stdin, stdout and stderr. Does not return.
+ */
+static void
+Serve(risc_vm_t * const vm, const int fd, const int conn)
+{
+  close(fd);
+  signal(SIGCHLD, SIG_DFL);
+  if (dup2(conn, STDIN_FILENO) < 0 || dup2(conn, STDOUT_FILENO) < 0
+      || dup2(conn, STDERR_FILENO) < 0) {
+    _exit(1);
+  }
+  close(conn);
+
+  while (RISC_Run(vm, INT_MAX) == kRiscPreempted) {
+    /* Keep going */
+  }
+  RISC_Destroy(vm);
+  fflush(stdout);
+  _exit(0);
+}
+
+#ifdef TEST
+
+#include <stdlib.h>
+#include <sys/wait.h>
+
+#include "minunit.h"
+
+/* Instruction encodings (cf. the tests in risc.c) */
+#define F1(op, a, b, im) ((int32_t)((((a) + 0x40) << 24) | ((b) << 20)      \
+                         | ((op) << 16) | ((im) & 0xFFFF)                   \
+                         | ((im) < 0 ? kInsnV : 0)))
+#define F2(op, a, b, off) ((int32_t)(((uint32_t)(op) << 28) | ((a) << 24)   \
+                          | ((b) << 20) | ((off) & 0xFFFF)))
+#define F3(op, cond, off) ((int32_t)(((uint32_t)(op) + 12) << 28            \
+                          | ((cond) << 24) | ((off) & 0xFFFFFF)))
+
+enum {
+  kTestReply = 0x100            /* Max. size of a reply */
+};
+
+/* Read(R0); Write(R0) */
+static const int32_t  g_test_echo[] = {
+  0,
+  F1(kOpMov, 1, 0, -1),
+  F2(kOpLdr, 0, 1, 0),
+  F2(kOpStr, 0, 1, 0),
+  F3(kOpBr, kCondTrue, kRegLNK)
+};
+
+/* Returns a connection to the server at path, waiting for it to come up, or
+ * -1 if it does not
+ */
+static int
+Connect(const char * const path)
+{
+  struct sockaddr_un addr;
+  int           fd;
+  int           i;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  for (i = 0; i != 100; ++i) {
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+      return -1;
+    }
+    if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+      return fd;
+    }
+    close(fd);
+    usleep(10000);
+  }
+  return -1;
+}
+
+/* Sends the input over the connection, ending it, and reads the reply */
+static bool
+Exchange(const int fd, const char * const in, char * const reply)
+{
+  size_t        len;
+  ssize_t       n;
+
+  len = strlen(in);
+  if (write(fd, in, len) != (ssize_t)len || shutdown(fd, SHUT_WR)) {
+    return false;
+  }
+  len = 0;
+  while ((n = read(fd, reply + len, kTestReply - 1 - len)) > 0) {
+    len += n;
+  }
+  reply[len] = '\0';
+  close(fd);
+  return !n;
+}
+
+/* Returns whether the process pid has no children left, not even finished
+ * ones yet to be reaped, waiting a while for them to exit. Also true if this
+ * cannot be told (from /proc).
+ */
+static bool
+Childless(const pid_t pid)
+{
+  FILE *        fp;
+  char          fname[64];
+  int           ch;
+  int           i;
+
+  sprintf(fname, "/proc/%d/task/%d/children", (int)pid, (int)pid);
+  for (i = 0; i != 100; ++i) {
+    if (!(fp = fopen(fname, "r"))) {
+      return true;
+    }
+    ch = fgetc(fp);
+    fclose(fp);
+    if (ch == EOF) {
+      return true;
+    }
+    usleep(10000);
+  }
+  return false;
+}
+
+/* Checks that a server runs the program afresh for every connection, also
+ * for connections open at the same time, with its input, output and error
+ * messages going over the connection, and that it reaps its children
+ */
+char *
+TestServer(void)
+{
+  static const risc_image_t image = { g_test_echo, 5, 0, 0, 1 };
+  risc_vm_t *       vm;
+  char              path[] = "/tmp/ocXXXXXX";
+  char              replies[3][kTestReply];
+  bool              ok[4];
+  pid_t             pid;
+  int               fd;
+  int               conns[2];
+  int               status;
+
+  ASSERT_TRUE((fd = mkstemp(path)) >= 0);
+  close(fd);
+  ASSERT_NOT_NULL(vm = RISC_Create(&image, RISC_MemSize(&image), 0, 0));
+  fflush(stdout);
+  fflush(stderr);
+  ASSERT_TRUE((pid = fork()) >= 0);
+  if (!pid) {
+    Server_Run(vm, path);
+    _exit(1);
+  }
+  RISC_Destroy(vm);
+
+  /* Stop the server before checking anything */
+  fd = Connect(path);
+  conns[0] = Connect(path);
+  conns[1] = Connect(path);
+  ok[0] = fd >= 0 && Exchange(fd, "42\n", replies[0]);
+  ok[1] = conns[1] >= 0 && Exchange(conns[1], "-7", replies[1]);
+  ok[2] = conns[0] >= 0 && Exchange(conns[0], "", replies[2]);
+  ok[3] = Childless(pid);
+  kill(pid, SIGTERM);
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  unlink(path);
+
+  ASSERT_TRUE(ok[0]);
+  ASSERT_EQ(0, strcmp("42", replies[0]));
+  ASSERT_TRUE(ok[1]);
+  ASSERT_EQ(0, strcmp("-7", replies[1]));
+  ASSERT_TRUE(ok[2]);
+  ASSERT_EQ(0, strncmp("Trap: ", replies[2], 6));
+  ASSERT_TRUE(ok[3]);
+  return NULL;
+}
+
+#endif /* TEST */
@@ -0,0 +1,17 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include <stdbool.h>
+
+#include "risc.h"
+
+/* A program that has been loaded once can be run any number of times as a
+ * server listening on a Unix socket. Every connection is handed to a child
+ * process, forked from the server with the VM ready to run (its memory laid
+ * out, code decoded and translated), which is shared copy-on-write. The child
+ * runs the program with stdin, stdout and stderr bound to the connection.
+ */
+
+extern bool    Server_Run(risc_vm_t * const, const char * const);
+
+#endif /* SERVER_H_ */
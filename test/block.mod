@@ -0,0 +1,28 @@
+MODULE block;
+
+  VAR
+    buf : ARRAY 4 OF CHAR;
+    n, blocks, total : INTEGER;
+
+  (* Test reading the input in blocks, up to its end and past it *)
+  BEGIN
+    blocks := 0;
+    total := 0;
+    ReadBlock(buf, n);
+    WHILE n > 0 DO
+      Write(n);
+      Write(":");
+      WriteBlock(buf, n);
+      Write(" ");
+      blocks := blocks + 1;
+      total := total + n;
+      ReadBlock(buf, n)
+    END;
+    ReadBlock(buf, n);
+    Write(blocks);
+    Write(" ");
+    Write(total);
+    Write(" ");
+    Write(n)
+
+END block.
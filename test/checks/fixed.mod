@@ -0,0 +1,18 @@
+MODULE fixed;
+
+  VAR
+    a : ARRAY 10 OF INTEGER;
+    i, n, s : INTEGER;
+
+  (* Test indices kept in range by the bounds of FOR loops, or not *)
+  BEGIN
+    Read(n);
+    FOR i := 0 TO LEN(a) - 1 DO a[i] := i END;
+    s := 0;
+    FOR i := 9 TO 0 BY -1 DO s := s + a[i] END;
+    FOR i := 0 TO 10 DO
+      IF i < n THEN s := s + a[i] END
+    END;
+    Write(s)
+
+END fixed.
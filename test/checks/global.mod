@@ -0,0 +1,19 @@
+MODULE global;
+
+  VAR
+    a : ARRAY 10 OF INTEGER;
+    g, n : INTEGER;
+
+  PROCEDURE Skip;
+    BEGIN
+      g := g + n
+    END Skip;
+
+  (* Test a global loop variable changed by a procedure called in the loop *)
+  BEGIN
+    Read(n);
+    FOR g := 0 TO 9 DO a[g] := 1 END;
+    FOR g := 0 TO 9 DO Skip; a[g] := 2 END;
+    Write(a[0] + a[9])
+
+END global.
@@ -0,0 +1,19 @@
+MODULE mask;
+
+  VAR
+    a : ARRAY 8 OF INTEGER;
+    b : ARRAY 256 OF INTEGER;
+    c : ARRAY 4 OF CHAR;
+    i, n, s : INTEGER;
+
+  (* Test indices kept in range by masks and byte loads, or not *)
+  BEGIN
+    Read(n);
+    FOR i := 0 TO 7 DO a[i] := i END;
+    c := "abc";
+    b[ORD("b")] := 10;
+    s := a[n MOD 8] + b[ORD(c[n MOD 4])];
+    s := s + a[n MOD 16];
+    Write(s)
+
+END mask.
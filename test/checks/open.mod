@@ -0,0 +1,43 @@
+MODULE open;
+
+  VAR
+    a, b : ARRAY 5 OF INTEGER;
+    n : INTEGER;
+
+  (* Test indices kept in range by the length of an open array *)
+  PROCEDURE Sum(x : ARRAY OF INTEGER) : INTEGER;
+    VAR
+      i, s : INTEGER;
+    BEGIN
+      s := 0;
+      FOR i := 0 TO LEN(x) - 1 DO s := s + x[i] END
+    RETURN s
+  END Sum;
+
+  (* Test indices of another array, which may be shorter *)
+  PROCEDURE Copy(VAR x : ARRAY OF INTEGER; y : ARRAY OF INTEGER);
+    VAR
+      i : INTEGER;
+    BEGIN
+      FOR i := LEN(x) - 1 TO 0 BY -1 DO x[i] := 2 * y[i] END
+    END Copy;
+
+  (* Test a loop up to the length itself *)
+  PROCEDURE Fill(VAR x : ARRAY OF INTEGER; n : INTEGER);
+    VAR
+      i : INTEGER;
+    BEGIN
+      FOR i := 0 TO LEN(x) DO
+        IF i < n THEN x[i] := i END
+      END
+    END Fill;
+
+  BEGIN
+    Read(n);
+    Fill(a, n);
+    Copy(b, a);
+    Write(Sum(a));
+    Write(" ");
+    Write(Sum(b))
+
+END open.
@@ -10,5 +10,7 @@ MODULE io;
     Write("w");
     Write(0);
     WriteLn("rld!");
+    WriteBlock(x, 4);
+    WriteLn("!");
 
 END io.
@@ -0,0 +1,17 @@
+MODULE literals;
+
+  VAR
+    a : ARRAY 2 OF CHAR;
+    s : ARRAY 6 OF CHAR;
+    c : CHAR;
+
+  (* Test a literal used both as a string and as a CHAR *)
+  BEGIN
+    a := "x";
+    c := "x";
+    s := "hello";
+    Write(a[0]);
+    Write(c);
+    Write(s[0])
+
+END literals.
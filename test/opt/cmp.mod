@@ -0,0 +1,15 @@
+MODULE cmp;
+
+  VAR
+    b, c : BOOLEAN;
+    n : INTEGER;
+
+  (* Test comparisons with 0 made redundant by the loads of b and c *)
+  BEGIN
+    n := 7;
+    b := ODD(n);
+    c := n > 9;
+    IF b THEN Write(1) ELSE Write(0) END;
+    IF c THEN Write(1) ELSE Write(0) END
+
+END cmp.
@@ -0,0 +1,11 @@
+MODULE copy;
+
+  (* Test reading parameters from the registers they are kept in *)
+  PROCEDURE Twice(x : INTEGER) : INTEGER;
+  RETURN 2 * x
+  END Twice;
+
+  BEGIN
+    Write(Twice(21))
+
+END copy.
@@ -0,0 +1,12 @@
+MODULE cycle;
+
+  VAR
+    i : INTEGER;
+
+  (* Test leaving jumps alone that form a cycle *)
+  BEGIN
+    i := 0;
+    IF i > 0 THEN REPEAT WHILE FALSE DO INC(i) END UNTIL FALSE END;
+    Write(i)
+
+END cycle.
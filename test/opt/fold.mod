@@ -0,0 +1,16 @@
+MODULE fold;
+
+  (* Test folding moves into the instructions computing their sources *)
+  PROCEDURE Sum(n : INTEGER) : INTEGER;
+    VAR
+      i, s : INTEGER;
+    BEGIN
+      s := 0;
+      FOR i := 1 TO n DO s := s + i END
+    RETURN s
+  END Sum;
+
+  BEGIN
+    Write(Sum(10))
+
+END fold.
@@ -0,0 +1,16 @@
+MODULE jump;
+
+  VAR
+    a, b, x : INTEGER;
+
+  (* Test threading jumps to jumps *)
+  BEGIN
+    a := 1; b := 1;
+    IF a > 0 THEN
+      IF b > 0 THEN x := 1 ELSE x := 2 END
+    ELSE
+      x := 3
+    END;
+    Write(x)
+
+END jump.
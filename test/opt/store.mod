@@ -0,0 +1,12 @@
+MODULE store;
+
+  VAR
+    x, y : INTEGER;
+
+  (* Test forwarding stored values to loads of the same variable *)
+  BEGIN
+    x := 20;
+    y := x * 2 + 2;
+    Write(y)
+
+END store.
@@ -0,0 +1,24 @@
+MODULE frame;
+
+  PROCEDURE Inc(VAR x : INTEGER; n : INTEGER);
+    BEGIN
+      x := x + n
+    END Inc;
+
+  (* Test locals passed as VAR parameters, or whose addresses are taken *)
+  PROCEDURE Locals(n : INTEGER) : INTEGER;
+    VAR
+      x, y, z : INTEGER;
+    BEGIN
+      x := n; y := 0; z := 1;
+      Inc(x, 2);
+      Inc(n, x);
+      SYSTEM.GET(SYSTEM.ADR(x), y);
+      SYSTEM.PUT(SYSTEM.ADR(z), y + 1)
+    RETURN 1000 * n + 100 * x + 10 * y + z
+  END Locals;
+
+  BEGIN
+    Write(Locals(1))
+
+END frame.
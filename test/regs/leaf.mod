@@ -0,0 +1,33 @@
+MODULE leaf;
+
+  VAR
+    n : INTEGER;
+
+  (* Test a leaf procedure without a frame *)
+  PROCEDURE Add(x, y : INTEGER) : INTEGER;
+  RETURN x + y
+  END Add;
+
+  (* Test a leaf procedure with a frame, kept for an array *)
+  PROCEDURE Spin(n : INTEGER) : INTEGER;
+    VAR
+      a : ARRAY 4 OF INTEGER;
+      i, s : INTEGER;
+    BEGIN
+      s := 0;
+      FOR i := 0 TO 3 DO a[i] := i END;
+      FOR i := 1 TO n DO s := (s + a[i MOD 4]) MOD 1000 END
+    RETURN s
+  END Spin;
+
+  (* Test calling a leaf procedure *)
+  PROCEDURE Outer(n : INTEGER) : INTEGER;
+  RETURN Add(Spin(n), 1)
+  END Outer;
+
+  BEGIN
+    Read(n);
+    Write(Add(1, 2));
+    WriteLn(Outer(n))
+
+END leaf.
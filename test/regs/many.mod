@@ -0,0 +1,27 @@
+MODULE many;
+
+  VAR
+    r : INTEGER;
+
+  PROCEDURE Add(x, y : INTEGER) : INTEGER;
+  RETURN x + y
+  END Add;
+
+  (* Test more locals than there are registers to keep them in *)
+  PROCEDURE Many(n : INTEGER) : INTEGER;
+    VAR
+      a, b, c, d, e, f, g, h, i, j, k, l, m, o : INTEGER;
+    BEGIN
+      a := n; b := a + 1; c := b + 1; d := c + 1; e := d + 1; f := e + 1;
+      g := f + 1; h := g + 1; i := h + 1; j := i + 1; k := j + 1;
+      l := k + 1; m := l + 1; o := m + 1;
+      a := Add(a, o); o := Add(o, b);
+      n := a * b + c * d + e * f + g * h + i * j + k * l + m * o
+    RETURN n
+  END Many;
+
+  BEGIN
+    r := Many(1);
+    Write(r)
+
+END many.
@@ -0,0 +1,35 @@
+MODULE recurse;
+
+  (* Test locals of recursive procedures *)
+  PROCEDURE Fib(n : INTEGER) : INTEGER;
+    VAR
+      a, b : INTEGER;
+    BEGIN
+      IF n < 2 THEN
+        a := n; b := 0
+      ELSE
+        a := Fib(n - 1); b := Fib(n - 2)
+      END
+    RETURN a + b
+  END Fib;
+
+  PROCEDURE Ack(m, n : INTEGER) : INTEGER;
+    VAR
+      r : INTEGER;
+    BEGIN
+      IF m = 0 THEN
+        r := n + 1
+      ELSIF n = 0 THEN
+        r := Ack(m - 1, 1)
+      ELSE
+        r := Ack(m - 1, Ack(m, n - 1))
+      END
+    RETURN r
+  END Ack;
+
+  BEGIN
+    Write(Fib(15));
+    Write(" ");
+    Write(Ack(2, 3))
+
+END recurse.
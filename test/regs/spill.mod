@@ -0,0 +1,40 @@
+MODULE spill;
+
+  VAR
+    r : INTEGER;
+
+  PROCEDURE Sq(x : INTEGER) : INTEGER;
+  RETURN x * x
+  END Sq;
+
+  (* Test locals and operands live across calls *)
+  PROCEDURE Mix(a, b : INTEGER) : INTEGER;
+    VAR
+      c, d : INTEGER;
+    BEGIN
+      c := a + 1;
+      d := Sq(b) + c;
+      c := c * 10 + Sq(d - a) - Sq(Sq(2));
+      a := a + b + c + d
+    RETURN 100 * a + Sq(c MOD 7)
+  END Mix;
+
+  (* Test locals kept in registers, saved around the call in the loop *)
+  PROCEDURE Loop(n : INTEGER) : INTEGER;
+    VAR
+      i, s, t : INTEGER;
+    BEGIN
+      s := 0; t := 0;
+      FOR i := 1 TO n DO
+        s := s + i; t := t + s; s := s + Sq(i); t := t - i
+      END
+    RETURN s * 1000 + t
+  END Loop;
+
+  BEGIN
+    r := Mix(3, 4);
+    Write(r);
+    Write(" ");
+    Write(Loop(10))
+
+END spill.